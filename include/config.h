@@ -0,0 +1,2 @@
+#define HAVE_ATOMIC 1
+#define HAVE_CSTDATOMIC 0
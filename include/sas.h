@@ -365,6 +365,446 @@ public:
   typedef int (create_socket_callback_t)(const char* hostname,
                                          const char* port);
 
+  // Histogram of latencies in nanoseconds.
+  //
+  // Values are recorded into log-linear buckets - each power of two is split
+  // into 2^SUB_BUCKET_BITS equal buckets - so the values reported by
+  // percentile() are accurate to within 12.5%, however wide the range of
+  // values recorded.
+  class Histogram
+  {
+  public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    Histogram();
+
+    void record(uint64_t value, uint64_t count = 1);
+    void merge(const Histogram& other);
+
+    /// Returns a histogram of the values recorded in this histogram since
+    /// the earlier snapshot was taken.  The minimum and maximum of the result
+    /// are only accurate to the resolution of the buckets.
+    Histogram delta(const Histogram& earlier) const;
+
+    inline uint64_t count() const { return _count; }
+    inline uint64_t sum() const { return _sum; }
+    inline uint64_t min() const { return (_count > 0) ? _min : 0; }
+    inline uint64_t max() const { return _max; }
+    inline uint64_t mean() const { return (_count > 0) ? (_sum / _count) : 0; }
+
+    /// Returns the value at the given percentile (0-100) - that is, the
+    /// highest value that falls in the same bucket as the value at that
+    /// percentile.
+    uint64_t percentile(double pct) const;
+
+    inline uint64_t bucket_count(int bucket) const { return _counts[bucket]; }
+    static int bucket(uint64_t value);
+    static uint64_t bucket_lowest(int bucket);
+    static uint64_t bucket_highest(int bucket);
+
+    friend class SASThreadStats;
+
+  private:
+    uint64_t _counts[NUM_BUCKETS];
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _min;
+    uint64_t _max;
+  };
+
+  // Statistics on the time the report_* calls spend in the library, as
+  // returned by SAS::get_stats.  These are only collected if enabled in the
+  // Options passed to SAS::init.
+  struct Stats
+  {
+    /// Time spent building messages.
+    Histogram serialize;
+
+    /// Time spent compressing parameters (add_compressed_param).
+    Histogram compress;
+
+    /// Time spent adding messages to the send queue (including waiting for
+    /// the queue lock).
+    Histogram enqueue;
+  };
+
+  // Counters for the connection to SAS, as returned by
+  // SAS::get_connection_stats.  All except queue_depth are cumulative since
+  // SAS::init.  If there are several connections the counters are summed
+  // across them, except queue_high_water which is the highest of any one
+  // connection's queue.
+  struct ConnectionStats
+  {
+    ConnectionStats() :
+      enqueued(0),
+      dropped_queue_full(0),
+      dropped_queue_closed(0),
+      dropped_send_failed(0),
+      messages_sent(0),
+      bytes_sent(0),
+      connects(0),
+      reconnects(0),
+      connect_failures(0),
+      send_lockups(0),
+      spilled(0),
+      dropped_spill_full(0),
+      requeued(0),
+      zerocopy_sends(0),
+      zerocopy_copied(0),
+      queue_depth(0),
+      queue_high_water(0)
+    {
+    }
+
+    /// Messages added to the send queue.
+    uint64_t enqueued;
+
+    /// Messages discarded because the send queue was full.
+    uint64_t dropped_queue_full;
+
+    /// Messages discarded because the send queue had been closed (because
+    /// the library was terminating).
+    uint64_t dropped_queue_closed;
+
+    /// Messages discarded because the connection failed while they were
+    /// being sent.  (Only happens when writing to a file:// address - on a
+    /// connection to SAS they are sent again, see requeued.)
+    uint64_t dropped_send_failed;
+
+    /// Messages (excluding heartbeats) written to the connection, and not
+    /// since re-queued.
+    uint64_t messages_sent;
+
+    /// Bytes (including INIT and heartbeat messages) written to the
+    /// connection.
+    uint64_t bytes_sent;
+
+    /// Successful connections to SAS, and how many of those were
+    /// reconnections after the first.
+    uint64_t connects;
+    uint64_t reconnects;
+
+    /// Failed attempts to connect to SAS.
+    uint64_t connect_failures;
+
+    /// Connections closed because SAS stopped accepting data for longer than
+    /// the send timeout.
+    uint64_t send_lockups;
+
+    /// Messages written to the spill file (see Options::spill_file), and
+    /// messages discarded because the spill file was full.
+    uint64_t spilled;
+    uint64_t dropped_spill_full;
+
+    /// Messages that had been written to a connection that then failed, but
+    /// that SAS hadn't acknowledged, so were queued to be sent again after
+    /// reconnecting.
+    uint64_t requeued;
+
+    /// Writes to SAS that were made with MSG_ZEROCOPY (see
+    /// Options::zerocopy_min_bytes), and how many of those the kernel
+    /// copied anyway (as it does on loopback, or if the NIC can't send
+    /// directly from user memory).
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_copied;
+
+    /// Messages currently on the send queue, and the most there have been.
+    uint64_t queue_depth;
+    uint64_t queue_high_water;
+  };
+
+  // Options controlling the behaviour of the SAS client library.  The
+  // defaults are suitable for most applications.
+  struct Options
+  {
+    /// How messages are distributed when connecting to more than one SAS.
+    enum struct Distribution
+    {
+      /// Each trail is sent to one SAS, chosen by hashing its trail ID, so
+      /// the load is spread across the connections.
+      ShardByTrail,
+
+      /// Every message is sent to every SAS.
+      Replicate
+    };
+
+    /// Which IP address families may be used to connect to SAS, and which
+    /// is tried first when a SAS address resolves to both.
+    enum struct AddressFamily
+    {
+      /// Use either, in the order returned by the resolver.
+      Any,
+      PreferIPv4,
+      PreferIPv6,
+      IPv4Only,
+      IPv6Only
+    };
+
+    /// How the kernel batches small writes to SAS into TCP segments.
+    enum struct TcpBatching
+    {
+      /// Leave Nagle's algorithm on (the system default).
+      Default,
+
+      /// Send each write immediately (TCP_NODELAY).
+      NoDelay,
+
+      /// Only send full segments (TCP_CORK), pushing out the remainder
+      /// whenever the writer has sent everything it has queued.
+      Cork
+    };
+
+    /// How the writer threads send to SAS.
+    enum struct SendBackend
+    {
+      /// Wait for the socket with epoll, and send batches with sendmsg.
+      Epoll,
+
+      /// Submit each batch, and the waits for the socket and the queue,
+      /// through an io_uring, so a batch takes one system call.  Needs Linux
+      /// 5.11 or later - if io_uring isn't available (or is disabled) the
+      /// Epoll backend is used instead.  Not used for file:// addresses, and
+      /// doesn't support zerocopy sends.
+      IoUring
+    };
+
+    /// The scheduling policy for the writer threads.
+    enum struct SchedPolicy
+    {
+      /// Keep the policy of the thread that called SAS::init.
+      Inherit,
+
+      /// SCHED_OTHER, SCHED_BATCH and SCHED_IDLE, which use the nice level.
+      Other,
+      Batch,
+      Idle,
+
+      /// The real-time policies SCHED_FIFO and SCHED_RR, which use the
+      /// priority (and need CAP_SYS_NICE).
+      Fifo,
+      RoundRobin
+    };
+
+    Options() :
+      stats_enabled(false),
+      stats_log_interval_ms(60000),
+      send_timeout_ms(5000),
+      distribution(Distribution::ShardByTrail),
+      connections_per_address(1),
+      trail_assoc_connection(-1),
+      connect_timeout_ms(5000),
+      dns_refresh_interval_ms(60000),
+      sas_port("6761"),
+      address_family(AddressFamily::Any),
+      spill_file_max_bytes(256 * 1024 * 1024),
+      spill_watermark(50000),
+      capture_file_bytes(64 * 1024 * 1024),
+      heartbeat_interval_ms(1000),
+      tcp_user_timeout_ms(10000),
+      keepalive_interval_ms(5000),
+      send_buffer_bytes(0),
+      tcp_batching(TcpBatching::Default),
+      notsent_lowat_bytes(0),
+      zerocopy_min_bytes(0),
+      send_backend(SendBackend::Epoll),
+      max_queue_depth(100000),
+      min_reconnect_delay_ms(10),
+      max_reconnect_delay_ms(10000),
+      max_pending_bytes(4 * 1024 * 1024),
+      max_batch_msgs(1024),
+      zlib_level(-1),
+      zlib_window_bits(15),
+      zlib_mem_level(9),
+      lz4_acceleration(1),
+      lz4_max_buffer_bytes(131072),
+      trail_sample_rate(1.0),
+      writer_thread_name("sas-writer"),
+      writer_sched_policy(SchedPolicy::Inherit),
+      writer_sched_priority(0),
+      writer_nice(0),
+      application_driven(false)
+    {
+    }
+
+    /// Whether to collect latency statistics on the report_* calls (see
+    /// SAS::get_stats).  This adds a couple of clock reads to each call.
+    bool stats_enabled;
+
+    /// Interval at which to log the latency statistics through the log
+    /// callback (at level SASCLIENT_LOG_STATS), or 0 not to log them.  Only
+    /// used if stats_enabled is set.
+    int stats_log_interval_ms;
+
+    /// How long SAS may stop accepting data for before the connection is
+    /// considered to have locked up, and is closed and reopened.
+    int send_timeout_ms;
+
+    /// How messages are distributed between the SAS addresses, if there are
+    /// several.
+    Distribution distribution;
+
+    /// Number of connections (each with its own writer thread) to open to
+    /// each SAS address.  Trails are sharded between an address's
+    /// connections by trail ID, so each trail's messages stay in order.
+    int connections_per_address;
+
+    /// Which connection trail associations are sent to when they are
+    /// sharded.  By default (-1) an association is sent to the connections
+    /// for both trails.  Otherwise it is the index of a connection (or, when
+    /// replicating, of a connection to each address) that receives all
+    /// associations.
+    int trail_assoc_connection;
+
+    /// How long to wait for a connection to SAS to be established (across
+    /// all of the SAS address's resolved IP addresses).
+    int connect_timeout_ms;
+
+    /// How often the SAS addresses are resolved again in the background.
+    /// Connections (and reconnections) use the most recently resolved
+    /// addresses rather than waiting for DNS.
+    int dns_refresh_interval_ms;
+
+    /// Port to connect to SAS on, for addresses that don't specify one.
+    std::string sas_port;
+
+    /// Which IP address families to connect over.
+    AddressFamily address_family;
+
+    /// File to spill queued messages to when SAS is unreachable or can't
+    /// keep up, so they aren't discarded.  Once the queue holds
+    /// spill_watermark messages, the writer moves queued messages into the
+    /// file, and sends them (in order) once SAS is accepting data again.
+    /// The file is allocated at spill_file_max_bytes when first needed;
+    /// messages that don't fit are discarded.  With several connections,
+    /// ".1", ".2" and so on are appended to the name for the second and
+    /// later connections.  Empty (the default) disables spilling.
+    std::string spill_file;
+    size_t spill_file_max_bytes;
+    unsigned int spill_watermark;
+
+    /// File to record the most recent capture_file_bytes of reported
+    /// messages in, so they can be recovered if the process dies before
+    /// they are sent.  The file is a memory-mapped ring buffer, so recording
+    /// a message is a memory copy.  It can be replayed to SAS with the
+    /// sas_replay tool.  Empty (the default) disables capture.
+    std::string capture_file;
+    size_t capture_file_bytes;
+
+    /// How long a connection can go without sending anything before a
+    /// heartbeat is sent to SAS.  Heartbeats are only sent while the
+    /// connection is idle.  0 disables heartbeats.
+    int heartbeat_interval_ms;
+
+    /// How long data written to SAS can go unacknowledged before the
+    /// connection is dropped by the kernel (TCP_USER_TIMEOUT).  0 leaves the
+    /// system default, which can be many minutes.
+    int tcp_user_timeout_ms;
+
+    /// Interval between TCP keepalive probes on an idle connection to SAS,
+    /// which is dropped after 3 unanswered probes.  0 disables keepalives.
+    int keepalive_interval_ms;
+
+    /// Size of the kernel send buffer for connections to SAS (SO_SNDBUF).
+    /// 0 (the default) leaves the kernel to size it automatically.
+    int send_buffer_bytes;
+
+    /// How writes to SAS are batched into TCP segments.
+    TcpBatching tcp_batching;
+
+    /// Limit on how much unsent data the kernel holds for a connection to
+    /// SAS (TCP_NOTSENT_LOWAT) - beyond it, messages wait on the writer's
+    /// own queue, where they can be spilled or batched.  0 leaves the
+    /// system default.
+    int notsent_lowat_bytes;
+
+    /// Writes to SAS of at least this many bytes are sent with MSG_ZEROCOPY,
+    /// so the kernel sends them straight from the queued messages rather
+    /// than copying them.  Messages are then held until the kernel reports
+    /// it has finished with them.  0 (the default) disables zerocopy, which
+    /// only pays off for large writes.
+    size_t zerocopy_min_bytes;
+
+    /// How the writer threads send to SAS.
+    SendBackend send_backend;
+
+    /// Maximum number of messages each connection's queue holds.  Once it's
+    /// full, further messages are discarded (or, if a spill file is
+    /// configured, the queue is spilled before it gets there).  0 means no
+    /// limit.
+    unsigned int max_queue_depth;
+
+    /// Range of the delay between attempts to connect to SAS, which backs
+    /// off exponentially from the minimum to the maximum while attempts
+    /// fail.
+    int min_reconnect_delay_ms;
+    int max_reconnect_delay_ms;
+
+    /// Limits on how much the writer takes off the queue while waiting for
+    /// SAS to accept data (which stops the queue filling during short
+    /// stalls), and on how many messages it takes off the queue at once.
+    size_t max_pending_bytes;
+    unsigned int max_batch_msgs;
+
+    /// Parameters for zlib compression of message parameters: the level
+    /// (0-9, or -1 for zlib's default), the base two logarithm of the window
+    /// size (9-15), and how much memory to use (1-9).  Larger windows and
+    /// memory levels compress better but use more memory per thread.  When
+    /// the compression options change (through init or reconfigure), each
+    /// thread picks up the new ones the next time it compresses a parameter.
+    /// init and reconfigure reject values outside these ranges.
+    int zlib_level;
+    int zlib_window_bits;
+    int zlib_mem_level;
+
+    /// Parameters for LZ4 compression of message parameters: the
+    /// acceleration (1 compresses best, higher values are faster), and the
+    /// largest output buffer each thread will allocate (at most 1GiB) -
+    /// parameters that don't compress into it are sent empty.
+    int lz4_acceleration;
+    int lz4_max_buffer_bytes;
+
+    /// Fraction (from 0.0 to 1.0) of trails to report.  Trails are chosen by
+    /// hashing their trail IDs, so each trail is either reported in full or
+    /// not at all; events, markers and analytics on the other trails are
+    /// discarded before being serialized.  Trail associations are always
+    /// sent.  Lowering this (with SAS::reconfigure) sheds load during
+    /// overload.
+    double trail_sample_rate;
+
+    /// CPUs to run the writer threads on, so that SAS traffic can be kept
+    /// off the cores doing latency-sensitive work.  Empty (the default)
+    /// lets them run on any CPU.
+    std::vector<int> writer_cpus;
+
+    /// Name given to the writer threads (with each connection's index
+    /// appended), as shown by top and perf.
+    /// Linux truncates thread names to 15 characters.  Empty leaves them
+    /// named after the process.
+    std::string writer_thread_name;
+
+    /// The writer threads' scheduling policy, real-time priority (for Fifo
+    /// and RoundRobin) and nice level (for the others - 0 leaves it
+    /// unchanged).  If a setting can't be applied (usually for lack of
+    /// privilege) a warning is logged and the writer carries on without it.
+    SchedPolicy writer_sched_policy;
+    int writer_sched_priority;
+    int writer_nice;
+
+    /// Run without writer threads, for applications with their own event
+    /// loop.  Reported messages are added straight to the connection's
+    /// pending list (there is no queue between threads), and the
+    /// application does the socket work by calling SAS::poll_once whenever
+    /// the file descriptor from SAS::get_poll_fd is readable, and
+    /// SAS::flush to send what it has reported.  All calls to the library
+    /// must then be made from one thread (or be serialized by the
+    /// application).  Spilling to disk and the io_uring backend aren't
+    /// available in this mode, and while connecting, the first lookup of a
+    /// SAS hostname blocks (use IP addresses to avoid this).
+    bool application_driven;
+  };
+
   /// Initialises the SAS client library.  This call must
   /// complete before any other functions on the API can be called.
   ///
@@ -376,7 +816,19 @@ public:
   /// @param  resource_identifier
   ///     The version of the resource bundle
   /// @param  sas_address
-  ///     Takes a single ipv4 address or domain name.
+  ///     Takes a single IP address or domain name, or a comma-separated
+  ///     list of them.  Each may be followed by ":port" (with IPv6 addresses
+  ///     in square brackets, as in "[::1]:6761") to override
+  ///     Options::sas_port.  Each address gets its own connection, and
+  ///     messages are distributed between them as set in
+  ///     Options::distribution.
+  ///
+  ///     An address of the form "file:///path/to/file" writes the byte
+  ///     stream that would be sent to SAS (including the INIT message) to
+  ///     that file, or to a named pipe at that path, rather than connecting
+  ///     to SAS.  This runs the whole reporting path, so is useful for
+  ///     testing and benchmarking without a SAS server.  The file is
+  ///     truncated at initialization.
   /// @param  log_callback
   ///     Optional Logging callback
   /// @param  socket_callback
@@ -393,11 +845,90 @@ public:
                   sas_log_callback_t* log_callback,
                   create_socket_callback_t* socket_callback = NULL);
 
+  /// Initialises the SAS client library with non-default options.  The
+  /// other parameters are as for the version of SAS::init above.
+  ///
+  /// @param  options
+  ///     Options controlling the behaviour of the library
+  ///
+  static int init(std::string system_name,
+                  const std::string& system_type,
+                  const std::string& resource_identifier,
+                  const std::string& sas_address,
+                  const Options& options,
+                  sas_log_callback_t* log_callback,
+                  create_socket_callback_t* socket_callback = NULL);
+
+  /// Changes the library's configuration while it is running, without
+  /// reconnecting to SAS or discarding queued messages.  Only these options
+  /// take effect - the rest keep the values passed to SAS::init:
+  ///
+  /// -  max_queue_depth.  If a queue holds more than the new maximum, the
+  ///    messages already queued are kept, but new ones are discarded until
+  ///    it drains below the maximum.
+  /// -  trail_sample_rate.
+  /// -  the zlib_* and lz4_* compression options.
+  ///
+  /// @param  options
+  ///     The new options
+  /// @param  sas_address
+  ///     New SAS addresses, in the same form as for SAS::init, or empty to
+  ///     keep the current ones.  There must be the same number of addresses
+  ///     as before.  Connections whose address changes reconnect to the new
+  ///     one, and send it the messages the old one hadn't acknowledged
+  ///     along with everything queued.
+  ///
+  /// @returns
+  ///     SAS_INIT_RC_OK    on success
+  ///     SAS_INIT_RC_ERR   if the library isn't initialized or the addresses
+  ///                       are invalid, in which case nothing is changed
+  ///
+  static int reconfigure(const Options& options,
+                         const std::string& sas_address = "");
+
   /// Terminates the connection to the SAS Client Library.
   ///
-  static void term();
+  /// @param  flush_timeout_ms
+  ///     How long to spend sending messages that have already been reported
+  ///     before closing the connections.  Reporting stops immediately, and
+  ///     term returns as soon as everything has been sent (or this time has
+  ///     passed, in which case the remaining messages are discarded).  By
+  ///     default nothing more is sent.
+  ///
+  static void term(int flush_timeout_ms = 0);
+
+  /// Get the file descriptor to poll for the library's work when it is
+  /// application driven (see Options::application_driven).  It becomes
+  /// readable (EPOLLIN) whenever SAS::poll_once has something to do,
+  /// including when its timers expire, so the application needs no timeouts
+  /// of its own.
+  ///
+  /// @returns
+  ///     The file descriptor, or -1 if the library isn't initialized or
+  ///     isn't application driven
+  ///
+  static int get_poll_fd();
+
+  /// Do whatever work is due on the connections to SAS, without blocking:
+  /// connecting, sending pending messages, heartbeats and timeouts.  Does
+  /// nothing unless the library is application driven.
+  ///
+  static void poll_once();
+
+  /// Send the messages reported so far, as far as the sockets will take
+  /// them without blocking.  Does nothing unless the library is application
+  /// driven.
+  ///
+  /// @returns
+  ///     true if everything reported has been written to the sockets, false
+  ///     if some is still pending (in which case SAS::poll_once sends it once
+  ///     the sockets are writable or reconnected)
+  ///
+  static bool flush();
 
-  /// Request a new trail ID.
+  /// Request a new trail ID.  Trail IDs are unique within the process, but
+  /// each thread takes them from its own block, so they aren't issued in
+  /// order across threads.
   ///
   /// @param instance
   ///    Can be used to identify a code location where a particular trail was created.
@@ -459,6 +990,40 @@ public:
 
   static Timestamp get_current_timestamp();
 
+  /// Report a message that has already been serialized - for example, one
+  /// read back from a capture file.  It is sent to SAS as is (so it keeps
+  /// its original timestamp).
+  ///
+  /// @param msg
+  ///    The complete message, including its header.  Must be an event,
+  ///    marker, analytics or trail association message.
+  ///
+  /// @returns
+  ///    false if the message is not one of those types or is malformed
+  ///
+  static bool report_serialized(std::string msg);
+
+  /// Get the latency statistics collected so far.  These are cumulative
+  /// since the library was first initialised with statistics enabled.
+  ///
+  /// @param stats
+  ///    Filled in with the statistics
+  ///
+  static void get_stats(Stats& stats);
+
+  /// Get a snapshot of the counters for the connection to SAS.  This is
+  /// cheap enough to call frequently (for example, from a monitoring
+  /// thread).
+  ///
+  /// @param stats
+  ///    Filled in with the counters
+  ///
+  /// @returns
+  ///    false if there is no connection (the library has not been
+  ///    initialised, or was initialised with SAS disabled)
+  ///
+  static bool get_connection_stats(ConnectionStats& stats);
+
   static sas_log_callback_t* _log_callback;
 
 
@@ -489,8 +1054,17 @@ public:
 
   static std::atomic<TrailId> _next_trail_id;
   class Connection;
-  static Connection* _connection;
+  class ConnectionPool;
+  static ConnectionPool* _connections;
   static create_socket_callback_t* _socket_callback;
+
+  // The options in force, which reconfigure may change while other threads
+  // are reading them, so are accessed through get_options.  The generation
+  // is incremented whenever the compression options change, so that each
+  // thread's compressors know to pick up the new ones.
+  static void get_options(Options& options);
+  static Options _options;
+  static std::atomic<uint32_t> _compression_generation;
 };
 
 #endif
@@ -0,0 +1,207 @@
+/**
+ * @file bench_compress.cpp Throughput and ratio benchmark for the SAS parameter
+ * compressors.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Usage: sas_bench_compress [--threads=N] [--min-time-ms=N]
+//
+// Runs the zlib and LZ4 compressors, with and without a dictionary profile,
+// over the synthetic corpus at a range of payload sizes.  Each case is run
+// on a single thread and then (if --threads is greater than 1) on N threads
+// concurrently.  Every case runs on freshly created threads, so the "cold"
+// column shows the cost of the first call on a thread, which includes
+// creating that thread's compressor (and, for LZ4 with a dictionary, loading
+// the dictionary into it).
+
+#include "sas.h"
+#include "benchutil.h"
+#include "benchcorpus.h"
+
+namespace
+{
+
+const size_t PAYLOAD_SIZES[] = {256, 1024, 4096, 16384};
+const int PAYLOADS_PER_CASE = 16;
+
+struct Result
+{
+  uint64_t calls;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t busy_ns;
+  uint64_t cold_ns;
+};
+
+// Run one case on the specified number of threads and print a line of
+// results.
+void run_case(const char* algorithm_name,
+              const SAS::Profile* profile,
+              SAS::Profile::Algorithm algorithm,
+              SasBench::PayloadType type,
+              const std::vector<std::string>& payloads,
+              int num_threads,
+              uint64_t min_time_ns)
+{
+  std::vector<Result> results(num_threads);
+
+  SasBench::ThreadGroup group(num_threads, [&](int index)
+  {
+    Result& result = results[index];
+    memset(&result, 0, sizeof(result));
+
+    // Time the first call separately - this is where the per-thread
+    // compressor state gets built.
+    uint64_t start = SasBench::now_ns();
+    SAS::Compressor* compressor = SAS::Compressor::get(algorithm);
+    std::string compressed = compressor->compress(payloads[0], profile);
+    result.cold_ns = SasBench::now_ns() - start;
+
+    start = SasBench::now_ns();
+    uint64_t elapsed = 0;
+    size_t next = 0;
+    while (elapsed < min_time_ns)
+    {
+      // Check the clock every batch of calls rather than every call.
+      for (int ii = 0; ii < 64; ++ii)
+      {
+        const std::string& in = payloads[next];
+        next = (next + 1) % payloads.size();
+        compressed = SAS::Compressor::get(algorithm)->compress(in, profile);
+        result.bytes_in += in.length();
+        result.bytes_out += compressed.length();
+        ++result.calls;
+      }
+      elapsed = SasBench::now_ns() - start;
+    }
+    result.busy_ns = elapsed;
+  });
+  uint64_t wall_ns = group.run();
+
+  Result total;
+  memset(&total, 0, sizeof(total));
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    total.calls += results[ii].calls;
+    total.bytes_in += results[ii].bytes_in;
+    total.bytes_out += results[ii].bytes_out;
+    total.busy_ns += results[ii].busy_ns;
+    total.cold_ns += results[ii].cold_ns;
+  }
+
+  printf("%-9s %-10s %7lu %4d %10.1f %10.0f %10.0f %7.3f\n",
+         algorithm_name,
+         SasBench::payload_type_name(type),
+         payloads[0].length(),
+         num_threads,
+         (total.bytes_in / 1e6) / (wall_ns / 1e9),
+         (double)total.busy_ns / total.calls,
+         (double)total.cold_ns / num_threads,
+         (double)total.bytes_out / total.bytes_in);
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  int num_threads = SasBench::get_arg(argc, argv, "threads", 4);
+  uint64_t min_time_ns = SasBench::get_arg(argc, argv, "min-time-ms", 200) * 1000000ull;
+
+  // Profiles must outlive the compressors (which cache state keyed on the
+  // profile's address), so create them all up front.
+  std::vector<SAS::Profile*> zlib_dict_profiles;
+  std::vector<SAS::Profile*> lz4_dict_profiles;
+  SAS::Profile lz4_profile(SAS::Profile::Algorithm::LZ4);
+  for (int type = SasBench::SIP; type <= SasBench::JSON; ++type)
+  {
+    std::string dict = SasBench::dictionary((SasBench::PayloadType)type);
+    zlib_dict_profiles.push_back(new SAS::Profile(dict, SAS::Profile::Algorithm::ZLIB));
+    lz4_dict_profiles.push_back(new SAS::Profile(dict, SAS::Profile::Algorithm::LZ4));
+  }
+
+  printf("%-9s %-10s %7s %4s %10s %10s %10s %7s\n",
+         "algorithm", "payload", "size", "thr", "MB/s", "ns/call", "cold ns", "ratio");
+
+  for (int type = SasBench::SIP; type <= SasBench::JSON; ++type)
+  {
+    for (size_t ii = 0; ii < sizeof(PAYLOAD_SIZES) / sizeof(PAYLOAD_SIZES[0]); ++ii)
+    {
+      std::vector<std::string> payloads =
+        SasBench::corpus((SasBench::PayloadType)type, PAYLOAD_SIZES[ii], PAYLOADS_PER_CASE);
+
+      struct
+      {
+        const char* name;
+        const SAS::Profile* profile;
+        SAS::Profile::Algorithm algorithm;
+      } cases[] =
+      {
+        {"zlib", NULL, SAS::Profile::Algorithm::ZLIB},
+        {"zlib+dict", zlib_dict_profiles[type], SAS::Profile::Algorithm::ZLIB},
+        {"lz4", &lz4_profile, SAS::Profile::Algorithm::LZ4},
+        {"lz4+dict", lz4_dict_profiles[type], SAS::Profile::Algorithm::LZ4},
+      };
+
+      for (size_t jj = 0; jj < sizeof(cases) / sizeof(cases[0]); ++jj)
+      {
+        run_case(cases[jj].name,
+                 cases[jj].profile,
+                 cases[jj].algorithm,
+                 (SasBench::PayloadType)type,
+                 payloads,
+                 1,
+                 min_time_ns);
+
+        if (num_threads > 1)
+        {
+          run_case(cases[jj].name,
+                   cases[jj].profile,
+                   cases[jj].algorithm,
+                   (SasBench::PayloadType)type,
+                   payloads,
+                   num_threads,
+                   min_time_ns);
+        }
+      }
+    }
+  }
+
+  for (size_t ii = 0; ii < zlib_dict_profiles.size(); ++ii)
+  {
+    delete zlib_dict_profiles[ii];
+    delete lz4_dict_profiles[ii];
+  }
+
+  return 0;
+}
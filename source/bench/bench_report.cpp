@@ -0,0 +1,494 @@
+/**
+ * @file bench_report.cpp End-to-end reporting throughput benchmark against a
+ * local fake SAS server.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Usage: sas_bench_report [--threads=N] [--connections=N] [--duration-ms=N]
+//                         [--rate=N] [--sip-size=N] [--compress] [--stats]
+//                         [--perf] [--file=PATH] [--sndbuf=N]
+//                         [--tcp-batching=default|nodelay|cork]
+//                         [--notsent-lowat=N] [--zerocopy=N]
+//                         [--send-backend=epoll|io_uring]
+//                         [--writer-cpus=N,N,...]
+//
+// Starts a fake SAS server on the loopback interface, initializes the
+// library to report to it, and then drives SAS::report_event and
+// SAS::report_marker from N producer threads for the specified duration.
+// Each producer repeatedly reports a call-like transaction: a new trail,
+// start and Call-ID markers, a pair of events carrying a SIP message (of
+// --sip-size bytes, optionally compressed), a small event with only static
+// parameters and a short string, and an end marker.
+//
+// --connections sets the number of connections (and so writer threads) the
+// library opens, with trails sharded between them.  Each connection goes to
+// its own fake server, so that a single server thread doesn't limit the
+// delivered rate.  The bench_scaling make target runs this with increasing
+// numbers of connections.
+//
+// --rate limits each producer to that many report calls per second (0, the
+// default, means as fast as possible).
+//
+// Reports the latency of the report calls as seen by the producers, the
+// rate at which messages are delivered to the server, the number of
+// messages that never arrived, and the CPU cost per message (excluding the
+// fake server's CPU).
+//
+// --stats enables the library's own latency statistics and prints the
+// breakdown of where the report calls spent their time.
+//
+// --file writes the SAS byte stream to PATH (which may be a named pipe, or
+// /dev/null) using a file:// address instead of sending it to fake servers,
+// so that the delivered rate and CPU cost are those of the library alone.
+//
+// --sndbuf, --tcp-batching, --notsent-lowat and --zerocopy set the
+// corresponding socket tuning options (send_buffer_bytes, tcp_batching,
+// notsent_lowat_bytes and zerocopy_min_bytes), so their effect on the
+// delivered rate and CPU cost can be compared.  The bench_sockopts make
+// target runs through a set of configurations.
+//
+// --send-backend selects how the library's writer threads send (see
+// SAS::Options::send_backend).  The bench_backends make target compares
+// them.
+//
+// --writer-cpus pins the library's writer threads to the listed CPUs (see
+// SAS::Options::writer_cpus), for example to keep them apart from the
+// producers.
+//
+// --perf counts cache misses (and instructions) on the producer threads
+// using the hardware performance counters, and reports them per report
+// call.  This shows up contention on cache lines shared between producers
+// and the writer thread, so run it with several threads on a multi-core
+// machine.
+
+#include "sas.h"
+#include "benchutil.h"
+#include "benchcorpus.h"
+#include "fakesas.h"
+
+namespace
+{
+
+const int REPORTS_PER_TRANSACTION = 6;
+const size_t MAX_SAMPLES_PER_THREAD = 4 * 1024 * 1024;
+
+// The fake servers, and the next one to connect to.
+std::vector<SasTest::FakeSas*> fake_sas;
+std::atomic<unsigned int> next_server(0);
+
+void log_callback(SAS::sas_log_level_t level,
+                  int32_t log_id_len,
+                  unsigned char* log_id,
+                  int32_t sas_ip_len,
+                  unsigned char* sas_ip,
+                  int32_t msg_len,
+                  unsigned char* msg)
+{
+  if (level <= SAS::SASCLIENT_LOG_WARNING)
+  {
+    fprintf(stderr, "%.*s\n", msg_len, msg);
+  }
+}
+
+// Connect to a fake SAS server regardless of the address the library was
+// configured with, spreading the connections across the servers.
+int create_socket(const char* hostname, const char* port)
+{
+  SasTest::FakeSas* server = fake_sas[next_server++ % fake_sas.size()];
+  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server->port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    ::close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+struct ProducerResult
+{
+  uint64_t reports;
+  std::vector<uint64_t> latencies;
+};
+
+// Time a single report call, recording the latency.
+#define TIMED(RESULT, CALL)                                                    \
+  {                                                                            \
+    uint64_t start_ns = SasBench::now_ns();                                    \
+    CALL;                                                                      \
+    if ((RESULT).latencies.size() < MAX_SAMPLES_PER_THREAD)                    \
+    {                                                                          \
+      (RESULT).latencies.push_back(SasBench::now_ns() - start_ns);             \
+    }                                                                          \
+    ++(RESULT).reports;                                                        \
+  }
+
+void produce(ProducerResult& result,
+             const std::vector<std::string>& sip_msgs,
+             bool compress,
+             uint64_t duration_ns,
+             uint64_t rate)
+{
+  static SAS::Profile sip_profile(SasBench::sip_dictionary());
+
+  result.reports = 0;
+  result.latencies.reserve(MAX_SAMPLES_PER_THREAD);
+
+  uint64_t start = SasBench::now_ns();
+  uint64_t now = start;
+  size_t next = 0;
+  while (now - start < duration_ns)
+  {
+    const std::string& sip_msg = sip_msgs[next];
+    next = (next + 1) % sip_msgs.size();
+
+    SAS::TrailId trail = SAS::new_trail(1);
+
+    SAS::Marker start_marker(trail, MARKER_ID_START, 1);
+    TIMED(result, SAS::report_marker(start_marker));
+
+    SAS::Marker call_id(trail, MARKER_ID_SIP_CALL_ID, 2);
+    call_id.add_var_param(sip_msg.substr(sip_msg.find("Call-ID: ") + 9, 41));
+    TIMED(result, SAS::report_marker(call_id, SAS::Marker::Scope::Trace));
+
+    for (int ii = 0; ii < 2; ++ii)
+    {
+      SAS::Event rx(trail, 0x000001 + ii, 3);
+      rx.add_static_param(5060);
+      rx.add_static_param(ii);
+      rx.add_var_param("10.0.0.1");
+      if (compress)
+      {
+        rx.add_compressed_param(sip_msg, &sip_profile);
+      }
+      else
+      {
+        rx.add_var_param(sip_msg);
+      }
+      TIMED(result, SAS::report_event(rx));
+    }
+
+    SAS::Event small(trail, 0x000010, 4);
+    small.add_static_param(200);
+    small.add_static_param(1);
+    small.add_static_param(42);
+    small.add_var_param("sip:+16505550000@example.com");
+    TIMED(result, SAS::report_event(small));
+
+    SAS::Marker end_marker(trail, MARKER_ID_END, 5);
+    TIMED(result, SAS::report_marker(end_marker));
+
+    now = SasBench::now_ns();
+    if (rate > 0)
+    {
+      // Sleep until the next transaction is due.
+      uint64_t due = start + (result.reports * 1000000000ull / rate);
+      if (due > now)
+      {
+        usleep((due - now) / 1000);
+        now = SasBench::now_ns();
+      }
+    }
+  }
+}
+
+void print_histogram(const char* name, const SAS::Histogram& histogram)
+{
+  printf("%-9s count=%lu mean=%luns p50=%luns p99=%luns p99.9=%luns max=%luns\n",
+         name,
+         histogram.count(),
+         histogram.mean(),
+         histogram.percentile(50),
+         histogram.percentile(99),
+         histogram.percentile(99.9),
+         histogram.max());
+}
+
+// Totals across the fake servers (or, when writing to a file, as counted by
+// the library).
+uint64_t data_messages()
+{
+  if (fake_sas.empty())
+  {
+    SAS::ConnectionStats stats;
+    SAS::get_connection_stats(stats);
+    return stats.messages_sent;
+  }
+
+  uint64_t total = 0;
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    total += fake_sas[ii]->data_messages();
+  }
+  return total;
+}
+
+uint64_t server_cpu_ns()
+{
+  uint64_t total = 0;
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    total += fake_sas[ii]->cpu_ns();
+  }
+  return total;
+}
+
+uint64_t server_bytes()
+{
+  if (fake_sas.empty())
+  {
+    SAS::ConnectionStats stats;
+    SAS::get_connection_stats(stats);
+    return stats.bytes_sent;
+  }
+
+  uint64_t total = 0;
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    total += fake_sas[ii]->bytes();
+  }
+  return total;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  int num_threads = SasBench::get_arg(argc, argv, "threads", 4);
+  int num_connections = SasBench::get_arg(argc, argv, "connections", 1);
+  uint64_t duration_ns = SasBench::get_arg(argc, argv, "duration-ms", 2000) * 1000000ull;
+  uint64_t rate = SasBench::get_arg(argc, argv, "rate", 0);
+  size_t sip_size = SasBench::get_arg(argc, argv, "sip-size", 1024);
+  bool compress = SasBench::get_flag(argc, argv, "compress");
+  std::string file = SasBench::get_str_arg(argc, argv, "file", "");
+
+  SAS::Options options;
+  options.stats_enabled = SasBench::get_flag(argc, argv, "stats");
+  options.connections_per_address = num_connections;
+  options.send_buffer_bytes = SasBench::get_arg(argc, argv, "sndbuf", 0);
+  options.notsent_lowat_bytes = SasBench::get_arg(argc, argv, "notsent-lowat", 0);
+  options.zerocopy_min_bytes = SasBench::get_arg(argc, argv, "zerocopy", 0);
+  std::string batching = SasBench::get_str_arg(argc, argv, "tcp-batching", "default");
+  if (batching == "nodelay")
+  {
+    options.tcp_batching = SAS::Options::TcpBatching::NoDelay;
+  }
+  else if (batching == "cork")
+  {
+    options.tcp_batching = SAS::Options::TcpBatching::Cork;
+  }
+  else if (batching != "default")
+  {
+    fprintf(stderr, "Unknown --tcp-batching %s\n", batching.c_str());
+    return 1;
+  }
+  std::string backend = SasBench::get_str_arg(argc, argv, "send-backend", "epoll");
+  if (backend == "io_uring")
+  {
+    options.send_backend = SAS::Options::SendBackend::IoUring;
+  }
+  else if (backend != "epoll")
+  {
+    fprintf(stderr, "Unknown --send-backend %s\n", backend.c_str());
+    return 1;
+  }
+  std::string writer_cpus = SasBench::get_str_arg(argc, argv, "writer-cpus", "");
+  for (size_t pos = 0; pos < writer_cpus.length(); )
+  {
+    size_t end = writer_cpus.find(',', pos);
+    if (end == std::string::npos)
+    {
+      end = writer_cpus.length();
+    }
+    options.writer_cpus.push_back(atoi(writer_cpus.substr(pos, end - pos).c_str()));
+    pos = end + 1;
+  }
+
+  for (int ii = 0; (ii < num_connections) && (file.empty()); ++ii)
+  {
+    fake_sas.push_back(new SasTest::FakeSas());
+    if (!fake_sas.back()->start())
+    {
+      fprintf(stderr, "Failed to start fake SAS server\n");
+      return 1;
+    }
+  }
+
+  SAS::init("bench",
+            "bench",
+            "org.projectclearwater.20151201",
+            file.empty() ? "127.0.0.1" : "file://" + file,
+            options,
+            &log_callback,
+            &create_socket);
+
+  // Wait for the library to connect so we don't measure connection setup.
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    if (!fake_sas[ii]->wait_for_inits(1, 5000))
+    {
+      fprintf(stderr, "Library failed to connect to fake SAS server\n");
+      return 1;
+    }
+  }
+
+  std::vector<std::string> sip_msgs = SasBench::corpus(SasBench::SIP, sip_size, 16);
+  std::vector<ProducerResult> results(num_threads);
+
+  uint64_t start_cpu = SasBench::process_cpu_ns();
+  uint64_t start_server_cpu = server_cpu_ns();
+  uint64_t start = SasBench::now_ns();
+
+  // The producer threads inherit the performance counters from this thread.
+  bool perf = SasBench::get_flag(argc, argv, "perf");
+  SasBench::PerfCounters counters;
+  if (perf)
+  {
+    counters.start();
+  }
+
+  SasBench::ThreadGroup group(num_threads, [&](int index)
+  {
+    produce(results[index], sip_msgs, compress, duration_ns, rate);
+  });
+  uint64_t produce_ns = group.run();
+
+  if (perf)
+  {
+    counters.stop();
+  }
+
+  uint64_t reports = 0;
+  std::vector<uint64_t> latencies;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    reports += results[ii].reports;
+    latencies.insert(latencies.end(),
+                     results[ii].latencies.begin(),
+                     results[ii].latencies.end());
+  }
+
+  // Wait for the queue to drain - that is, until everything has been
+  // delivered, or nothing more has arrived for half a second.
+  uint64_t delivered = data_messages();
+  uint64_t last_progress = SasBench::now_ns();
+  uint64_t last_delivery = last_progress;
+  while ((delivered < reports) &&
+         (SasBench::now_ns() - last_progress < 500000000ull))
+  {
+    usleep(1000);
+    uint64_t now_delivered = data_messages();
+    if (now_delivered != delivered)
+    {
+      delivered = now_delivered;
+      last_progress = SasBench::now_ns();
+      last_delivery = last_progress;
+    }
+  }
+  uint64_t deliver_ns = last_delivery - start;
+
+  uint64_t cpu_ns = (SasBench::process_cpu_ns() - start_cpu) -
+                    (server_cpu_ns() - start_server_cpu);
+
+  SAS::ConnectionStats conn_stats;
+  SAS::get_connection_stats(conn_stats);
+  uint64_t bytes = server_bytes();
+
+  SAS::term();
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    fake_sas[ii]->stop();
+  }
+
+  printf("threads:               %d\n", num_threads);
+  printf("connections:           %d\n", num_connections);
+  printf("reports:               %lu\n", reports);
+  printf("produce rate:          %.0f msgs/s\n", reports / (produce_ns / 1e9));
+  printf("delivered:             %lu\n", delivered);
+  printf("delivered rate:        %.0f msgs/s\n", delivered / (deliver_ns / 1e9));
+  printf("dropped:               %lu (%.2f%%)\n",
+         reports - delivered,
+         (reports > 0) ? (100.0 * (reports - delivered) / reports) : 0.0);
+  printf("  queue full:          %lu\n", conn_stats.dropped_queue_full);
+  printf("  send failed:         %lu\n", conn_stats.dropped_send_failed);
+  printf("queue high water:      %lu\n", conn_stats.queue_high_water);
+  printf("bytes delivered:       %lu\n", bytes);
+  printf("zerocopy sends:        %lu (%lu copied)\n",
+         conn_stats.zerocopy_sends,
+         conn_stats.zerocopy_copied);
+  printf("cpu per message:       %.0f ns\n", (double)cpu_ns / std::max(reports, (uint64_t)1));
+  printf("report latency p50:    %lu ns\n", SasBench::percentile(latencies, 50));
+  printf("report latency p90:    %lu ns\n", SasBench::percentile(latencies, 90));
+  printf("report latency p99:    %lu ns\n", SasBench::percentile(latencies, 99));
+  printf("report latency p99.9:  %lu ns\n", SasBench::percentile(latencies, 99.9));
+  printf("report latency max:    %lu ns\n", SasBench::percentile(latencies, 100));
+
+  if (perf)
+  {
+    for (int ii = 0; ii < SasBench::PerfCounters::NUM_COUNTERS; ++ii)
+    {
+      SasBench::PerfCounters::Counter counter = (SasBench::PerfCounters::Counter)ii;
+      if (counters.supported(counter))
+      {
+        printf("%-22s %.2f per report\n",
+               (std::string(SasBench::PerfCounters::name(counter)) + ":").c_str(),
+               (double)counters.read(counter) / std::max(reports, (uint64_t)1));
+      }
+      else
+      {
+        printf("%-22s not supported\n",
+               (std::string(SasBench::PerfCounters::name(counter)) + ":").c_str());
+      }
+    }
+  }
+
+  if (options.stats_enabled)
+  {
+    SAS::Stats stats;
+    SAS::get_stats(stats);
+    print_histogram("serialize", stats.serialize);
+    print_histogram("compress", stats.compress);
+    print_histogram("enqueue", stats.enqueue);
+  }
+
+  for (size_t ii = 0; ii < fake_sas.size(); ++ii)
+  {
+    delete fake_sas[ii];
+  }
+  return 0;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file bench_spill.cpp Benchmark of spilling queued messages to disk and
+ * replaying them.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Usage: sas_bench_spill [--file=PATH] [--size-mb=N] [--msg-size=N]
+//                        [--messages=N]
+//
+// Measures how fast messages can be spilled to disk during a SAS outage, and
+// how fast they are replayed once SAS is reachable again.
+//
+// First the spill file itself is timed: --size-mb of messages of --msg-size
+// bytes are appended to a file at --file (default /tmp/sas_bench_spill), and
+// then read back.
+//
+// Then the library is run end to end with spilling enabled.  A fake SAS
+// server is started but connections to it are refused while --messages
+// events are reported, so they are spilled.  The spill rate is how fast the
+// writer moves them to disk.  Connections are then allowed, and the replay
+// rate is how fast the spilled messages are delivered to the server.
+
+#include "sas.h"
+#include "sas_spill.h"
+#include "benchutil.h"
+#include "fakesas.h"
+
+namespace
+{
+
+SasTest::FakeSas* fake_sas = NULL;
+std::atomic<bool> refuse_connections(true);
+
+void log_callback(SAS::sas_log_level_t level,
+                  int32_t log_id_len,
+                  unsigned char* log_id,
+                  int32_t sas_ip_len,
+                  unsigned char* sas_ip,
+                  int32_t msg_len,
+                  unsigned char* msg)
+{
+  if (level <= SAS::SASCLIENT_LOG_ERROR)
+  {
+    fprintf(stderr, "%.*s\n", msg_len, msg);
+  }
+}
+
+// Connect to the fake SAS server, unless connections are being refused.
+int create_socket(const char* hostname, const char* port)
+{
+  if (refuse_connections)
+  {
+    return -1;
+  }
+
+  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(fake_sas->port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    ::close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Build a message of the given size with a valid SAS length header.
+std::string make_msg(size_t size)
+{
+  std::string msg(size, 'x');
+  msg[0] = (char)(size >> 8);
+  msg[1] = (char)(size & 0xff);
+  return msg;
+}
+
+void bench_file(const std::string& path, size_t size_mb, size_t msg_size)
+{
+  size_t file_bytes = size_mb * 1024 * 1024;
+  std::string msg = make_msg(msg_size);
+
+  SASSpillFile spill;
+  uint64_t start = SasBench::now_ns();
+  if (!spill.open(path, file_bytes))
+  {
+    fprintf(stderr, "Failed to open spill file %s\n", path.c_str());
+    return;
+  }
+  uint64_t open_ns = SasBench::now_ns() - start;
+
+  uint64_t msgs = 0;
+  start = SasBench::now_ns();
+  while (spill.append(msg))
+  {
+    ++msgs;
+  }
+  uint64_t append_ns = SasBench::now_ns() - start;
+
+  std::deque<std::string> read_msgs;
+  uint64_t read_count = 0;
+  start = SasBench::now_ns();
+  while (!spill.empty())
+  {
+    spill.read(read_msgs, 4 * 1024 * 1024);
+    read_count += read_msgs.size();
+    read_msgs.clear();
+  }
+  uint64_t read_ns = SasBench::now_ns() - start;
+
+  spill.close();
+  unlink(path.c_str());
+
+  double mb = (double)(msgs * msg_size) / (1024 * 1024);
+  printf("spill file open/allocate: %.1f ms for %lu MB\n", open_ns / 1e6, size_mb);
+  printf("spill file append:        %.0f msgs/s  %.0f MB/s\n",
+         msgs / (append_ns / 1e9), mb / (append_ns / 1e9));
+  printf("spill file read:          %.0f msgs/s  %.0f MB/s (%lu msgs)\n",
+         read_count / (read_ns / 1e9), mb / (read_ns / 1e9), read_count);
+}
+
+void bench_end_to_end(const std::string& path, size_t size_mb, size_t msg_size, int num_msgs)
+{
+  fake_sas = new SasTest::FakeSas();
+  if (!fake_sas->start())
+  {
+    fprintf(stderr, "Failed to start fake SAS server\n");
+    return;
+  }
+
+  SAS::Options options;
+  options.spill_file = path;
+  options.spill_file_max_bytes = size_mb * 1024 * 1024;
+  options.spill_watermark = 1000;
+
+  SAS::init("bench",
+            "bench",
+            "org.projectclearwater.20151201",
+            "127.0.0.1",
+            options,
+            &log_callback,
+            &create_socket);
+
+  std::string param(msg_size > 40 ? msg_size - 40 : 0, 'x');
+  uint64_t start = SasBench::now_ns();
+  for (int ii = 0; ii < num_msgs; ++ii)
+  {
+    SAS::Event event(1, 1, ii);
+    event.add_var_param(param);
+    SAS::report_event(event);
+  }
+  uint64_t produce_ns = SasBench::now_ns() - start;
+
+  SAS::ConnectionStats stats;
+  while (true)
+  {
+    SAS::get_connection_stats(stats);
+    if (stats.spilled + stats.dropped_spill_full + stats.dropped_queue_full +
+          stats.queue_depth >= (uint64_t)num_msgs &&
+        stats.queue_depth < options.spill_watermark)
+    {
+      break;
+    }
+    usleep(100);
+  }
+  uint64_t spill_ns = SasBench::now_ns() - start;
+
+  refuse_connections = false;
+  start = SasBench::now_ns();
+  uint64_t expected = num_msgs - stats.dropped_spill_full - stats.dropped_queue_full;
+  fake_sas->wait_for_data_messages(expected, 60000);
+  uint64_t replay_ns = SasBench::now_ns() - start;
+  uint64_t delivered = fake_sas->data_messages();
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas;
+  unlink(path.c_str());
+
+  printf("reported:                 %d msgs in %.1f ms\n", num_msgs, produce_ns / 1e6);
+  printf("spilled:                  %lu msgs (%lu dropped: %lu queue full, %lu spill full)\n",
+         stats.spilled,
+         stats.dropped_queue_full + stats.dropped_spill_full,
+         stats.dropped_queue_full,
+         stats.dropped_spill_full);
+  printf("spill rate:               %.0f msgs/s\n", stats.spilled / (spill_ns / 1e9));
+  printf("replayed:                 %lu msgs\n", delivered);
+  printf("replay rate:              %.0f msgs/s\n", delivered / (replay_ns / 1e9));
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  std::string path = SasBench::get_str_arg(argc, argv, "file", "/tmp/sas_bench_spill");
+  size_t size_mb = SasBench::get_arg(argc, argv, "size-mb", 256);
+  size_t msg_size = SasBench::get_arg(argc, argv, "msg-size", 512);
+  int num_msgs = SasBench::get_arg(argc, argv, "messages", 200000);
+
+  printf("message size:             %lu bytes\n", msg_size);
+  bench_file(path, size_mb, msg_size);
+  bench_end_to_end(path, size_mb, msg_size, num_msgs);
+
+  return 0;
+}
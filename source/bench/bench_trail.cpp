@@ -0,0 +1,125 @@
+/**
+ * @file bench_trail.cpp Benchmark of trail ID allocation against thread count.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+// Usage: sas_bench_trail [--threads=N] [--min-time-ms=N]
+//
+// Calls SAS::new_trail as fast as possible on 1, 2, 4, ... up to N threads
+// concurrently, and reports the total rate and the time per call.  For
+// comparison, each thread count is also run allocating IDs one at a time
+// from a single shared atomic counter (which is what new_trail did before
+// it allocated IDs to each thread in blocks), which slows down as the
+// threads contend for the counter's cache line.
+
+#include "sas.h"
+#include "benchutil.h"
+
+namespace
+{
+
+alignas(64) std::atomic<SAS::TrailId> shared_counter(1);
+
+SAS::TrailId shared_new_trail()
+{
+  return shared_counter++;
+}
+
+// Run one case on the specified number of threads and print a line of
+// results.
+void run_case(const char* name,
+              SAS::TrailId (*new_trail)(),
+              int num_threads,
+              uint64_t min_time_ns)
+{
+  std::vector<uint64_t> calls(num_threads);
+  std::vector<uint64_t> busy_ns(num_threads);
+
+  SasBench::ThreadGroup group(num_threads, [&](int index)
+  {
+    uint64_t start = SasBench::now_ns();
+    uint64_t elapsed = 0;
+    uint64_t count = 0;
+    while (elapsed < min_time_ns)
+    {
+      // Check the clock every batch of calls rather than every call.
+      for (int ii = 0; ii < 1024; ++ii)
+      {
+        new_trail();
+      }
+      count += 1024;
+      elapsed = SasBench::now_ns() - start;
+    }
+    calls[index] = count;
+    busy_ns[index] = elapsed;
+  });
+  uint64_t wall_ns = group.run();
+
+  uint64_t total_calls = 0;
+  uint64_t total_busy_ns = 0;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    total_calls += calls[ii];
+    total_busy_ns += busy_ns[ii];
+  }
+
+  printf("%-14s %4d %12.1f %10.2f\n",
+         name,
+         num_threads,
+         (total_calls / 1e6) / (wall_ns / 1e9),
+         (double)total_busy_ns / total_calls);
+}
+
+SAS::TrailId sas_new_trail()
+{
+  return SAS::new_trail();
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  int max_threads = SasBench::get_arg(argc, argv, "threads", 8);
+  uint64_t min_time_ns = SasBench::get_arg(argc, argv, "min-time-ms", 200) * 1000000ull;
+
+  printf("%-14s %4s %12s %10s\n", "allocator", "thr", "Mcalls/s", "ns/call");
+
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+  {
+    run_case("new_trail", &sas_new_trail, num_threads, min_time_ns);
+    run_case("shared atomic", &shared_new_trail, num_threads, min_time_ns);
+  }
+
+  return 0;
+}
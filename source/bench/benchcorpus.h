@@ -0,0 +1,319 @@
+/**
+ * @file benchcorpus.h Synthetic SIP, Diameter and JSON payloads used by the
+ * SAS client library benchmarks.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BENCHCORPUS_H__
+#define BENCHCORPUS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// The corpus is generated rather than checked in as binary files.  Each
+// generator is deterministic for a given seed, and different seeds vary the
+// identifiers (Call-IDs, tags, session IDs, subscriber numbers) so that
+// successive payloads resemble a stream of different transactions rather
+// than the same buffer over and over.
+namespace SasBench
+{
+  enum PayloadType
+  {
+    SIP = 0,
+    DIAMETER,
+    JSON
+  };
+
+  inline const char* payload_type_name(PayloadType type)
+  {
+    switch (type)
+    {
+    case SIP:
+      return "sip";
+    case DIAMETER:
+      return "diameter";
+    default:
+      return "json";
+    }
+  }
+
+  // Cheap deterministic pseudo-random number generator (xorshift).
+  class Random
+  {
+  public:
+    Random(uint32_t seed) : _state(seed * 2654435761u + 1) {}
+
+    uint32_t next()
+    {
+      _state ^= _state << 13;
+      _state ^= _state >> 17;
+      _state ^= _state << 5;
+      return _state;
+    }
+
+    std::string digits(int n)
+    {
+      std::string s;
+      for (int ii = 0; ii < n; ++ii)
+      {
+        s += (char)('0' + (next() % 10));
+      }
+      return s;
+    }
+
+    std::string hex(int n)
+    {
+      static const char* hex_chars = "0123456789abcdef";
+      std::string s;
+      for (int ii = 0; ii < n; ++ii)
+      {
+        s += hex_chars[next() % 16];
+      }
+      return s;
+    }
+
+  private:
+    uint32_t _state;
+  };
+
+  // Dictionaries for use in compression profiles.  These hold the text that
+  // recurs in almost every payload of each type.
+  inline std::string sip_dictionary()
+  {
+    return "SIP/2.0 200 OK\r\n"
+           "Via: SIP/2.0/TCP 10.0.0.1:5058;rport;branch=z9hG4bKPj\r\n"
+           "Record-Route: <sip:scscf.example.com:5054;transport=TCP;lr>\r\n"
+           "Call-ID: \r\nFrom: <sip:+1650555@example.com>;tag=\r\n"
+           "To: <sip:+1650555@example.com>\r\nCSeq: 1 INVITE\r\n"
+           "Contact: <sip:+1650555@10.0.0.1:5060;transport=tcp>\r\n"
+           "P-Asserted-Identity: <sip:+1650555@example.com>\r\n"
+           "P-Charging-Vector: icid-value=;orig-ioi=example.com\r\n"
+           "Content-Type: application/sdp\r\nContent-Length: \r\n\r\n"
+           "v=0\r\no=- 0 0 IN IP4 10.0.0.1\r\ns=-\r\nc=IN IP4 10.0.0.1\r\n"
+           "t=0 0\r\nm=audio 4000 RTP/AVP 8 0 101\r\na=rtpmap:8 PCMA/8000\r\n"
+           "a=rtpmap:0 PCMU/8000\r\na=rtpmap:101 telephone-event/8000\r\n";
+  }
+
+  inline std::string diameter_dictionary()
+  {
+    return "hss.example.com;example.com;scscf.example.com;"
+           "sip:scscf.example.com:5054;transport=TCP"
+           "sip:+1650555@example.com+1650555@example.com";
+  }
+
+  inline std::string json_dictionary()
+  {
+    return "{\"event\":\"call_complete\",\"timestamp\":,\"subscriber\":"
+           "\"sip:+1650555@example.com\",\"peer\":\"sip:+1650555@example.com\","
+           "\"duration_ms\":,\"codec\":\"PCMA\",\"result\":\"success\","
+           "\"hops\":[{\"node\":\"sprout\",\"latency_us\":}]}";
+  }
+
+  // Generate a SIP INVITE of (exactly) the target size.  Additional
+  // Record-Route headers and SDP media lines are added as necessary to reach
+  // the target, and the result is truncated to fit.
+  inline std::string sip_payload(size_t target, uint32_t seed)
+  {
+    Random r(seed);
+    std::string subscriber = "+1650555" + r.digits(4);
+    std::string peer = "+1650555" + r.digits(4);
+    std::string s;
+    s.reserve(target + 256);
+    s += "INVITE sip:" + peer + "@example.com SIP/2.0\r\n";
+    s += "Via: SIP/2.0/TCP 10.0.0." + r.digits(2) +
+         ":5058;rport;branch=z9hG4bKPj" + r.hex(32) + "\r\n";
+    s += "Max-Forwards: 70\r\n";
+    s += "From: <sip:" + subscriber + "@example.com>;tag=" + r.hex(16) + "\r\n";
+    s += "To: <sip:" + peer + "@example.com>\r\n";
+    s += "Call-ID: " + r.hex(32) + "@10.0.0.1\r\n";
+    s += "CSeq: " + r.digits(3) + " INVITE\r\n";
+    s += "Contact: <sip:" + subscriber + "@10.0.0.1:5060;transport=tcp>\r\n";
+    s += "P-Asserted-Identity: <sip:" + subscriber + "@example.com>\r\n";
+    s += "P-Charging-Vector: icid-value=" + r.hex(24) +
+         ";orig-ioi=example.com\r\n";
+
+    while (s.length() < target / 2)
+    {
+      s += "Record-Route: <sip:scscf" + r.digits(1) +
+           ".example.com:5054;transport=TCP;lr;billing-role=charge-term>\r\n";
+    }
+
+    s += "Content-Type: application/sdp\r\n\r\n";
+    s += "v=0\r\no=- " + r.digits(10) + " " + r.digits(10) +
+         " IN IP4 10.0.0.1\r\ns=-\r\nc=IN IP4 10.0.0.1\r\nt=0 0\r\n";
+
+    while (s.length() < target)
+    {
+      s += "m=audio " + r.digits(5) + " RTP/AVP 8 0 101\r\n"
+           "a=rtpmap:8 PCMA/8000\r\na=rtpmap:0 PCMU/8000\r\n"
+           "a=rtpmap:101 telephone-event/8000\r\na=fmtp:101 0-15\r\n"
+           "a=candidate:" + r.digits(9) + " 1 udp " + r.digits(10) +
+           " 10.0." + r.digits(2) + "." + r.digits(2) + " " + r.digits(5) +
+           " typ host\r\n";
+    }
+
+    s.resize(target);
+    return s;
+  }
+
+  // Append a Diameter AVP (RFC 6733 section 4.1) to the string.
+  inline void diameter_avp(std::string& s,
+                           uint32_t code,
+                           const std::string& data)
+  {
+    uint32_t len = 8 + data.length();
+    char hdr[8] = {(char)(code >> 24), (char)(code >> 16),
+                   (char)(code >> 8), (char)code,
+                   0x40, (char)(len >> 16), (char)(len >> 8), (char)len};
+    s.append(hdr, sizeof(hdr));
+    s.append(data);
+    s.append((4 - (len % 4)) % 4, '\0');
+  }
+
+  // Generate a Diameter Cx Multimedia-Auth-Answer style message of (exactly)
+  // the target size, padding with repeated SIP-Auth-Data-Item style AVPs.
+  inline std::string diameter_payload(size_t target, uint32_t seed)
+  {
+    Random r(seed);
+    std::string subscriber = "+1650555" + r.digits(4);
+    std::string s;
+    s.reserve(target + 256);
+
+    // Diameter header: version, length (filled in below), flags, command code
+    // 303, application ID 16777216, hop-by-hop and end-to-end IDs.
+    char hdr[20] = {1, 0, 0, 0, 0, 0, 0x01, 0x2f,
+                    0x01, 0x00, 0x00, 0x00};
+    uint32_t hbh = r.next();
+    uint32_t e2e = r.next();
+    memcpy(hdr + 12, &hbh, sizeof(hbh));
+    memcpy(hdr + 16, &e2e, sizeof(e2e));
+    s.append(hdr, sizeof(hdr));
+
+    diameter_avp(s, 263, "scscf.example.com;" + r.digits(10) + ";" + r.digits(8));
+    diameter_avp(s, 264, "hss.example.com");
+    diameter_avp(s, 296, "example.com");
+    diameter_avp(s, 268, std::string("\x00\x00\x07\xd1", 4));
+    diameter_avp(s, 1, subscriber + "@example.com");
+    diameter_avp(s, 601, "sip:" + subscriber + "@example.com");
+    diameter_avp(s, 602, "sip:scscf.example.com:5054;transport=TCP");
+
+    while (s.length() < target)
+    {
+      diameter_avp(s, 612, "SIP Digest" + r.hex(32) + "example.com" + r.hex(16));
+    }
+
+    s.resize(target);
+
+    uint32_t len = s.length();
+    s[1] = (char)(len >> 16);
+    s[2] = (char)(len >> 8);
+    s[3] = (char)len;
+    return s;
+  }
+
+  // Generate a JSON analytics record of (exactly) the target size, padding
+  // with additional per-hop latency entries.
+  inline std::string json_payload(size_t target, uint32_t seed)
+  {
+    Random r(seed);
+    std::string s;
+    s.reserve(target + 256);
+    s += "{\"event\":\"call_complete\",\"timestamp\":" + r.digits(13) +
+         ",\"subscriber\":\"sip:+1650555" + r.digits(4) + "@example.com\"" +
+         ",\"peer\":\"sip:+1650555" + r.digits(4) + "@example.com\"" +
+         ",\"duration_ms\":" + r.digits(6) +
+         ",\"codec\":\"PCMA\",\"result\":\"success\",\"hops\":[";
+
+    bool first = true;
+    while (s.length() < target)
+    {
+      if (!first)
+      {
+        s += ",";
+      }
+      first = false;
+      s += "{\"node\":\"sprout-" + r.digits(2) + "\",\"latency_us\":" +
+           r.digits(4) + "}";
+    }
+    s += "]}";
+
+    s.resize(target);
+    return s;
+  }
+
+  inline std::string payload(PayloadType type, size_t target, uint32_t seed)
+  {
+    switch (type)
+    {
+    case SIP:
+      return sip_payload(target, seed);
+    case DIAMETER:
+      return diameter_payload(target, seed);
+    default:
+      return json_payload(target, seed);
+    }
+  }
+
+  inline std::string dictionary(PayloadType type)
+  {
+    switch (type)
+    {
+    case SIP:
+      return sip_dictionary();
+    case DIAMETER:
+      return diameter_dictionary();
+    default:
+      return json_dictionary();
+    }
+  }
+
+  // Generate a set of distinct payloads of the given type and size.
+  inline std::vector<std::string> corpus(PayloadType type,
+                                         size_t target,
+                                         int count)
+  {
+    std::vector<std::string> payloads;
+    for (int ii = 0; ii < count; ++ii)
+    {
+      payloads.push_back(payload(type, target, ii + 1));
+    }
+    return payloads;
+  }
+} // namespace SasBench
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * @file benchutil.h Utilities shared by the SAS client library benchmarks.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BENCHUTIL_H__
+#define BENCHUTIL_H__
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace SasBench
+{
+  // Monotonic wall-clock time in nanoseconds.
+  inline uint64_t now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+  }
+
+  // CPU time consumed by the whole process (all threads) in nanoseconds.
+  inline uint64_t process_cpu_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+  }
+
+  // Look up an integer command line option of the form --name=value,
+  // returning the default if it is not present.
+  inline long get_arg(int argc, char* argv[], const char* name, long dflt)
+  {
+    size_t name_len = strlen(name);
+    for (int ii = 1; ii < argc; ++ii)
+    {
+      if ((strncmp(argv[ii], "--", 2) == 0) &&
+          (strncmp(argv[ii] + 2, name, name_len) == 0) &&
+          (argv[ii][2 + name_len] == '='))
+      {
+        return strtol(argv[ii] + 3 + name_len, NULL, 0);
+      }
+    }
+    return dflt;
+  }
+
+  // Look up a string command line option of the form --name=value,
+  // returning the default if it is not present.
+  inline std::string get_str_arg(int argc,
+                                 char* argv[],
+                                 const char* name,
+                                 const std::string& dflt)
+  {
+    size_t name_len = strlen(name);
+    for (int ii = 1; ii < argc; ++ii)
+    {
+      if ((strncmp(argv[ii], "--", 2) == 0) &&
+          (strncmp(argv[ii] + 2, name, name_len) == 0) &&
+          (argv[ii][2 + name_len] == '='))
+      {
+        return std::string(argv[ii] + 3 + name_len);
+      }
+    }
+    return dflt;
+  }
+
+  // Check whether a boolean command line flag of the form --name is present.
+  inline bool get_flag(int argc, char* argv[], const char* name)
+  {
+    for (int ii = 1; ii < argc; ++ii)
+    {
+      if ((strncmp(argv[ii], "--", 2) == 0) &&
+          (strcmp(argv[ii] + 2, name) == 0))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Run a function on the specified number of threads, releasing them all at
+  // once so that they contend with each other for the whole run.  The
+  // function is passed the index of the thread it is running on.
+  class ThreadGroup
+  {
+  public:
+    ThreadGroup(int num_threads, std::function<void(int)> fn) :
+      _fn(fn),
+      _threads(num_threads),
+      _ready(0),
+      _go(false)
+    {
+      pthread_mutex_init(&_m, NULL);
+      pthread_cond_init(&_cond, NULL);
+    }
+
+    ~ThreadGroup()
+    {
+      pthread_cond_destroy(&_cond);
+      pthread_mutex_destroy(&_m);
+    }
+
+    // Run the threads to completion, returning the elapsed wall-clock time in
+    // nanoseconds from when they were released.
+    uint64_t run()
+    {
+      std::vector<Context> contexts(_threads.size());
+      for (size_t ii = 0; ii < _threads.size(); ++ii)
+      {
+        contexts[ii].group = this;
+        contexts[ii].index = ii;
+        pthread_create(&_threads[ii], NULL, &thread_fn, &contexts[ii]);
+      }
+
+      pthread_mutex_lock(&_m);
+      while (_ready < _threads.size())
+      {
+        pthread_cond_wait(&_cond, &_m);
+      }
+      uint64_t start = now_ns();
+      _go = true;
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_m);
+
+      for (size_t ii = 0; ii < _threads.size(); ++ii)
+      {
+        pthread_join(_threads[ii], NULL);
+      }
+
+      return now_ns() - start;
+    }
+
+  private:
+    struct Context
+    {
+      ThreadGroup* group;
+      int index;
+    };
+
+    static void* thread_fn(void* p)
+    {
+      Context* ctx = (Context*)p;
+      ThreadGroup* group = ctx->group;
+
+      pthread_mutex_lock(&group->_m);
+      ++group->_ready;
+      pthread_cond_broadcast(&group->_cond);
+      while (!group->_go)
+      {
+        pthread_cond_wait(&group->_cond, &group->_m);
+      }
+      pthread_mutex_unlock(&group->_m);
+
+      group->_fn(ctx->index);
+      return NULL;
+    }
+
+    std::function<void(int)> _fn;
+    std::vector<pthread_t> _threads;
+    size_t _ready;
+    bool _go;
+    pthread_mutex_t _m;
+    pthread_cond_t _cond;
+  };
+
+  // Hardware performance counters (cache misses and so on) for the calling
+  // process, counting user-space events in the calling thread and any
+  // threads it creates after the counters are opened.  Counters the kernel
+  // or hardware doesn't support (for example, in many virtual machines) are
+  // reported as unsupported rather than failing the benchmark.
+  class PerfCounters
+  {
+  public:
+    enum Counter
+    {
+      CACHE_MISSES = 0,
+      L1D_READ_MISSES,
+      INSTRUCTIONS,
+      NUM_COUNTERS
+    };
+
+    PerfCounters()
+    {
+      _fds[CACHE_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      _fds[L1D_READ_MISSES] = open(PERF_TYPE_HW_CACHE,
+                                   PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+      _fds[INSTRUCTIONS] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    }
+
+    ~PerfCounters()
+    {
+      for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+      {
+        if (_fds[ii] >= 0)
+        {
+          ::close(_fds[ii]);
+        }
+      }
+    }
+
+    static const char* name(Counter counter)
+    {
+      static const char* names[] = {"cache misses", "L1D read misses", "instructions"};
+      return names[counter];
+    }
+
+    bool supported(Counter counter) const { return (_fds[counter] >= 0); }
+
+    void start()
+    {
+      for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+      {
+        if (_fds[ii] >= 0)
+        {
+          ioctl(_fds[ii], PERF_EVENT_IOC_RESET, 0);
+          ioctl(_fds[ii], PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    void stop()
+    {
+      for (int ii = 0; ii < NUM_COUNTERS; ++ii)
+      {
+        if (_fds[ii] >= 0)
+        {
+          ioctl(_fds[ii], PERF_EVENT_IOC_DISABLE, 0);
+        }
+      }
+    }
+
+    uint64_t read(Counter counter) const
+    {
+      uint64_t value = 0;
+      if ((_fds[counter] < 0) ||
+          (::read(_fds[counter], &value, sizeof(value)) != sizeof(value)))
+      {
+        return 0;
+      }
+      return value;
+    }
+
+  private:
+    static int open(uint32_t type, uint64_t config)
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    int _fds[NUM_COUNTERS];
+  };
+
+  // Return the specified percentile (0-100) of a set of samples.  The samples
+  // are sorted in place.
+  inline uint64_t percentile(std::vector<uint64_t>& samples, double pct)
+  {
+    if (samples.empty())
+    {
+      return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t idx = (size_t)((pct / 100.0) * (samples.size() - 1) + 0.5);
+    return samples[std::min(idx, samples.size() - 1)];
+  }
+} // namespace SasBench
+
+#endif
@@ -40,14 +40,33 @@
 #include <string.h>
 #include <netdb.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <algorithm>
+#include <vector>
 
 #include "sas.h"
 #include "sas_eventq.h"
 #include "sas_internal.h"
+#include "sas_resolver.h"
+#include "sas_ring.h"
+#include "sas_spill.h"
+#include "sas_stats.h"
+#include "sas_uring.h"
 
-const char* SAS_PORT = "6761";
 
 // MIN/MAX string lengths for init parameters.
 const unsigned int MAX_SYSTEM_LEN = 64;
@@ -56,10 +75,73 @@ const unsigned int MAX_RESOURCE_ID_LEN = 255;
 const uint8_t ASSOC_OP_ASSOCIATE = 0x01;
 const uint8_t ASSOC_OP_NO_REACTIVATE = 0x02;
 
-std::atomic<SAS::TrailId> SAS::_next_trail_id(1);
-SAS::Connection* SAS::_connection = NULL;
+// The trail ID counter is written by threads taking blocks of trail IDs, and
+// the connection pool pointer read by every thread reporting to SAS, so keep
+// them on separate cache lines.
+alignas(SAS_CACHE_LINE_SIZE) std::atomic<SAS::TrailId> SAS::_next_trail_id(1);
+alignas(SAS_CACHE_LINE_SIZE) SAS::ConnectionPool* SAS::_connections = NULL;
 SAS::sas_log_callback_t* SAS::_log_callback = NULL;
 SAS::create_socket_callback_t* SAS::_socket_callback = NULL;
+SAS::Options SAS::_options;
+std::atomic<uint32_t> SAS::_compression_generation(0);
+
+// Protects _options, which reconfigure can change while other threads read it.
+static pthread_mutex_t options_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Largest LZ4 output buffer, so that doubling the buffer can't overflow.
+static const int MAX_LZ4_BUFFER_BYTES = 1 << 30;
+
+// Check the compression options are in range.
+//
+// @returns the name of the first one that isn't, or NULL if they all are.
+static const char* invalid_compression_option(const SAS::Options& options)
+{
+  if ((options.zlib_level < -1) || (options.zlib_level > 9))
+  {
+    return "zlib_level";
+  }
+  else if ((options.zlib_window_bits < 9) || (options.zlib_window_bits > 15))
+  {
+    return "zlib_window_bits";
+  }
+  else if ((options.zlib_mem_level < 1) || (options.zlib_mem_level > 9))
+  {
+    return "zlib_mem_level";
+  }
+  else if (options.lz4_acceleration < 1)
+  {
+    return "lz4_acceleration";
+  }
+  else if ((options.lz4_max_buffer_bytes < 1) ||
+           (options.lz4_max_buffer_bytes > MAX_LZ4_BUFFER_BYTES))
+  {
+    return "lz4_max_buffer_bytes";
+  }
+  return NULL;
+}
+
+// Each thread allocates trail IDs from its own block, taken from the global
+// counter TRAIL_BLOCK_SIZE at a time, so that threads creating trails don't
+// all contend on the counter's cache line.  IDs left in a block when its
+// thread exits are never used.
+struct TrailBlock
+{
+  SAS::TrailId next;
+  SAS::TrailId end;
+};
+static const SAS::TrailId TRAIL_BLOCK_SIZE = 4096;
+static pthread_once_t trail_block_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trail_block_key;
+
+static void destroy_trail_block(void* block)
+{
+  delete (TrailBlock*)block;
+}
+
+static void init_trail_block_key()
+{
+  (void)pthread_key_create(&trail_block_key, destroy_trail_block);
+}
 
 class SAS::Connection
 {
@@ -67,37 +149,424 @@ public:
   Connection(const std::string& system_name,
              const std::string& system_type,
              const std::string& resource_identifier,
-             const std::string& sas_address);
+             const std::string& sas_address,
+             const std::string& sas_port,
+             unsigned int index,
+             SASResolver* resolver,
+             const Options& options);
   ~Connection();
 
   void send_msg(std::string msg);
+  void get_stats(ConnectionStats& stats);
+  void start_drain();
+  void wait_for_drain(uint64_t deadline_ns);
+  void set_address(const std::string& sas_address, const std::string& sas_port);
+  void set_max_queue_depth(unsigned int max_queue_depth);
+  int poll_fd();
+  bool poll_once();
+  bool flush();
 
   static void* writer_thread(void* p);
+  static bool is_file_address(const std::string& sas_address);
 
 private:
+  enum SendResult
+  {
+    SEND_COMPLETE,
+    SEND_BLOCKED,
+    SEND_FAILED
+  };
+
+  // Where an application-driven connection is in connecting to SAS.
+  enum ConnectState
+  {
+    DISCONNECTED,
+    CONNECTING,
+    CONNECTED
+  };
+
   bool connect_init();
-  static int get_local_sock(const char* sas_address, const char* sas_port);
-  static bool set_send_timeout(int sock, int timeout);
+  bool finish_connect();
+  void set_file_path();
+  void apply_address();
+  static void block_sigpipe();
+  void set_up_thread();
+  int next_reconnect_delay();
+  bool wait_to_reconnect(int delay_ms);
+  int get_local_sock(const char* sas_address, const char* sas_port);
+  bool start_connecting(const char* sas_address, const char* sas_port);
+  int continue_connecting(const struct epoll_event* events,
+                          int num_events,
+                          uint64_t& wake_ns);
+  void abandon_connecting();
+  int start_connect(const SASResolvedAddress& address);
+  int open_file();
+  void configure_socket();
+  bool check_socket();
+  void push_corked();
+  void reap_zerocopy();
+  static void order_addresses(std::vector<SASResolvedAddress>& addresses,
+                              Options::AddressFamily preference);
   void writer();
-
+  int reconnect_delay_after(uint64_t connected_ns);
+  void poll_disconnected();
+  void poll_connected(bool socket_ok);
+  void connect_finished();
+  void connection_lost();
+  void arm_wake_timer();
+  bool send_loop();
+  bool send_loop_uring();
+  bool run_uring();
+  void prep_uring_ops();
+  bool uring_completed(uint64_t op, int res);
+  void cancel_uring_ops();
+  void reap_uring_ops();
+  bool fill_pending();
+  bool spill_queue();
+  bool should_spill();
+  SendResult send_pending();
+  void record_sent(size_t nsent);
+  int build_batch(struct iovec* iov, size_t& batch_bytes, bool& zerocopy);
+  ssize_t send_batch();
+  ssize_t write_batch();
+  uint64_t unacked_bytes();
+  void trim_unacked();
+  void requeue_unacked();
+  void disconnect();
+  void periodic();
+  int idle_timeout_ms();
+  void arm_heartbeat_timer(uint64_t delay_ns);
+  void heartbeat_timer_fired();
+  bool drained();
+  static bool is_data_msg(const std::string& msg);
+
+  // The members are grouped by which threads write them, with each group on
+  // its own cache lines, so that producers calling send_msg and the writer
+  // thread don't invalidate each other's caches on every message.  Groups
+  // are separated by a cache line of padding (rather than aligned) as the
+  // Connection is allocated with plain operator new.
+
+  // Read-mostly - set up at construction.
   std::string _system_name;
   std::string _system_type;
   std::string _resource_identifier;
+  Options::AddressFamily _address_family;
+
+  // The address being connected to.  Set up at construction, but changed by
+  // apply_address when reconfigure moves the connection, so only the writer
+  // thread (or, when application driven, the thread polling the library)
+  // may read them - or any thread once the writer has been joined.
   std::string _sas_address;
+  std::string _sas_port;
 
-  SASeventq<std::string> _msg_q;
-  bool _connected;
+  // The connection's position in the pool.  Only the first connection logs
+  // the (process-wide) latency statistics.
+  unsigned int _index;
+
+  // Shared by all the connections in the pool.
+  SASResolver* _resolver;
+
+  // The file (or pipe) to write the byte stream to instead of connecting to
+  // SAS, for a file:// address.  Empty when connecting to SAS.
+  std::string _file_path;
+
+  // The file to spill messages to when the queue fills up (empty if spilling
+  // is disabled), its size, and the queue depth at which to start spilling.
+  std::string _spill_path;
+  size_t _spill_max_bytes;
+  unsigned int _spill_watermark;
 
   pthread_t _writer;
+  uint64_t _stats_log_interval_ns;
+  uint64_t _send_timeout_ns;
+  uint64_t _connect_timeout_ns;
+  uint64_t _heartbeat_interval_ns;
+  int _tcp_user_timeout_ms;
+  int _keepalive_interval_ms;
+  int _send_buffer_bytes;
+  Options::TcpBatching _tcp_batching;
+  int _notsent_lowat_bytes;
+  size_t _zerocopy_min_bytes;
+
+  // Where and how the writer thread runs (see Options).
+  std::vector<int> _writer_cpus;
+  std::string _writer_thread_name;
+  Options::SchedPolicy _sched_policy;
+  int _sched_priority;
+  int _nice;
+
+  // The queue's capacity (which reconfigure can change), the range of the
+  // reconnection delay, and the limits on the data the writer takes off the
+  // queue while waiting for the socket and on how many messages it pops at
+  // once (see Options).
+  std::atomic<unsigned int> _max_queue_depth;
+  int _min_reconnect_delay_ms;
+  int _max_reconnect_delay_ms;
+  size_t _max_pending_bytes;
+  unsigned int _max_batch_msgs;
+
+  char _pad0[SAS_CACHE_LINE_SIZE];
+
+  // Written by producers.  The enqueue count is also incremented on every
+  // message, so it is given a line to itself rather than sharing with the
+  // rarely written drop counters.
+  std::atomic<uint64_t> _enqueued;
+  char _pad1[SAS_CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> _dropped_queue_full;
+  std::atomic<uint64_t> _dropped_queue_closed;
+
+  // Whether messages are currently being discarded because the queue is
+  // full.  Used to log once when discarding starts and stops, rather than
+  // for every message.  Set by producers and cleared by the writer thread.
+  std::atomic<bool> _discarding;
+
+  // Set when the library is terminating, but the writer should send what's
+  // already been queued before exiting.
+  std::atomic<bool> _draining;
+
+  // The address reconfigure has asked the writer to move to, and whether it
+  // has yet to do so.
+  pthread_mutex_t _address_lock;
+  std::string _next_sas_address;
+  std::string _next_sas_port;
+  std::atomic<bool> _address_changed;
+
+  char _pad2[SAS_CACHE_LINE_SIZE];
+
+  // The queue itself, which keeps its own producer and consumer state apart.
+  SASeventq<std::string> _msg_q;
 
+  // Whether the application drives the connection (through poll_once and
+  // flush) rather than a writer thread.  If so, there's no queue - send_msg
+  // adds messages straight to the pending list.
+  bool _application_driven;
+
+  // Written by the writer thread.
   // Socket for the connection.
   int _sock;
 
-  /// Send timeout for the socket in seconds.
-  static const int SEND_TIMEOUT = 5;
+  // The writer's epoll set, containing the socket, the queue's eventfd and
+  // the heartbeat timer.
+  int _epoll_fd;
+  int _notify_fd;
+  int _timer_fd;
+
+  // Messages taken off the queue but not yet (completely) sent, how much of
+  // the first message has been sent, and the total size of the messages.
+  std::deque<std::string> _pending;
+  size_t _pending_offset;
+  size_t _pending_bytes;
+
+  // When data was last successfully written to the socket.
+  uint64_t _last_progress_ns;
+
+  // Buffer for coalescing pending messages into large writes to a file.
+  std::string _write_buf;
+
+  // Messages written to the socket that SAS may not have acknowledged yet,
+  // their total size, the total written on this connection, and the size
+  // the history can reach before acknowledged messages are trimmed from it.
+  // If the connection fails, the unacknowledged messages are sent again.
+  std::deque<std::string> _unacked;
+  size_t _unacked_bytes;
+  uint64_t _conn_bytes;
+  size_t _unacked_trim_at;
+
+  // Whether the socket is corked (so must be uncorked to push out a partial
+  // segment) and has zerocopy enabled, the ID the kernel will give the next
+  // MSG_ZEROCOPY send, and the zerocopy sends the kernel hasn't finished
+  // with yet, each with the connection offset it started at.  Messages from
+  // those sends must stay in the history even once acknowledged.
+  bool _corked;
+  bool _zerocopy;
+  uint32_t _zerocopy_next_id;
+  std::deque<std::pair<uint32_t, uint64_t> > _zerocopy_inflight;
+
+  // The io_uring the writer sends through (NULL if using epoll), which of
+  // the URING_OP_* operations are outstanding on it, whether the last send
+  // found the socket full (so the next waits for it to be writable), and
+  // the buffers the outstanding operations use.
+  SASUring* _uring;
+  unsigned int _uring_ops;
+  bool _uring_blocked;
+  struct msghdr _uring_msg;
+  std::vector<struct iovec> _uring_iov;
+  uint64_t _uring_notify_value;
+
+  // The connection attempts in progress, the addresses still to try, when
+  // to try the next one, and when to give up.
+  std::vector<SASResolvedAddress> _connect_addresses;
+  size_t _connect_next_address;
+  uint64_t _connect_next_attempt_ns;
+  uint64_t _connect_deadline_ns;
+  std::vector<int> _connect_attempts;
+
+  // When application driven: whether connected, when the connection was made,
+  // when to next try connecting (while disconnected) or continue connecting,
+  // whether the socket can take more data, the most messages there have been
+  // pending, and the timer that wakes the application for its next timeout.
+  ConnectState _state;
+  uint64_t _connected_ns;
+  uint64_t _connect_wake_ns;
+  bool _can_write;
+  unsigned int _pending_high_water;
+  int _wake_fd;
+
+  // The current reconnection backoff (0 if the last connection was good), and
+  // the state for randomizing the delay.
+  int _reconnect_backoff_ms;
+  uint64_t _backoff_rng;
+
+  // The spill file, and whether messages are currently going via it.  Once
+  // spilling starts, every message taken off the queue goes through the file
+  // until the file has been emptied, so that messages are still sent in
+  // order.
+  SASSpillFile _spill;
+  bool _spilling;
+
+  std::atomic<uint64_t> _dropped_send_failed;
+  std::atomic<uint64_t> _messages_sent;
+  std::atomic<uint64_t> _bytes_sent;
+  std::atomic<uint64_t> _connects;
+  std::atomic<uint64_t> _connect_failures;
+  std::atomic<uint64_t> _send_lockups;
+  std::atomic<uint64_t> _spilled;
+  std::atomic<uint64_t> _dropped_spill_full;
+  std::atomic<uint64_t> _requeued;
+  std::atomic<uint64_t> _zerocopy_sends;
+  std::atomic<uint64_t> _zerocopy_copied;
+
+  uint64_t _dropped_when_logged;
+
+  // When the writer thread should next do its periodic work.
+  uint64_t _next_periodic_ns;
+  static const uint64_t PERIODIC_INTERVAL_NS = 1000000000ull;
+
+  // When to next log the latency statistics (in the CLOCK_MONOTONIC
+  // timebase), and the statistics as they were when last logged.
+  uint64_t _next_stats_log_ns;
+  SAS::Stats _last_stats;
+
+  /// How long to wait for a connection attempt to one address before also
+  /// trying the next address (as recommended by RFC 8305).
+  static const uint64_t CONNECTION_ATTEMPT_DELAY_NS = 250000000ull;
+
+  /// How long a connection must have been up for to reconnect immediately
+  /// when it fails.
+  static const uint64_t MIN_STABLE_CONNECTION_NS = 1000000000ull;
+
+  /// Returned by continue_connecting while the connection attempts are still
+  /// in progress.
+  static const int CONNECT_IN_PROGRESS = -2;
+
+  /// How often to check whether the queue needs spilling while the writer is
+  /// waiting for SAS.
+  static const int SPILL_CHECK_INTERVAL_MS = 10;
+
+  /// Limit on how many messages are sent at once.
+  static const int MAX_IOVECS = 256;
+
+  /// How much the history of sent messages can grow by before checking
+  /// which have been acknowledged.
+  static const size_t UNACKED_CHECK_BYTES = 1024 * 1024;
+
+  /// Number of unanswered keepalive probes after which the connection is
+  /// dropped.
+  static const int KEEPALIVE_PROBES = 3;
+
+  /// Messages shorter than this may be stored within the std::string itself
+  /// (rather than on the heap), so would move when the message is moved
+  /// into the history.  Batches containing them aren't sent with zerocopy.
+  static const size_t MIN_ZEROCOPY_MSG_BYTES = 16;
+
+  /// Size of the writes made to a file:// destination.
+  static const size_t FILE_WRITE_BYTES = 1024 * 1024;
+
+  /// Prefix of SAS addresses that are files (or pipes) to write to.
+  static const char* const FILE_ADDRESS_PREFIX;
+
+  /// The operations the writer submits to its io_uring, used as their user
+  /// data, and the size of the ring.
+  static const uint64_t URING_OP_SEND = 0x1;
+  static const uint64_t URING_OP_WRITABLE = 0x2;
+  static const uint64_t URING_OP_NOTIFY = 0x4;
+  static const uint64_t URING_OP_SOCKET = 0x8;
+  static const uint64_t URING_OP_CANCEL = 0x10;
+  static const unsigned int URING_ENTRIES = 16;
+
+  /// At most three operations are outstanding (a send or writable poll, the
+  /// eventfd read and the socket poll), each of which may be being
+  /// cancelled, so the ring never normally fills.
+  static const unsigned int URING_MAX_OPS = 3;
+  static_assert(URING_ENTRIES >= 2 * URING_MAX_OPS,
+                "io_uring too small for the writer's operations");
+
+  /// The heartbeat message, which is always the same, so is serialized once.
+  static const std::string HEARTBEAT_MSG;
+};
+
+const std::string SAS::Connection::HEARTBEAT_MSG = SAS::heartbeat_msg();
+
+const char* const SAS::Connection::FILE_ADDRESS_PREFIX = "file://";
 
-  /// Maximum depth of SAS message queue.
-  static const int MAX_MSG_QUEUE = 100000;
+// The set of connections to SAS, each with its own queue and writer thread.
+// There are one or more connections to each SAS address.  Messages are
+// either sharded between all the connections by trail ID (so that each
+// trail's messages stay in order on a single connection), or replicated to
+// every address and sharded between that address's connections.
+class SAS::ConnectionPool
+{
+public:
+  ConnectionPool(const std::string& system_name,
+                 const std::string& system_type,
+                 const std::string& resource_identifier,
+                 const std::vector<std::string>& sas_addresses,
+                 const Options& options);
+  ~ConnectionPool();
+
+  void send_msg(TrailId trail, std::string msg);
+  void send_assoc(TrailId trail_a, TrailId trail_b, std::string msg);
+  void get_stats(ConnectionStats& stats);
+  void drain(int timeout_ms);
+  bool reconfigure(const std::vector<std::string>& sas_addresses,
+                   const Options& options);
+  bool sampled(TrailId trail) const;
+  int poll_fd();
+  void poll_once();
+  bool flush();
+
+  static std::vector<std::string> parse_addresses(const std::string& sas_address);
+  static bool split_host_port(const std::string& address,
+                              const std::string& default_port,
+                              std::string& host,
+                              std::string& port);
+
+private:
+  static unsigned int shard(TrailId trail, unsigned int num_shards);
+  static uint64_t sample_threshold(double sample_rate);
+  void send_to(const std::vector<unsigned int>& targets, std::string msg);
+
+  // Resolves the addresses for all the connections.
+  SASResolver _resolver;
+
+  // The connections, grouped by address, with _per_address connections to
+  // each address.
+  std::vector<Connection*> _connections;
+  unsigned int _per_address;
+  Options::Distribution _distribution;
+  int _trail_assoc_connection;
+
+  // Trails whose hashed IDs are below the threshold are reported (see
+  // sampled).
+  std::atomic<uint64_t> _sample_threshold;
+
+  // Ring file recording every message for post-mortem analysis, if enabled.
+  SASCaptureRing _capture;
+  bool _capturing;
+
+  // When application driven, an epoll set containing each connection's
+  // epoll set, for the application to poll.  -1 otherwise.
+  int _poll_fd;
 };
 
 int SAS::init(std::string system_name,
@@ -106,12 +575,67 @@ int SAS::init(std::string system_name,
               const std::string& sas_address,
               sas_log_callback_t* log_callback,
               create_socket_callback_t* socket_callback)
+{
+  return init(system_name,
+              system_type,
+              resource_identifier,
+              sas_address,
+              Options(),
+              log_callback,
+              socket_callback);
+}
+
+
+int SAS::init(std::string system_name,
+              const std::string& system_type,
+              const std::string& resource_identifier,
+              const std::string& sas_address,
+              const Options& options,
+              sas_log_callback_t* log_callback,
+              create_socket_callback_t* socket_callback)
 {
   _log_callback = log_callback;
   _socket_callback = socket_callback;
 
+  const char* invalid_option = invalid_compression_option(options);
+  if (invalid_option != NULL)
+  {
+    SAS_LOG_ERROR("Error connecting to SAS - Invalid %s option.", invalid_option);
+    return SAS_INIT_RC_ERR;
+  }
+
+  std::vector<std::string> sas_addresses;
   if (sas_address != "0.0.0.0")
   {
+    sas_addresses = ConnectionPool::parse_addresses(sas_address);
+    if (sas_addresses.empty())
+    {
+      SAS_LOG_ERROR("Error connecting to SAS - SAS address is blank.");
+      return SAS_INIT_RC_ERR;
+    }
+
+    for (size_t ii = 0; ii < sas_addresses.size(); ++ii)
+    {
+      if (Connection::is_file_address(sas_addresses[ii]))
+      {
+        if (sas_addresses[ii] == "file://")
+        {
+          SAS_LOG_ERROR("Error connecting to SAS - File path is blank.");
+          return SAS_INIT_RC_ERR;
+        }
+        continue;
+      }
+
+      std::string host;
+      std::string port;
+      if (!ConnectionPool::split_host_port(sas_addresses[ii], options.sas_port, host, port))
+      {
+        SAS_LOG_ERROR("Error connecting to SAS - Invalid SAS address %s.",
+                      sas_addresses[ii].c_str());
+        return SAS_INIT_RC_ERR;
+      }
+    }
+
     // Check the system and resource parameters are present and have the correct
     // length.
     if (system_name.length() <= 0)
@@ -146,280 +670,3020 @@ int SAS::init(std::string system_name,
       return SAS_INIT_RC_ERR;
     }
 
-    if (resource_identifier.length() > MAX_RESOURCE_ID_LEN)
+    if (resource_identifier.length() > MAX_RESOURCE_ID_LEN)
+    {
+      SAS_LOG_ERROR("Error connecting to SAS - Resource Identifier is longer than %d characters.",
+                    MAX_RESOURCE_ID_LEN);
+      return SAS_INIT_RC_ERR;
+    }
+  }
+
+  // Only store the options once they're known to be valid, so that a failed
+  // init leaves no trace.
+  pthread_mutex_lock(&options_lock);
+  _options = options;
+  pthread_mutex_unlock(&options_lock);
+  _compression_generation.fetch_add(1, std::memory_order_release);
+  SASThreadStats::set_enabled(options.stats_enabled);
+
+  if (!sas_addresses.empty())
+  {
+    _connections = new ConnectionPool(system_name,
+                                      system_type,
+                                      resource_identifier,
+                                      sas_addresses,
+                                      options);
+  }
+
+  return SAS_INIT_RC_OK;
+}
+
+
+int SAS::reconfigure(const Options& options, const std::string& sas_address)
+{
+  if (_connections == NULL)
+  {
+    SAS_LOG_ERROR("Can't reconfigure SAS - the library isn't initialized.");
+    return SAS_INIT_RC_ERR;
+  }
+
+  const char* invalid_option = invalid_compression_option(options);
+  if (invalid_option != NULL)
+  {
+    SAS_LOG_ERROR("Can't reconfigure SAS - Invalid %s option.", invalid_option);
+    return SAS_INIT_RC_ERR;
+  }
+
+  std::vector<std::string> sas_addresses;
+  if (!sas_address.empty())
+  {
+    sas_addresses = ConnectionPool::parse_addresses(sas_address);
+    if (sas_addresses.empty())
+    {
+      SAS_LOG_ERROR("Can't reconfigure SAS - SAS address is blank.");
+      return SAS_INIT_RC_ERR;
+    }
+
+    for (size_t ii = 0; ii < sas_addresses.size(); ++ii)
+    {
+      std::string host;
+      std::string port;
+      if ((Connection::is_file_address(sas_addresses[ii])) ?
+            (sas_addresses[ii] == "file://") :
+            (!ConnectionPool::split_host_port(sas_addresses[ii], options.sas_port, host, port)))
+      {
+        SAS_LOG_ERROR("Can't reconfigure SAS - Invalid SAS address %s.",
+                      sas_addresses[ii].c_str());
+        return SAS_INIT_RC_ERR;
+      }
+    }
+  }
+
+  if (!_connections->reconfigure(sas_addresses, options))
+  {
+    return SAS_INIT_RC_ERR;
+  }
+
+  pthread_mutex_lock(&options_lock);
+  _options.max_queue_depth = options.max_queue_depth;
+  _options.trail_sample_rate = options.trail_sample_rate;
+  _options.zlib_level = options.zlib_level;
+  _options.zlib_window_bits = options.zlib_window_bits;
+  _options.zlib_mem_level = options.zlib_mem_level;
+  _options.lz4_acceleration = options.lz4_acceleration;
+  _options.lz4_max_buffer_bytes = options.lz4_max_buffer_bytes;
+  pthread_mutex_unlock(&options_lock);
+  _compression_generation.fetch_add(1, std::memory_order_release);
+
+  return SAS_INIT_RC_OK;
+}
+
+
+int SAS::get_poll_fd()
+{
+  return (_connections != NULL) ? _connections->poll_fd() : -1;
+}
+
+
+void SAS::poll_once()
+{
+  if (_connections != NULL)
+  {
+    _connections->poll_once();
+  }
+}
+
+
+bool SAS::flush()
+{
+  return (_connections != NULL) ? _connections->flush() : true;
+}
+
+
+void SAS::get_options(Options& options)
+{
+  pthread_mutex_lock(&options_lock);
+  options = _options;
+  pthread_mutex_unlock(&options_lock);
+}
+
+
+void SAS::term(int flush_timeout_ms)
+{
+  if ((_connections) && (flush_timeout_ms > 0))
+  {
+    _connections->drain(flush_timeout_ms);
+  }
+
+  delete _connections;
+  _connections = NULL;
+}
+
+
+SAS::ConnectionPool::ConnectionPool(const std::string& system_name,
+                                    const std::string& system_type,
+                                    const std::string& resource_identifier,
+                                    const std::vector<std::string>& sas_addresses,
+                                    const Options& options) :
+  _resolver(options.dns_refresh_interval_ms),
+  _per_address(std::max(options.connections_per_address, 1)),
+  _distribution(options.distribution),
+  _trail_assoc_connection(options.trail_assoc_connection),
+  _sample_threshold(sample_threshold(options.trail_sample_rate)),
+  _capturing(false),
+  _poll_fd(-1)
+{
+  if (!options.capture_file.empty())
+  {
+    _capturing = _capture.open(options.capture_file,
+                               options.capture_file_bytes,
+                               system_name,
+                               system_type,
+                               resource_identifier);
+  }
+
+  for (size_t ii = 0; ii < sas_addresses.size(); ++ii)
+  {
+    // File addresses are passed through whole.
+    std::string host = sas_addresses[ii];
+    std::string port;
+    if (!Connection::is_file_address(host))
+    {
+      split_host_port(sas_addresses[ii], options.sas_port, host, port);
+    }
+
+    for (unsigned int jj = 0; jj < _per_address; ++jj)
+    {
+      _connections.push_back(new Connection(system_name,
+                                            system_type,
+                                            resource_identifier,
+                                            host,
+                                            port,
+                                            _connections.size(),
+                                            &_resolver,
+                                            options));
+    }
+  }
+
+  if (options.application_driven)
+  {
+    _poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (size_t ii = 0; ii < _connections.size(); ++ii)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u32 = ii;
+      if ((_poll_fd < 0) ||
+          (epoll_ctl(_poll_fd, EPOLL_CTL_ADD, _connections[ii]->poll_fd(), &ev) < 0))
+      {
+        // LCOV_EXCL_START
+        SAS_LOG_ERROR("Failed to set up SAS poll fd: %d %s", errno, ::strerror(errno));
+        break;
+        // LCOV_EXCL_STOP
+      }
+    }
+  }
+}
+
+
+SAS::ConnectionPool::~ConnectionPool()
+{
+  // Wake any writers waiting for DNS before terminating the connections.
+  _resolver.stop();
+
+  for (size_t ii = 0; ii < _connections.size(); ++ii)
+  {
+    delete _connections[ii];
+  }
+  _connections.clear();
+
+  if (_poll_fd >= 0)
+  {
+    ::close(_poll_fd);
+    _poll_fd = -1;
+  }
+}
+
+
+// Apply new options, and move the connections to new addresses (unless
+// there are none), which must be one for each of the current addresses.
+//
+// @returns false, having changed nothing, if the number of addresses is wrong.
+bool SAS::ConnectionPool::reconfigure(const std::vector<std::string>& sas_addresses,
+                                      const Options& options)
+{
+  if ((!sas_addresses.empty()) &&
+      (sas_addresses.size() * _per_address != _connections.size()))
+  {
+    SAS_LOG_ERROR("Can't reconfigure SAS - %lu addresses given, but it was initialized with %lu.",
+                  sas_addresses.size(), _connections.size() / _per_address);
+    return false;
+  }
+
+  for (size_t ii = 0; ii < sas_addresses.size(); ++ii)
+  {
+    std::string host = sas_addresses[ii];
+    std::string port;
+    if (!Connection::is_file_address(host))
+    {
+      split_host_port(sas_addresses[ii], options.sas_port, host, port);
+    }
+
+    for (unsigned int jj = 0; jj < _per_address; ++jj)
+    {
+      _connections[ii * _per_address + jj]->set_address(host, port);
+    }
+  }
+
+  for (size_t ii = 0; ii < _connections.size(); ++ii)
+  {
+    _connections[ii]->set_max_queue_depth(options.max_queue_depth);
+  }
+
+  _sample_threshold.store(sample_threshold(options.trail_sample_rate),
+                          std::memory_order_relaxed);
+
+  return true;
+}
+
+
+// The threshold below which hashed trail IDs are sampled, for a sample rate.
+uint64_t SAS::ConnectionPool::sample_threshold(double sample_rate)
+{
+  if (!(sample_rate > 0.0))
+  {
+    return 0;
+  }
+  else if (sample_rate >= 1.0)
+  {
+    return UINT64_MAX;
+  }
+  return (uint64_t)(sample_rate * 18446744073709551616.0);
+}
+
+
+// Whether a trail is to be reported.  The trail ID is hashed with a
+// different function (the splitmix64 finalizer) from the one used to shard
+// trails, so that the trails sampled are spread evenly across the shards.
+bool SAS::ConnectionPool::sampled(TrailId trail) const
+{
+  uint64_t threshold = _sample_threshold.load(std::memory_order_relaxed);
+  if (threshold == UINT64_MAX)
+  {
+    return true;
+  }
+
+  uint64_t hash = trail;
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+  hash ^= hash >> 31;
+  return (hash < threshold);
+}
+
+
+// Send everything that's been queued, waiting up to the timeout.  The
+// connections drain in parallel, against a common deadline.
+void SAS::ConnectionPool::drain(int timeout_ms)
+{
+  uint64_t deadline_ns = SASThreadStats::now_ns() + (timeout_ms * 1000000ull);
+
+  for (size_t ii = 0; ii < _connections.size(); ++ii)
+  {
+    _connections[ii]->start_drain();
+  }
+
+  if (_poll_fd >= 0)
+  {
+    // There are no writer threads, so do their work here until everything
+    // has been sent.
+    while (true)
+    {
+      bool drained = true;
+      for (size_t ii = 0; ii < _connections.size(); ++ii)
+      {
+        drained = _connections[ii]->poll_once() && drained;
+      }
+
+      uint64_t now = SASThreadStats::now_ns();
+      if (drained)
+      {
+        break;
+      }
+      else if (now >= deadline_ns)
+      {
+        SAS_LOG_WARNING("Timed out sending queued messages to SAS - discarding the rest");
+        break;
+      }
+
+      struct epoll_event event;
+      epoll_wait(_poll_fd, &event, 1, (int)((deadline_ns - now + 999999) / 1000000));
+    }
+    return;
+  }
+
+  for (size_t ii = 0; ii < _connections.size(); ++ii)
+  {
+    _connections[ii]->wait_for_drain(deadline_ns);
+  }
+}
+
+
+int SAS::ConnectionPool::poll_fd()
+{
+  return _poll_fd;
+}
+
+
+void SAS::ConnectionPool::poll_once()
+{
+  if (_poll_fd >= 0)
+  {
+    for (size_t ii = 0; ii < _connections.size(); ++ii)
+    {
+      _connections[ii]->poll_once();
+    }
+  }
+}
+
+
+bool SAS::ConnectionPool::flush()
+{
+  bool flushed = true;
+  if (_poll_fd >= 0)
+  {
+    for (size_t ii = 0; ii < _connections.size(); ++ii)
+    {
+      flushed = _connections[ii]->flush() && flushed;
+    }
+  }
+  return flushed;
+}
+
+
+// Split a comma-separated list of SAS addresses, ignoring surrounding white
+// space and empty entries.
+std::vector<std::string> SAS::ConnectionPool::parse_addresses(const std::string& sas_address)
+{
+  std::vector<std::string> addresses;
+  size_t start = 0;
+  while (start <= sas_address.length())
+  {
+    size_t end = sas_address.find(',', start);
+    if (end == std::string::npos)
+    {
+      end = sas_address.length();
+    }
+
+    size_t first = sas_address.find_first_not_of(" \t", start);
+    if ((first != std::string::npos) && (first < end))
+    {
+      size_t last = sas_address.find_last_not_of(" \t", end - 1);
+      addresses.push_back(sas_address.substr(first, last - first + 1));
+    }
+
+    start = end + 1;
+  }
+
+  return addresses;
+}
+
+
+// Split a SAS address into the host and port.  The address is one of
+//
+// -  a host name or IPv4 address, optionally followed by ":port"
+// -  an IPv6 address in square brackets, optionally followed by ":port"
+// -  a bare IPv6 address (which has more than one colon, so can't have a
+//    port).
+//
+// If there's no port the default is used.
+//
+// @returns false if the address is malformed, or its port isn't from 1 to
+//          65535.
+bool SAS::ConnectionPool::split_host_port(const std::string& address,
+                                          const std::string& default_port,
+                                          std::string& host,
+                                          std::string& port)
+{
+  size_t port_sep;
+  if (address[0] == '[')
+  {
+    size_t close = address.find(']');
+    if ((close == std::string::npos) || (close == 1))
+    {
+      return false;
+    }
+    host = address.substr(1, close - 1);
+
+    if (close + 1 == address.length())
+    {
+      port_sep = std::string::npos;
+    }
+    else if (address[close + 1] == ':')
+    {
+      port_sep = close + 1;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  else
+  {
+    port_sep = address.find(':');
+    if ((port_sep != std::string::npos) &&
+        (address.find(':', port_sep + 1) != std::string::npos))
+    {
+      // A bare IPv6 address.
+      port_sep = std::string::npos;
+    }
+    host = address.substr(0, port_sep);
+  }
+
+  if (port_sep == std::string::npos)
+  {
+    port = default_port;
+  }
+  else
+  {
+    port = address.substr(port_sep + 1);
+    if ((port.empty()) ||
+        (port.find_first_not_of("0123456789") != std::string::npos))
+    {
+      return false;
+    }
+
+    // Too many digits to fit in an unsigned long gives ULONG_MAX.
+    unsigned long port_num = strtoul(port.c_str(), NULL, 10);
+    if ((port_num == 0) || (port_num > 65535))
+    {
+      return false;
+    }
+  }
+
+  return !host.empty();
+}
+
+
+// Pick the shard for a trail.  Trail IDs are allocated sequentially, so mix
+// the bits (Fibonacci hashing) and then scale the top 32 bits of the hash to
+// the number of shards.  The low bits of the hash are poorly mixed, so taking
+// it modulo the number of shards would not spread trails evenly.
+unsigned int SAS::ConnectionPool::shard(TrailId trail, unsigned int num_shards)
+{
+  uint64_t hash = (trail * 0x9E3779B97F4A7C15ull) >> 32;
+  return (unsigned int)((hash * num_shards) >> 32);
+}
+
+
+// Send a message to each of the listed connections, copying it to all but the
+// last, which can take the original.
+void SAS::ConnectionPool::send_to(const std::vector<unsigned int>& targets,
+                                  std::string msg)
+{
+  size_t last = targets.size() - 1;
+  for (size_t ii = 0; ii < last; ++ii)
+  {
+    _connections[targets[ii]]->send_msg(msg);
+  }
+  _connections[targets[last]]->send_msg(std::move(msg));
+}
+
+
+void SAS::ConnectionPool::send_msg(TrailId trail, std::string msg)
+{
+  if (_capturing)
+  {
+    _capture.append(msg);
+  }
+
+  if (_distribution == Options::Distribution::ShardByTrail)
+  {
+    _connections[shard(trail, _connections.size())]->send_msg(std::move(msg));
+  }
+  else
+  {
+    // Send to the trail's connection to each address.
+    unsigned int offset = shard(trail, _per_address);
+    std::vector<unsigned int> targets;
+    for (unsigned int base = 0; base < _connections.size(); base += _per_address)
+    {
+      targets.push_back(base + offset);
+    }
+    send_to(targets, std::move(msg));
+  }
+}
+
+
+// Send a trail association.  The two trails may be on different connections,
+// so by default the association is sent to both so that each SAS knows the
+// trail it holds is associated with the other.  Alternatively all
+// associations can be sent to one designated connection (to each address,
+// if replicating).
+void SAS::ConnectionPool::send_assoc(TrailId trail_a, TrailId trail_b, std::string msg)
+{
+  if (_capturing)
+  {
+    _capture.append(msg);
+  }
+
+  bool replicate = (_distribution == Options::Distribution::Replicate);
+  unsigned int num_shards = replicate ? _per_address : _connections.size();
+
+  std::vector<unsigned int> targets;
+  for (unsigned int base = 0; base < _connections.size(); base += num_shards)
+  {
+    if (_trail_assoc_connection >= 0)
+    {
+      targets.push_back(base + (_trail_assoc_connection % num_shards));
+    }
+    else
+    {
+      unsigned int shard_a = shard(trail_a, num_shards);
+      unsigned int shard_b = shard(trail_b, num_shards);
+      targets.push_back(base + shard_a);
+      if (shard_b != shard_a)
+      {
+        targets.push_back(base + shard_b);
+      }
+    }
+  }
+  send_to(targets, std::move(msg));
+}
+
+
+void SAS::ConnectionPool::get_stats(ConnectionStats& stats)
+{
+  stats = ConnectionStats();
+  for (size_t ii = 0; ii < _connections.size(); ++ii)
+  {
+    ConnectionStats conn_stats;
+    _connections[ii]->get_stats(conn_stats);
+    stats.enqueued += conn_stats.enqueued;
+    stats.dropped_queue_full += conn_stats.dropped_queue_full;
+    stats.dropped_queue_closed += conn_stats.dropped_queue_closed;
+    stats.dropped_send_failed += conn_stats.dropped_send_failed;
+    stats.messages_sent += conn_stats.messages_sent;
+    stats.bytes_sent += conn_stats.bytes_sent;
+    stats.connects += conn_stats.connects;
+    stats.reconnects += conn_stats.reconnects;
+    stats.connect_failures += conn_stats.connect_failures;
+    stats.send_lockups += conn_stats.send_lockups;
+    stats.spilled += conn_stats.spilled;
+    stats.dropped_spill_full += conn_stats.dropped_spill_full;
+    stats.requeued += conn_stats.requeued;
+    stats.zerocopy_sends += conn_stats.zerocopy_sends;
+    stats.zerocopy_copied += conn_stats.zerocopy_copied;
+    stats.queue_depth += conn_stats.queue_depth;
+    stats.queue_high_water = std::max(stats.queue_high_water,
+                                      conn_stats.queue_high_water);
+  }
+}
+
+
+SAS::Connection::Connection(const std::string& system_name,
+                            const std::string& system_type,
+                            const std::string& resource_identifier,
+                            const std::string& sas_address,
+                            const std::string& sas_port,
+                            unsigned int index,
+                            SASResolver* resolver,
+                            const Options& options) :
+  _system_name(system_name),
+  _system_type(system_type),
+  _resource_identifier(resource_identifier),
+  _address_family(options.address_family),
+  _sas_address(sas_address),
+  _sas_port(sas_port),
+  _index(index),
+  _resolver(resolver),
+  _spill_path(options.spill_file),
+  _spill_max_bytes(options.spill_file_max_bytes),
+  _spill_watermark(options.spill_watermark),
+  _writer(0),
+  _stats_log_interval_ns(0),
+  _send_timeout_ns(options.send_timeout_ms * 1000000ull),
+  _connect_timeout_ns(options.connect_timeout_ms * 1000000ull),
+  _heartbeat_interval_ns(std::max(options.heartbeat_interval_ms, 0) * 1000000ull),
+  _tcp_user_timeout_ms(options.tcp_user_timeout_ms),
+  _keepalive_interval_ms(options.keepalive_interval_ms),
+  _send_buffer_bytes(options.send_buffer_bytes),
+  _tcp_batching(options.tcp_batching),
+  _notsent_lowat_bytes(options.notsent_lowat_bytes),
+  _zerocopy_min_bytes(options.zerocopy_min_bytes),
+  _writer_cpus(options.writer_cpus),
+  _writer_thread_name(options.writer_thread_name),
+  _sched_policy(options.writer_sched_policy),
+  _sched_priority(options.writer_sched_priority),
+  _nice(options.writer_nice),
+  _max_queue_depth(options.max_queue_depth),
+  _min_reconnect_delay_ms(std::max(options.min_reconnect_delay_ms, 1)),
+  _max_reconnect_delay_ms(std::max(options.max_reconnect_delay_ms, _min_reconnect_delay_ms)),
+  _max_pending_bytes(std::max(options.max_pending_bytes, (size_t)1)),
+  _max_batch_msgs(std::max(options.max_batch_msgs, 1u)),
+  _enqueued(0),
+  _dropped_queue_full(0),
+  _dropped_queue_closed(0),
+  _discarding(false),
+  _draining(false),
+  _address_changed(false),
+  _msg_q(options.max_queue_depth, false),
+  _application_driven(options.application_driven),
+  _sock(-1),
+  _epoll_fd(-1),
+  _notify_fd(-1),
+  _timer_fd(-1),
+  _pending_offset(0),
+  _pending_bytes(0),
+  _last_progress_ns(0),
+  _unacked_bytes(0),
+  _conn_bytes(0),
+  _unacked_trim_at(UNACKED_CHECK_BYTES),
+  _corked(false),
+  _zerocopy(false),
+  _zerocopy_next_id(0),
+  _uring(NULL),
+  _uring_ops(0),
+  _uring_blocked(false),
+  _uring_iov((size_t)MAX_IOVECS),
+  _uring_notify_value(0),
+  _connect_next_address(0),
+  _connect_next_attempt_ns(0),
+  _connect_deadline_ns(0),
+  _state(DISCONNECTED),
+  _connected_ns(0),
+  _connect_wake_ns(0),
+  _can_write(false),
+  _pending_high_water(0),
+  _wake_fd(-1),
+  _reconnect_backoff_ms(0),
+  _backoff_rng((SASThreadStats::now_ns() ^ (uintptr_t)this) | 1),
+  _spilling(false),
+  _dropped_send_failed(0),
+  _messages_sent(0),
+  _bytes_sent(0),
+  _connects(0),
+  _connect_failures(0),
+  _send_lockups(0),
+  _spilled(0),
+  _dropped_spill_full(0),
+  _requeued(0),
+  _zerocopy_sends(0),
+  _zerocopy_copied(0),
+  _dropped_when_logged(0),
+  _next_periodic_ns(0),
+  _next_stats_log_ns(0)
+{
+  pthread_mutex_init(&_address_lock, NULL);
+
+  if (_application_driven)
+  {
+    // Spilling works off the queue, which an application-driven connection
+    // doesn't have.
+    _spill_path.clear();
+  }
+
+  if ((!_spill_path.empty()) && (index > 0))
+  {
+    // Each connection in the pool needs its own file.
+    _spill_path += "." + std::to_string(index);
+  }
+
+  set_file_path();
+
+  if ((options.stats_enabled) && (options.stats_log_interval_ms > 0))
+  {
+    _stats_log_interval_ns = options.stats_log_interval_ms * 1000000ull;
+    _next_stats_log_ns = SASThreadStats::now_ns() + _stats_log_interval_ns;
+  }
+
+  // Set up the writer's epoll set, initially containing the queue's eventfd
+  // and the heartbeat timer (the socket is added when it's connected, and
+  // the timer is only armed while connected).
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _notify_fd = _msg_q.enable_notify_fd();
+  _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = _notify_fd;
+  struct epoll_event timer_ev;
+  memset(&timer_ev, 0, sizeof(timer_ev));
+  timer_ev.events = EPOLLIN;
+  timer_ev.data.fd = _timer_fd;
+  if ((_epoll_fd < 0) ||
+      (_notify_fd < 0) ||
+      (_timer_fd < 0) ||
+      (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _notify_fd, &ev) < 0) ||
+      (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _timer_fd, &timer_ev) < 0))
+  {
+    // LCOV_EXCL_START
+    SAS_LOG_ERROR("Failed to set up SAS writer event loop: %d %s", errno, ::strerror(errno));
+    // LCOV_EXCL_STOP
+  }
+
+  if ((options.send_backend == Options::SendBackend::IoUring) &&
+      (_file_path.empty()) &&
+      (!_application_driven))
+  {
+    _uring = new SASUring();
+    if (!_uring->init(URING_ENTRIES))
+    {
+      SAS_LOG_WARNING("io_uring not available for SAS connection to %s, using epoll: %d %s",
+                      _sas_address.c_str(), errno, ::strerror(errno));
+      delete _uring;
+      _uring = NULL;
+    }
+  }
+
+  // Open the queue for input
+  _msg_q.open();
+
+  if (_application_driven)
+  {
+    // Add the timer for the application's timeouts to the epoll set, and
+    // fire it straight away so that the first poll_once connects.
+    _wake_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event wake_ev;
+    memset(&wake_ev, 0, sizeof(wake_ev));
+    wake_ev.events = EPOLLIN;
+    wake_ev.data.fd = _wake_fd;
+    if ((_wake_fd < 0) ||
+        (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &wake_ev) < 0))
+    {
+      // LCOV_EXCL_START
+      SAS_LOG_ERROR("Failed to set up SAS wake timer: %d %s", errno, ::strerror(errno));
+      // LCOV_EXCL_STOP
+    }
+    arm_wake_timer();
+    return;
+  }
+
+  // Spawn a thread to open and write to the SAS connection.
+  int rc = pthread_create(&_writer, NULL, &writer_thread, this);
+
+  if (rc < 0)
+  {
+    // LCOV_EXCL_START
+    SAS_LOG_ERROR("Error creating SAS thread");
+    // LCOV_EXCL_STOP
+  }
+}
+
+
+SAS::Connection::~Connection()
+{
+  // Close off the queue.
+  _msg_q.close();
+
+  if (_writer != 0)
+  {
+    // Signal the writer thread to disconnect the socket and end.  This wakes
+    // the writer wherever it is waiting (including while connecting), so it
+    // exits promptly.
+    _msg_q.terminate();
+
+    // Wait for the writer thread to exit.
+    pthread_join(_writer, NULL);
+
+    _writer = 0;
+  }
+
+  if (_application_driven)
+  {
+    // There's no writer to close the socket, so do it here.
+    abandon_connecting();
+    disconnect();
+
+    if (_wake_fd >= 0)
+    {
+      ::close(_wake_fd);
+      _wake_fd = -1;
+    }
+  }
+
+  if (_epoll_fd >= 0)
+  {
+    ::close(_epoll_fd);
+    _epoll_fd = -1;
+  }
+
+  if (_timer_fd >= 0)
+  {
+    ::close(_timer_fd);
+    _timer_fd = -1;
+  }
+
+  delete _uring;
+  _uring = NULL;
+
+  pthread_mutex_destroy(&_address_lock);
+}
+
+
+// Move the connection to a new address.  The writer disconnects from the old
+// one (requeuing anything it hadn't acknowledged) and connects to the new
+// one straight away.
+void SAS::Connection::set_address(const std::string& sas_address,
+                                  const std::string& sas_port)
+{
+  pthread_mutex_lock(&_address_lock);
+  _next_sas_address = sas_address;
+  _next_sas_port = sas_port;
+  _address_changed.store(true);
+  pthread_mutex_unlock(&_address_lock);
+
+  _msg_q.wake();
+}
+
+
+int SAS::Connection::poll_fd()
+{
+  return _epoll_fd;
+}
+
+
+void SAS::Connection::set_max_queue_depth(unsigned int max_queue_depth)
+{
+  _max_queue_depth.store(max_queue_depth, std::memory_order_relaxed);
+  _msg_q.set_max_queue(max_queue_depth);
+}
+
+
+// Stop accepting messages, and have the writer thread exit once it has sent
+// everything already queued.
+void SAS::Connection::start_drain()
+{
+  _msg_q.close();
+  _draining.store(true);
+
+  // Wake the writer in case it's idle, so it notices it has finished.
+  _msg_q.wake();
+}
+
+
+// Wait for the writer thread to finish draining, up to the deadline (in the
+// CLOCK_MONOTONIC timebase).  If it hasn't finished by then, terminate it,
+// discarding whatever is left.
+void SAS::Connection::wait_for_drain(uint64_t deadline_ns)
+{
+  if (_writer == 0)
+  {
+    return;
+  }
+
+  // pthread_timedjoin_np takes an absolute CLOCK_REALTIME time.
+  uint64_t now = SASThreadStats::now_ns();
+  uint64_t remaining_ns = (deadline_ns > now) ? (deadline_ns - now) : 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t abs_ns = ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec + remaining_ns;
+  ts.tv_sec = abs_ns / 1000000000ull;
+  ts.tv_nsec = abs_ns % 1000000000ull;
+
+  if (pthread_timedjoin_np(_writer, NULL, &ts) != 0)
+  {
+    // The writer may be waiting for a first DNS lookup, which doesn't watch
+    // the queue, so stop the resolver too.  The connections share the
+    // deadline, so the others are being terminated as well.
+    _resolver->stop();
+    _msg_q.terminate();
+    pthread_join(_writer, NULL);
+
+    unsigned int depth;
+    unsigned int high_water;
+    _msg_q.depth(depth, high_water);
+    size_t unsent = depth + std::count_if(_pending.begin(), _pending.end(), is_data_msg);
+    SAS_LOG_WARNING("Timed out sending queued messages to SAS %s:%s - discarding %lu messages",
+                    _sas_address.c_str(), _sas_port.c_str(), unsent);
+  }
+
+  _writer = 0;
+}
+
+
+void* SAS::Connection::writer_thread(void* p)
+{
+  ((SAS::Connection*)p)->writer();
+  return NULL;
+}
+
+
+// Whether a SAS address is a file:// address.
+bool SAS::Connection::is_file_address(const std::string& sas_address)
+{
+  return (sas_address.compare(0, strlen(FILE_ADDRESS_PREFIX), FILE_ADDRESS_PREFIX) == 0);
+}
+
+
+// Writing to a pipe whose reader has gone raises SIGPIPE, which would kill
+// the application.  Block it on the writer thread so the write fails with
+// EPIPE instead.
+void SAS::Connection::block_sigpipe()
+{
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+}
+
+
+// Name the writer thread, and apply its CPU affinity and scheduling options.
+// Failures are logged but not fatal - the writer works wherever it runs.
+void SAS::Connection::set_up_thread()
+{
+  if (!_writer_thread_name.empty())
+  {
+    // Thread names are limited to 15 characters, so truncate the name
+    // before adding the index rather than losing the index.
+    std::string index = "-" + std::to_string(_index);
+    std::string name = _writer_thread_name.substr(0, 15 - index.length()) + index;
+    pthread_setname_np(pthread_self(), name.c_str());
+  }
+
+  if (!_writer_cpus.empty())
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (size_t ii = 0; ii < _writer_cpus.size(); ++ii)
+    {
+      if ((_writer_cpus[ii] >= 0) && (_writer_cpus[ii] < CPU_SETSIZE))
+      {
+        CPU_SET(_writer_cpus[ii], &cpus);
+      }
+    }
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0)
+    {
+      SAS_LOG_WARNING("Failed to set SAS writer CPU affinity: %d %s", rc, ::strerror(rc));
+    }
+  }
+
+  if (_sched_policy != Options::SchedPolicy::Inherit)
+  {
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    switch (_sched_policy)
+    {
+    case Options::SchedPolicy::Batch:
+      policy = SCHED_BATCH;
+      break;
+    case Options::SchedPolicy::Idle:
+      policy = SCHED_IDLE;
+      break;
+    case Options::SchedPolicy::Fifo:
+      policy = SCHED_FIFO;
+      priority = _sched_priority;
+      break;
+    case Options::SchedPolicy::RoundRobin:
+      policy = SCHED_RR;
+      priority = _sched_priority;
+      break;
+    default:
+      break;
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int rc = pthread_setschedparam(pthread_self(), policy, &param);
+    if (rc != 0)
+    {
+      SAS_LOG_WARNING("Failed to set SAS writer scheduling policy %d priority %d: %d %s",
+                      policy, priority, rc, ::strerror(rc));
+    }
+  }
+
+  if (_nice != 0)
+  {
+    // On Linux the nice level is per thread, set through the thread ID.
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), _nice) < 0)
+    {
+      SAS_LOG_WARNING("Failed to set SAS writer nice level %d: %d %s",
+                      _nice, errno, ::strerror(errno));
+    }
+  }
+}
+
+
+void SAS::Connection::writer()
+{
+  set_up_thread();
+
+  if (!_file_path.empty())
+  {
+    block_sigpipe();
+  }
+
+  while (true)
+  {
+    uint64_t connected_ns = 0;
+    if (connect_init())
+    {
+      connected_ns = SASThreadStats::now_ns();
+
+      // Now can start dequeuing and sending data.  The io_uring backend is
+      // only used for sockets (the connection may have moved to a file).
+      bool terminated = ((_uring != NULL) && (_file_path.empty())) ?
+                          !send_loop_uring() : !send_loop();
+
+      // Terminate the socket.
+      disconnect();
+
+      if (terminated)
+      {
+        // Received a termination signal on the queue, so exit.
+        break;
+      }
+    }
+
+    int reconnect_delay_ms = reconnect_delay_after(connected_ns);
+
+    // Wait for the delay before trying to reconnect.
+    SAS_LOG_DEBUG("Waiting to reconnect to SAS - timeout = %d", reconnect_delay_ms);
+    if (!wait_to_reconnect(reconnect_delay_ms))
+    {
+      // Received a termination signal on the queue, so exit.
+      break;
+    }
+  }
+}
+
+
+// Get the delay before reconnecting, after the connection made at
+// connected_ns has failed (or after failing to connect, if it's 0).
+int SAS::Connection::reconnect_delay_after(uint64_t connected_ns)
+{
+  if (_address_changed.load())
+  {
+    // Moving to a new address, so connect to it straight away.
+    _reconnect_backoff_ms = 0;
+    return 0;
+  }
+  else if ((connected_ns != 0) &&
+           (SASThreadStats::now_ns() - connected_ns >= MIN_STABLE_CONNECTION_NS))
+  {
+    // The connection had been up for a while, so this is probably a
+    // one-off failure (such as SAS restarting) - reconnect straight away.
+    _reconnect_backoff_ms = 0;
+    return 0;
+  }
+
+  // Either the connection attempt failed, or the connection failed soon
+  // after it was made - back off, to avoid reconnecting in a tight loop.
+  return next_reconnect_delay();
+}
+
+
+// Get the delay before the next connection attempt.  The delay doubles with
+// each consecutive failure, from the minimum reconnection delay up to the
+// maximum, and is randomized over the upper half of that
+// range so that many clients that lost their connections at the same time
+// don't all retry together.
+int SAS::Connection::next_reconnect_delay()
+{
+  if (_reconnect_backoff_ms == 0)
+  {
+    _reconnect_backoff_ms = _min_reconnect_delay_ms;
+  }
+  else if (_reconnect_backoff_ms < _max_reconnect_delay_ms / 2)
+  {
+    _reconnect_backoff_ms *= 2;
+  }
+  else
+  {
+    _reconnect_backoff_ms = _max_reconnect_delay_ms;
+  }
+
+  // xorshift64
+  _backoff_rng ^= _backoff_rng << 13;
+  _backoff_rng ^= _backoff_rng >> 7;
+  _backoff_rng ^= _backoff_rng << 17;
+
+  int half = _reconnect_backoff_ms / 2;
+  return half + (int)(_backoff_rng % (uint64_t)(_reconnect_backoff_ms - half + 1));
+}
+
+
+// Wait before reconnecting.  The wait is on the writer's epoll set so that it
+// is cut short as soon as the queue is terminated.
+//
+// @returns false if the queue has been terminated (or drained).
+bool SAS::Connection::wait_to_reconnect(int delay_ms)
+{
+  uint64_t reconnect_ns = SASThreadStats::now_ns() + (delay_ms * 1000000ull);
+
+  while (!_msg_q.is_terminated())
+  {
+    periodic();
+
+    if (drained())
+    {
+      // There's nothing left to send, so there's no point reconnecting.
+      return false;
+    }
+
+    if ((should_spill()) && (!spill_queue()))
+    {
+      return false;
+    }
+
+    uint64_t now = SASThreadStats::now_ns();
+    if ((now >= reconnect_ns) || (_address_changed.load()))
+    {
+      return true;
+    }
+
+    // Wake at least once a second to do the periodic work, and more often if
+    // the queue may need spilling.
+    uint64_t wait_ns = reconnect_ns - now;
+    uint64_t max_wait_ns = _spill_path.empty() ?
+                             PERIODIC_INTERVAL_NS :
+                             SPILL_CHECK_INTERVAL_MS * 1000000ull;
+    if (wait_ns > max_wait_ns)
+    {
+      wait_ns = max_wait_ns;
+    }
+    int timeout_ms = (wait_ns + 999999) / 1000000;
+
+    struct epoll_event event;
+    if (epoll_wait(_epoll_fd, &event, 1, timeout_ms) > 0)
+    {
+      // Only the queue's eventfd is in the set while disconnected.
+      _msg_q.clear_notify_fd();
+    }
+  }
+
+  return false;
+}
+
+
+// Poll an application-driven connection: handle whatever has happened on its
+// epoll set, connect (or carry on connecting) if it's time to, and send what
+// is pending.  This is the equivalent of a pass round the writer thread's
+// loops, but never waits.
+//
+// @returns true if the library is terminating and everything has been sent.
+bool SAS::Connection::poll_once()
+{
+  struct epoll_event events[8];
+  int num_events = epoll_wait(_epoll_fd, events, 8, 0);
+  bool socket_ok = true;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    int fd = events[ii].data.fd;
+    if (fd == _notify_fd)
+    {
+      _msg_q.clear_notify_fd();
+    }
+    else if ((fd == _timer_fd) && (_state == CONNECTED))
+    {
+      heartbeat_timer_fired();
+    }
+    else if ((fd == _timer_fd) || (fd == _wake_fd))
+    {
+      uint64_t expirations;
+      (void)!::read(fd, &expirations, sizeof(expirations));
+    }
+    else if ((fd == _sock) && (_state == CONNECTED))
+    {
+      if ((events[ii].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+          (!check_socket()))
+      {
+        socket_ok = false;
+      }
+      _can_write = true;
+    }
+  }
+
+  periodic();
+
+  if ((_state == CONNECTING) && (_address_changed.load()))
+  {
+    // Start again with the new address.
+    abandon_connecting();
+    _state = DISCONNECTED;
+    _connect_wake_ns = 0;
+  }
+
+  if (_state == CONNECTING)
+  {
+    int sock = continue_connecting(events, num_events, _connect_wake_ns);
+    if (sock != CONNECT_IN_PROGRESS)
+    {
+      abandon_connecting();
+      _sock = sock;
+      connect_finished();
+    }
+  }
+  else if (_state == DISCONNECTED)
+  {
+    poll_disconnected();
+  }
+  else
+  {
+    poll_connected(socket_ok);
+  }
+
+  arm_wake_timer();
+
+  return drained();
+}
+
+
+// Send what's pending on an application-driven connection, if it's
+// connected.
+//
+// @returns true if nothing is left pending.
+bool SAS::Connection::flush()
+{
+  if (_state == CONNECTED)
+  {
+    poll_connected(true);
+    arm_wake_timer();
+  }
+
+  return _pending.empty();
+}
+
+
+// Start connecting, if it's time to.  Connecting to a file or through the
+// socket callback completes (or fails) straight away.
+void SAS::Connection::poll_disconnected()
+{
+  if ((SASThreadStats::now_ns() < _connect_wake_ns) || (drained()))
+  {
+    return;
+  }
+
+  apply_address();
+
+  if (!_file_path.empty())
+  {
+    _sock = open_file();
+  }
+  else if (_socket_callback)
+  {
+    _sock = _socket_callback(_sas_address.c_str(), _sas_port.c_str());
+  }
+  else if (start_connecting(_sas_address.c_str(), _sas_port.c_str()))
+  {
+    int sock = continue_connecting(NULL, 0, _connect_wake_ns);
+    if (sock == CONNECT_IN_PROGRESS)
+    {
+      _state = CONNECTING;
+      return;
+    }
+    abandon_connecting();
+    _sock = sock;
+  }
+  else
+  {
+    _sock = -1;
+  }
+
+  connect_finished();
+}
+
+
+// Send what's pending, unless the connection has failed, locked up or is
+// moving to a new address, in which case disconnect.
+void SAS::Connection::poll_connected(bool socket_ok)
+{
+  if ((!socket_ok) || (_address_changed.load()))
+  {
+    connection_lost();
+    return;
+  }
+
+  if ((!_pending.empty()) && (_can_write))
+  {
+    SendResult result = send_pending();
+    if (result == SEND_FAILED)
+    {
+      connection_lost();
+      return;
+    }
+    _can_write = (result == SEND_COMPLETE);
+  }
+
+  if (!_pending.empty())
+  {
+    uint64_t stalled_ns = SASThreadStats::now_ns() - _last_progress_ns;
+    if (stalled_ns >= _send_timeout_ns)
+    {
+      SAS_LOG_ERROR("SAS connection to %s:%s locked up - no data sent for %lums",
+                    _sas_address.c_str(), _sas_port.c_str(), stalled_ns / 1000000);
+      _send_lockups.fetch_add(1, std::memory_order_relaxed);
+      connection_lost();
+    }
+  }
+}
+
+
+// Set up the socket an application-driven connection has just opened (or
+// failed to), and start sending if it succeeded.
+void SAS::Connection::connect_finished()
+{
+  uint64_t now = SASThreadStats::now_ns();
+  if (finish_connect())
+  {
+    _state = CONNECTED;
+    _connected_ns = now;
+    _last_progress_ns = now;
+    _can_write = true;
+    arm_heartbeat_timer(_heartbeat_interval_ns);
+    poll_connected(true);
+  }
+  else
+  {
+    _state = DISCONNECTED;
+    _connect_wake_ns = now + reconnect_delay_after(0) * 1000000ull;
+  }
+}
+
+
+// Disconnect an application-driven connection, and work out when to
+// reconnect.
+void SAS::Connection::connection_lost()
+{
+  disconnect();
+  _state = DISCONNECTED;
+  _connect_wake_ns = SASThreadStats::now_ns() +
+                     reconnect_delay_after(_connected_ns) * 1000000ull;
+}
+
+
+// Arm the wake timer for the next time an application-driven connection
+// has something to do other than in response to I/O: connecting, giving up
+// on a locked up connection, or the periodic work.
+void SAS::Connection::arm_wake_timer()
+{
+  uint64_t now = SASThreadStats::now_ns();
+  uint64_t wake_ns = UINT64_MAX;
+  if (_state == CONNECTING)
+  {
+    wake_ns = _connect_wake_ns;
+  }
+  else if ((_state == DISCONNECTED) && (!drained()))
+  {
+    wake_ns = _connect_wake_ns;
+  }
+  else if ((_state == CONNECTED) && (!_pending.empty()))
+  {
+    wake_ns = _last_progress_ns + _send_timeout_ns;
+  }
+
+  int timeout_ms = idle_timeout_ms();
+  if ((timeout_ms >= 0) && (now + (timeout_ms * 1000000ull) < wake_ns))
+  {
+    wake_ns = now + (timeout_ms * 1000000ull);
+  }
+
+  // A zero expiry disarms the timer, so one that's already due fires after a
+  // nanosecond.
+  uint64_t delay_ns = (wake_ns == UINT64_MAX) ? 0 :
+                      (wake_ns > now) ? (wake_ns - now) : 1;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay_ns / 1000000000ull;
+  its.it_value.tv_nsec = delay_ns % 1000000000ull;
+  timerfd_settime(_wake_fd, 0, &its, NULL);
+}
+
+
+// Send messages to SAS until the connection fails or the queue is
+// terminated.
+//
+// The socket is non-blocking.  Messages are moved from the queue to the
+// pending list and written in batches with a single sendmsg call.  While
+// the socket's send buffer is full, the writer waits (in epoll) for either
+// the socket to become writable or more messages to be queued, and keeps
+// moving messages onto the pending list (up to max_pending_bytes) so that
+// the queue doesn't fill up and discard messages during short stalls.  If
+// SAS doesn't accept any data for the send timeout, the connection is
+// considered to have locked up.
+//
+// @returns false if the queue has been terminated (or drained).
+bool SAS::Connection::send_loop()
+{
+  bool can_write = true;
+  _last_progress_ns = SASThreadStats::now_ns();
+  arm_heartbeat_timer(_heartbeat_interval_ns);
+
+  while (true)
+  {
+    periodic();
+
+    if ((!fill_pending()) || (drained()))
+    {
+      return false;
+    }
+
+    if (_address_changed.load())
+    {
+      return true;
+    }
+
+    if ((!_pending.empty()) && (can_write))
+    {
+      SendResult result = send_pending();
+      if (result == SEND_FAILED)
+      {
+        return true;
+      }
+      can_write = (result == SEND_COMPLETE);
+      continue;
+    }
+
+    // Nothing can be sent right now, so wait for something to happen.  If
+    // there's pending data we're waiting for the socket to become writable,
+    // so only wait until the send timeout expires.  Otherwise wait for more
+    // messages, the heartbeat timer, or periodic work.
+    int timeout_ms = idle_timeout_ms();
+    if (!_pending.empty())
+    {
+      uint64_t stalled_ns = SASThreadStats::now_ns() - _last_progress_ns;
+      if (stalled_ns >= _send_timeout_ns)
+      {
+        // Close the socket so we try to connect again (and avoid buffering
+        // data while waiting for long TCP timeouts).
+        SAS_LOG_ERROR("SAS connection to %s:%s locked up - no data sent for %lums",
+                      _sas_address.c_str(), _sas_port.c_str(), stalled_ns / 1000000);
+        _send_lockups.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      timeout_ms = ((_send_timeout_ns - stalled_ns) / 1000000) + 1;
+
+      if ((!_spill_path.empty()) && (timeout_ms > SPILL_CHECK_INTERVAL_MS))
+      {
+        // Check regularly whether the queue needs spilling.
+        timeout_ms = SPILL_CHECK_INTERVAL_MS;
+      }
+    }
+
+    struct epoll_event events[3];
+    int num_events = epoll_wait(_epoll_fd, events, 3, timeout_ms);
+
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      if (events[ii].data.fd == _notify_fd)
+      {
+        _msg_q.clear_notify_fd();
+      }
+      else if (events[ii].data.fd == _timer_fd)
+      {
+        heartbeat_timer_fired();
+      }
+      else
+      {
+        if ((events[ii].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+            (!check_socket()))
+        {
+          return true;
+        }
+
+        // The socket is writable (or has an error, which the next send will
+        // pick up).
+        can_write = true;
+      }
+    }
+  }
+}
+
+
+// The io_uring equivalent of send_loop.  Each batch of pending messages is
+// sent with an IORING_OP_SENDMSG, submitted in the same io_uring_enter call
+// that waits for it to complete (or for the queue's eventfd to be read, or
+// the socket to become readable), so an active connection takes one system
+// call per batch rather than an epoll_wait and a sendmsg.  The heartbeat and
+// send timeouts are the io_uring_enter timeout, rather than the timerfd.
+//
+// @returns false if the queue has been terminated (or drained).
+bool SAS::Connection::send_loop_uring()
+{
+  bool connected = run_uring();
+
+  // Nothing can be outstanding on the ring when the socket is closed or the
+  // pending messages are moved.
+  cancel_uring_ops();
+
+  return connected;
+}
+
+
+bool SAS::Connection::run_uring()
+{
+  _last_progress_ns = SASThreadStats::now_ns();
+
+  while (true)
+  {
+    periodic();
+
+    if ((!fill_pending()) || (drained()))
+    {
+      return false;
+    }
+
+    if (_address_changed.load())
+    {
+      return true;
+    }
+
+    uint64_t now = SASThreadStats::now_ns();
+    uint64_t idle_ns = now - _last_progress_ns;
+    bool sending = (_uring_ops & (URING_OP_SEND | URING_OP_WRITABLE));
+    if ((!sending) &&
+        (_pending.empty()) &&
+        (_heartbeat_interval_ns != 0) &&
+        (idle_ns >= _heartbeat_interval_ns))
+    {
+      _pending.push_back(HEARTBEAT_MSG);
+      _pending_bytes += HEARTBEAT_MSG.length();
+    }
+
+    prep_uring_ops();
+
+    // Work out how long to wait, as send_loop does.
+    int64_t timeout_ns;
+    if (_uring_ops & (URING_OP_SEND | URING_OP_WRITABLE))
+    {
+      if (idle_ns >= _send_timeout_ns)
+      {
+        SAS_LOG_ERROR("SAS connection to %s:%s locked up - no data sent for %lums",
+                      _sas_address.c_str(), _sas_port.c_str(), idle_ns / 1000000);
+        _send_lockups.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      timeout_ns = _send_timeout_ns - idle_ns;
+
+      if ((!_spill_path.empty()) && (timeout_ns > SPILL_CHECK_INTERVAL_MS * 1000000ll))
+      {
+        timeout_ns = SPILL_CHECK_INTERVAL_MS * 1000000ll;
+      }
+    }
+    else
+    {
+      int timeout_ms = idle_timeout_ms();
+      timeout_ns = (timeout_ms < 0) ? -1 : timeout_ms * 1000000ll;
+      if (_heartbeat_interval_ns != 0)
+      {
+        int64_t heartbeat_ns = (idle_ns < _heartbeat_interval_ns) ?
+                                 (_heartbeat_interval_ns - idle_ns) : 0;
+        if ((timeout_ns < 0) || (heartbeat_ns < timeout_ns))
+        {
+          timeout_ns = heartbeat_ns;
+        }
+      }
+    }
+
+    int rc = _uring->submit_and_wait(timeout_ns);
+    if ((rc < 0) && (rc != -ETIME) && (rc != -EINTR))
+    {
+      SAS_LOG_ERROR("io_uring wait for SAS connection to %s:%s failed: %d %s",
+                    _sas_address.c_str(), _sas_port.c_str(), -rc, ::strerror(-rc));
+      return true;
+    }
+
+    bool ok = true;
+    uint64_t op;
+    int res;
+    while (_uring->next_cqe(op, res))
+    {
+      ok = uring_completed(op, res) && ok;
+    }
+
+    if (!ok)
+    {
+      return true;
+    }
+  }
+}
+
+
+// Submit whichever of the writer's io_uring operations aren't already
+// outstanding: a send of the next batch of pending messages (or, if the
+// socket was full, a poll for it to become writable), a read of the queue's
+// eventfd, and a poll for the socket becoming readable (which is how SAS
+// closing the connection is noticed).
+//
+// If the submission queue is full, the operations that don't fit are left
+// for the next call, once submit_and_wait has made room.
+void SAS::Connection::prep_uring_ops()
+{
+  struct io_uring_sqe* sqe;
+  if ((!_pending.empty()) && (!(_uring_ops & (URING_OP_SEND | URING_OP_WRITABLE))))
+  {
+    if (_uring_blocked)
+    {
+      sqe = _uring->get_sqe(URING_OP_WRITABLE);
+      if (sqe != NULL)
+      {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = _sock;
+        sqe->poll32_events = POLLOUT;
+        _uring_ops |= URING_OP_WRITABLE;
+      }
+    }
+    else
+    {
+      sqe = _uring->get_sqe(URING_OP_SEND);
+      if (sqe != NULL)
+      {
+        // The messages (and the iovecs and message header) must stay put
+        // until the send completes.  The pending list is only added to while
+        // a send is outstanding, which doesn't move its existing entries.
+        size_t batch_bytes;
+        bool zerocopy;
+        memset(&_uring_msg, 0, sizeof(_uring_msg));
+        _uring_msg.msg_iov = &_uring_iov[0];
+        _uring_msg.msg_iovlen = build_batch(&_uring_iov[0], batch_bytes, zerocopy);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = _sock;
+        sqe->addr = (uint64_t)(uintptr_t)&_uring_msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        _uring_ops |= URING_OP_SEND;
+      }
+    }
+  }
+
+  if (!(_uring_ops & URING_OP_NOTIFY))
+  {
+    sqe = _uring->get_sqe(URING_OP_NOTIFY);
+    if (sqe != NULL)
+    {
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = _notify_fd;
+      sqe->addr = (uint64_t)(uintptr_t)&_uring_notify_value;
+      sqe->len = sizeof(_uring_notify_value);
+      _uring_ops |= URING_OP_NOTIFY;
+    }
+  }
+
+  if (!(_uring_ops & URING_OP_SOCKET))
+  {
+    sqe = _uring->get_sqe(URING_OP_SOCKET);
+    if (sqe != NULL)
+    {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = _sock;
+      sqe->poll32_events = POLLIN | POLLRDHUP;
+      _uring_ops |= URING_OP_SOCKET;
+    }
+  }
+}
+
+
+// Handle the completion of one of the writer's io_uring operations.
+//
+// @returns false if the connection has failed.
+bool SAS::Connection::uring_completed(uint64_t op, int res)
+{
+  _uring_ops &= ~op;
+
+  if (res == -ECANCELED)
+  {
+    return true;
+  }
+
+  if (op == URING_OP_SEND)
+  {
+    if (res >= 0)
+    {
+      record_sent(res);
+      if ((_pending.empty()) && (_corked))
+      {
+        push_corked();
+      }
+    }
+    else if ((res == -EAGAIN) || (res == -EWOULDBLOCK))
+    {
+      _uring_blocked = true;
+    }
+    else if (res != -EINTR)
+    {
+      SAS_LOG_ERROR("SAS connection to %s:%s failed: %d %s",
+                    _sas_address.c_str(), _sas_port.c_str(), -res, ::strerror(-res));
+      return false;
+    }
+  }
+  else if (op == URING_OP_WRITABLE)
+  {
+    _uring_blocked = false;
+  }
+  else if (op == URING_OP_SOCKET)
+  {
+    return check_socket();
+  }
+
+  return true;
+}
+
+
+// Cancel the outstanding io_uring operations and wait for them to complete.
+// A send may still complete successfully (in full or in part) rather than
+// being cancelled, so is accounted for as usual.
+void SAS::Connection::cancel_uring_ops()
+{
+  for (uint64_t op = URING_OP_SEND; op < URING_OP_CANCEL; op <<= 1)
+  {
+    struct io_uring_sqe* sqe = NULL;
+    while ((_uring_ops & op) &&
+           ((sqe = _uring->get_sqe(URING_OP_CANCEL)) == NULL))
+    {
+      // The submission queue is full, so submit what's on it and try again
+      // (unless the operation completes in the meantime).
+      _uring->submit_and_wait(0);
+      reap_uring_ops();
+    }
+
+    if (sqe != NULL)
+    {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = op;
+    }
+  }
+
+  while (_uring_ops != 0)
+  {
+    _uring->submit_and_wait(-1);
+    reap_uring_ops();
+  }
+
+  _uring_blocked = false;
+}
+
+
+// Handle the completions of the writer's io_uring operations while they're
+// being cancelled.
+void SAS::Connection::reap_uring_ops()
+{
+  uint64_t op;
+  int res;
+  while (_uring->next_cqe(op, res))
+  {
+    if (op != URING_OP_CANCEL)
+    {
+      uring_completed(op, res);
+    }
+  }
+}
+
+
+// How long the writer can wait when it has nothing to send, before it has
+// periodic work to do (-1 meaning indefinitely).  While idle the writer is
+// only woken by new messages and the heartbeat timer, unless it needs to
+// log statistics or is watching for the queue to stop discarding.
+int SAS::Connection::idle_timeout_ms()
+{
+  uint64_t wake_ns;
+  if (_discarding.load(std::memory_order_relaxed))
+  {
+    wake_ns = _next_periodic_ns;
+  }
+  else if (_stats_log_interval_ns != 0)
+  {
+    wake_ns = std::max(_next_periodic_ns, _next_stats_log_ns);
+  }
+  else
+  {
+    return -1;
+  }
+
+  uint64_t now = SASThreadStats::now_ns();
+  return (wake_ns > now) ? (int)(((wake_ns - now) + 999999) / 1000000) : 0;
+}
+
+
+// Set the heartbeat timer to fire after the delay (or disarm it if the
+// delay is 0).
+void SAS::Connection::arm_heartbeat_timer(uint64_t delay_ns)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay_ns / 1000000000ull;
+  its.it_value.tv_nsec = delay_ns % 1000000000ull;
+  timerfd_settime(_timer_fd, 0, &its, NULL);
+}
+
+
+// The heartbeat timer has fired.  Send a heartbeat if nothing has been
+// written for the heartbeat interval, and set the timer for when the next
+// one will be due if nothing else is sent.  Re-arming the timer here, rather
+// than on every write, keeps the cost off the send path.
+void SAS::Connection::heartbeat_timer_fired()
+{
+  uint64_t expirations;
+  (void)!::read(_timer_fd, &expirations, sizeof(expirations));
+
+  uint64_t idle_ns = SASThreadStats::now_ns() - _last_progress_ns;
+  if ((idle_ns >= _heartbeat_interval_ns) && (_pending.empty()))
+  {
+    _pending.push_back(HEARTBEAT_MSG);
+    _pending_bytes += HEARTBEAT_MSG.length();
+    arm_heartbeat_timer(_heartbeat_interval_ns);
+  }
+  else if (idle_ns < _heartbeat_interval_ns)
+  {
+    arm_heartbeat_timer(_heartbeat_interval_ns - idle_ns);
+  }
+  else
+  {
+    // Data is waiting to be sent, which the send timeout takes care of.
+    arm_heartbeat_timer(_heartbeat_interval_ns);
+  }
+}
+
+
+// Move messages from the queue (or, if spilling, the spill file) to the
+// pending list, until either the queue is empty (in which case the queue's
+// eventfd is armed to signal when more arrive) or the pending list is full.
+//
+// @returns false if the queue has been terminated.
+bool SAS::Connection::fill_pending()
+{
+  if (_spilling)
+  {
+    // Everything on the queue is newer than what's in the spill file, so
+    // move it to the end of the file before reading from the front.
+    if (!spill_queue())
+    {
+      return false;
+    }
+
+    if (_pending_bytes < _max_pending_bytes)
+    {
+      _pending_bytes += _spill.read(_pending, _max_pending_bytes - _pending_bytes);
+    }
+
+    if (_spill.empty())
+    {
+      SAS_LOG_INFO("Finished sending messages spilled to %s", _spill_path.c_str());
+      _spilling = false;
+    }
+
+    return true;
+  }
+
+  while (_pending_bytes < _max_pending_bytes)
+  {
+    size_t first_new = _pending.size();
+    if (!_msg_q.pop_batch(_pending, _max_batch_msgs))
+    {
+      return false;
+    }
+
+    if (_pending.size() == first_new)
+    {
+      break;
+    }
+
+    for (size_t ii = first_new; ii < _pending.size(); ++ii)
+    {
+      _pending_bytes += _pending[ii].length();
+    }
+  }
+
+  if ((_pending_bytes >= _max_pending_bytes) && (should_spill()))
+  {
+    return spill_queue();
+  }
+
+  return true;
+}
+
+
+// Whether the queue should be spilled to disk - that is, spilling is enabled
+// and either the queue has reached the watermark or we're already spilling.
+bool SAS::Connection::should_spill()
+{
+  if (_spill_path.empty())
+  {
+    return false;
+  }
+
+  if (_spilling)
+  {
+    return true;
+  }
+
+  unsigned int depth;
+  unsigned int high_water;
+  _msg_q.depth(depth, high_water);
+  return (depth >= _spill_watermark);
+}
+
+
+// Move everything on the queue to the end of the spill file.  Messages that
+// don't fit in the file are discarded.
+//
+// @returns false if the queue has been terminated.
+bool SAS::Connection::spill_queue()
+{
+  if (!_spill.is_open())
+  {
+    if (!_spill.open(_spill_path, _spill_max_bytes))
+    {
+      // Don't try again.
+      _spill_path.clear();
+      return true;
+    }
+  }
+
+  if (!_spilling)
+  {
+    SAS_LOG_WARNING("SAS message queue reached %u messages - spilling to %s",
+                    _spill_watermark, _spill_path.c_str());
+    _spilling = true;
+  }
+
+  std::deque<std::string> msgs;
+  while (true)
+  {
+    if (!_msg_q.pop_batch(msgs, _max_batch_msgs))
+    {
+      return false;
+    }
+
+    if (msgs.empty())
+    {
+      break;
+    }
+
+    for (std::deque<std::string>::const_iterator it = msgs.begin();
+         it != msgs.end();
+         ++it)
+    {
+      if (_spill.append(*it))
+      {
+        _spilled.fetch_add(1, std::memory_order_relaxed);
+      }
+      else
+      {
+        _dropped_spill_full.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    msgs.clear();
+  }
+
+  return true;
+}
+
+
+// Write as much of the pending data to the socket as it will take.
+SAS::Connection::SendResult SAS::Connection::send_pending()
+{
+  while (!_pending.empty())
+  {
+    ssize_t nsent = (_file_path.empty()) ? send_batch() : write_batch();
+    if (nsent < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      else if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+      {
+        return SEND_BLOCKED;
+      }
+
+      // The socket (or file) has failed.
+      SAS_LOG_ERROR("SAS connection to %s:%s failed: %d %s", _sas_address.c_str(), _sas_port.c_str(), errno, ::strerror(errno));
+      return SEND_FAILED;
+    }
+
+    record_sent(nsent);
+  }
+
+  if (_corked)
+  {
+    push_corked();
+  }
+
+  return SEND_COMPLETE;
+}
+
+
+// Account for data having been written to the socket, removing the messages
+// that have been completely sent from the pending list.
+void SAS::Connection::record_sent(size_t nsent)
+{
+  _bytes_sent.fetch_add(nsent, std::memory_order_relaxed);
+  _conn_bytes += nsent;
+  _last_progress_ns = SASThreadStats::now_ns();
+
+  // Remove the messages that have been completely sent.
+  size_t remaining = nsent;
+  while (remaining > 0)
+  {
+    const std::string& front = _pending.front();
+    size_t front_remaining = front.length() - _pending_offset;
+    if (remaining < front_remaining)
+    {
+      _pending_offset += remaining;
+      break;
+    }
+
+    remaining -= front_remaining;
+    if (is_data_msg(front))
+    {
+      _messages_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+    _pending_bytes -= front.length();
+    if (_file_path.empty())
+    {
+      // Keep the message until SAS has acknowledged it.
+      _unacked_bytes += front.length();
+      _unacked.push_back(std::move(_pending.front()));
+    }
+    _pending.pop_front();
+    _pending_offset = 0;
+  }
+
+  if (_unacked_bytes >= _unacked_trim_at)
+  {
+    trim_unacked();
+  }
+}
+
+
+// Get how many of the bytes written on this connection SAS hasn't
+// acknowledged.  TCP_INFO's count of acknowledged bytes survives the
+// connection being reset (unlike the send queue, which SIOCOUTQ reports, and
+// which the kernel discards on a reset), so is used where available.
+uint64_t SAS::Connection::unacked_bytes()
+{
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if ((getsockopt(_sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) &&
+      (info_len >= offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked)))
+  {
+    return (_conn_bytes > info.tcpi_bytes_acked) ? (_conn_bytes - info.tcpi_bytes_acked) : 0;
+  }
+
+  int outq;
+  if (ioctl(_sock, SIOCOUTQ, &outq) == 0)
+  {
+    return outq;
+  }
+
+  // Not a TCP socket, so there's no way of knowing.
+  return 0;
+}
+
+
+// Discard the messages SAS has acknowledged from the history of sent
+// messages.  The history is only trimmed after it has grown by
+// UNACKED_CHECK_BYTES, to keep the syscall off the path of each send.
+// Messages from zerocopy sends the kernel hasn't finished with are kept
+// even if they have been acknowledged, as it may still be reading them.
+void SAS::Connection::trim_unacked()
+{
+  uint64_t unacked = unacked_bytes();
+  if (_zerocopy)
+  {
+    reap_zerocopy();
+    if (!_zerocopy_inflight.empty())
+    {
+      unacked = std::max(unacked, _conn_bytes - _zerocopy_inflight.front().second);
+    }
+  }
+  uint64_t history_unacked = (unacked > _pending_offset) ? (unacked - _pending_offset) : 0;
+  while ((!_unacked.empty()) &&
+         (_unacked_bytes - _unacked.front().length() >= history_unacked))
+  {
+    _unacked_bytes -= _unacked.front().length();
+    _unacked.pop_front();
+  }
+  _unacked_trim_at = _unacked_bytes + UNACKED_CHECK_BYTES;
+}
+
+
+// Move the messages that SAS never acknowledged back onto the pending list,
+// ahead of everything else, so that they are sent again once reconnected.
+// Must be called before the socket is closed.
+void SAS::Connection::requeue_unacked()
+{
+  uint64_t unacked = unacked_bytes();
+  uint64_t history_unacked = (unacked > _pending_offset) ? (unacked - _pending_offset) : 0;
+
+  // A partially written message is sent again in full.
+  _pending_offset = 0;
+
+  uint64_t requeued_bytes = 0;
+  while ((!_unacked.empty()) && (requeued_bytes < history_unacked))
+  {
+    std::string& msg = _unacked.back();
+    requeued_bytes += msg.length();
+
+    // INIT and heartbeat messages aren't needed on the new connection.
+    if (is_data_msg(msg))
+    {
+      _pending_bytes += msg.length();
+      _pending.push_front(std::move(msg));
+      _messages_sent.fetch_sub(1, std::memory_order_relaxed);
+      _requeued.fetch_add(1, std::memory_order_relaxed);
+    }
+    _unacked.pop_back();
+  }
+
+  _unacked.clear();
+  _unacked_bytes = 0;
+  _conn_bytes = 0;
+  _unacked_trim_at = UNACKED_CHECK_BYTES;
+}
+
+
+// Fill in an array of MAX_IOVECS iovecs with as many of the pending
+// messages as fit, getting their total size and whether they can be sent
+// with zerocopy.
+//
+// @returns the number of iovecs used.
+int SAS::Connection::build_batch(struct iovec* iov, size_t& batch_bytes, bool& zerocopy)
+{
+  int iovcnt = 0;
+  batch_bytes = 0;
+  zerocopy = _zerocopy;
+  for (std::deque<std::string>::const_iterator it = _pending.begin();
+       (it != _pending.end()) && (iovcnt < MAX_IOVECS);
+       ++it, ++iovcnt)
+  {
+    size_t offset = (iovcnt == 0) ? _pending_offset : 0;
+    iov[iovcnt].iov_base = (void*)(it->data() + offset);
+    iov[iovcnt].iov_len = it->length() - offset;
+    batch_bytes += iov[iovcnt].iov_len;
+    if (it->length() < MIN_ZEROCOPY_MSG_BYTES)
+    {
+      zerocopy = false;
+    }
+  }
+
+  return iovcnt;
+}
+
+
+// Send as many of the pending messages as fit in one sendmsg call.
+ssize_t SAS::Connection::send_batch()
+{
+  struct iovec iov[MAX_IOVECS];
+  size_t batch_bytes;
+  bool zerocopy;
+  int iovcnt = build_batch(iov, batch_bytes, zerocopy);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+
+  if ((zerocopy) && (batch_bytes >= _zerocopy_min_bytes))
+  {
+    ssize_t nsent = ::sendmsg(_sock, &msg, flags | MSG_ZEROCOPY);
+    if (nsent > 0)
+    {
+      // The kernel numbers each zerocopy send that sends anything, and
+      // reports when it has finished with them (see reap_zerocopy).
+      _zerocopy_inflight.push_back(std::make_pair(_zerocopy_next_id++, _conn_bytes));
+      _zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+      return nsent;
+    }
+    else if ((nsent == 0) || (errno != ENOBUFS))
+    {
+      return nsent;
+    }
+
+    // Too many zerocopy sends are outstanding for the socket's option
+    // memory limit, so fall back to copying this batch.
+  }
+
+  return ::sendmsg(_sock, &msg, flags);
+}
+
+
+// Write a batch of pending messages to a file:// destination.  The messages
+// are copied into a single buffer of up to FILE_WRITE_BYTES and written with
+// one write call - unlike a socket, there's nothing to be gained by getting
+// small messages out promptly, and large writes are much cheaper per byte.
+ssize_t SAS::Connection::write_batch()
+{
+  _write_buf.clear();
+  for (std::deque<std::string>::const_iterator it = _pending.begin();
+       (it != _pending.end()) && (_write_buf.length() < FILE_WRITE_BYTES);
+       ++it)
+  {
+    size_t offset = (it == _pending.begin()) ? _pending_offset : 0;
+    _write_buf.append(it->data() + offset, it->length() - offset);
+  }
+
+  // When application driven, this is the application's thread, so SIGPIPE
+  // is only blocked for the write.
+  sigset_t sigpipe;
+  sigset_t saved_mask;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  if (_application_driven)
+  {
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &saved_mask);
+  }
+
+  ssize_t nwritten = ::write(_sock, _write_buf.data(), _write_buf.length());
+  int saved_errno = errno;
+  if ((nwritten < 0) && (errno == EPIPE))
+  {
+    // Consume the SIGPIPE raised (and blocked) on this thread.
+    struct timespec no_wait = {0, 0};
+    sigtimedwait(&sigpipe, NULL, &no_wait);
+  }
+
+  if (_application_driven)
+  {
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+  }
+  errno = saved_errno;
+  return nwritten;
+}
+
+
+// Close the socket.  Messages SAS hadn't acknowledged (including any that had
+// only been partially sent) are re-queued, and all the pending messages are
+// kept and will be sent once we reconnect.  When writing to a file, a
+// partially written message can't be written again (as the part already
+// written can't be taken back), so it is discarded.
+void SAS::Connection::disconnect()
+{
+  if ((_sock >= 0) && (_file_path.empty()))
+  {
+    requeue_unacked();
+
+    if (!_zerocopy_inflight.empty())
+    {
+      // The kernel may still be reading messages from zerocopy sends, and
+      // won't report when it's finished once the socket is closed, so reset
+      // the connection rather than closing it gracefully.  That discards
+      // the unsent data at once, so the messages are safe to reuse.
+      struct linger linger = {1, 0};
+      setsockopt(_sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+      _zerocopy_inflight.clear();
+    }
+  }
+
+  if (_sock >= 0)
+  {
+    // Closing the socket also removes it from the epoll set.
+    ::close(_sock);
+    _sock = -1;
+  }
+
+  // Stop the heartbeat timer, clearing any expiry that hasn't been handled,
+  // so that only the queue's eventfd can wake the writer while disconnected.
+  arm_heartbeat_timer(0);
+  uint64_t expirations;
+  (void)!::read(_timer_fd, &expirations, sizeof(expirations));
+
+  if (_pending_offset > 0)
+  {
+    if (is_data_msg(_pending.front()))
+    {
+      _dropped_send_failed.fetch_add(1, std::memory_order_relaxed);
+    }
+    _pending_bytes -= _pending.front().length();
+    _pending.pop_front();
+    _pending_offset = 0;
+  }
+}
+
+
+// Whether the library is terminating and everything queued has been sent,
+// so the writer can exit.  With zerocopy, the writer also waits for the
+// kernel to finish with the messages, so the connection can be closed
+// gracefully.
+bool SAS::Connection::drained()
+{
+  if ((!_draining.load()) ||
+      (!_pending.empty()) ||
+      (_spilling) ||
+      (!_zerocopy_inflight.empty()))
+  {
+    return false;
+  }
+
+  unsigned int depth;
+  unsigned int high_water;
+  _msg_q.depth(depth, high_water);
+  return (depth == 0);
+}
+
+
+// Whether a message carries data (as opposed to being an INIT or heartbeat
+// message).  The message type is the fourth byte of the header.
+bool SAS::Connection::is_data_msg(const std::string& msg)
+{
+  return ((msg.length() > 3) &&
+          (msg[3] != SAS_MSG_INIT) &&
+          (msg[3] != SAS_MSG_HEARTBEAT));
+}
+
+
+// Periodic work done on the writer thread - logging statistics if they are
+// due, and spotting when the queue has stopped discarding messages.
+void SAS::Connection::periodic()
+{
+  uint64_t now = SASThreadStats::now_ns();
+  if (now < _next_periodic_ns)
+  {
+    return;
+  }
+  _next_periodic_ns = now + PERIODIC_INTERVAL_NS;
+
+  if (_discarding.load(std::memory_order_relaxed))
+  {
+    // Wait for the queue to drain to half full before declaring that it is
+    // no longer discarding, so we don't log every time it flaps between
+    // full and not quite full.
+    unsigned int depth;
+    unsigned int high_water;
+    _msg_q.depth(depth, high_water);
+    if (_application_driven)
+    {
+      depth = _pending.size();
+    }
+    if (depth < _max_queue_depth.load(std::memory_order_relaxed) / 2)
+    {
+      _discarding = false;
+      uint64_t dropped = _dropped_queue_full.load(std::memory_order_relaxed);
+      SAS_LOG_WARNING("SAS message queue no longer full - %lu messages discarded",
+                      dropped - _dropped_when_logged);
+      _dropped_when_logged = dropped;
+    }
+  }
+
+  if (_stats_log_interval_ns != 0)
+  {
+    if (now >= _next_stats_log_ns)
+    {
+      if (_index == 0)
+      {
+        SASThreadStats::log(_last_stats);
+      }
+
+      ConnectionStats stats;
+      get_stats(stats);
+      SAS_LOG_STATS("SAS connection %u (%s): enqueued=%lu dropped(full/closed/send)=%lu/%lu/%lu "
+                    "sent=%lu bytes=%lu connects=%lu connect_failures=%lu lockups=%lu "
+                    "spilled=%lu dropped(spill full)=%lu requeued=%lu zerocopy(sent/copied)=%lu/%lu "
+                    "queue=%lu high_water=%lu",
+                    _index,
+                    _sas_address.c_str(),
+                    stats.enqueued,
+                    stats.dropped_queue_full,
+                    stats.dropped_queue_closed,
+                    stats.dropped_send_failed,
+                    stats.messages_sent,
+                    stats.bytes_sent,
+                    stats.connects,
+                    stats.connect_failures,
+                    stats.send_lockups,
+                    stats.spilled,
+                    stats.dropped_spill_full,
+                    stats.requeued,
+                    stats.zerocopy_sends,
+                    stats.zerocopy_copied,
+                    stats.queue_depth,
+                    stats.queue_high_water);
+
+      _next_stats_log_ns = now + _stats_log_interval_ns;
+    }
+  }
+}
+
+// Connect to SAS.  The addresses come from the resolver's cache, and are
+// tried in the manner of RFC 8305 ("Happy Eyeballs"): a non-blocking connect
+// is started to the first address, and if it hasn't completed within
+// CONNECTION_ATTEMPT_DELAY_NS (or as soon as it fails) a connect to the next
+// address is started alongside it, and so on.  The first to complete wins.
+// The wait is on the writer's epoll set, so it is cut short if the queue is
+// terminated.  An application-driven connection goes through the same steps
+// (start_connecting and continue_connecting) from poll_once instead.
+//
+// @returns the connected socket (in non-blocking mode), or -1 on failure.
+int SAS::Connection::get_local_sock(const char* sas_address, const char* sas_port)
+{
+  if (!start_connecting(sas_address, sas_port))
+  {
+    return -1;
+  }
+
+  int sock = CONNECT_IN_PROGRESS;
+  struct epoll_event events[8];
+  int num_events = 0;
+  while (!_msg_q.is_terminated())
+  {
+    uint64_t wake_ns;
+    sock = continue_connecting(events, num_events, wake_ns);
+    if (sock != CONNECT_IN_PROGRESS)
+    {
+      break;
+    }
+
+    uint64_t now = SASThreadStats::now_ns();
+    int timeout_ms = (wake_ns > now) ? (int)((wake_ns - now + 999999) / 1000000) : 0;
+    num_events = epoll_wait(_epoll_fd, events, 8, timeout_ms);
+    for (int ii = 0; ii < num_events; ++ii)
+    {
+      if (events[ii].data.fd == _notify_fd)
+      {
+        _msg_q.clear_notify_fd();
+      }
+    }
+  }
+
+  abandon_connecting();
+
+  return (sock >= 0) ? sock : -1;
+}
+
+
+// Look up SAS's addresses and get ready to try them.
+//
+// @returns false if there are none to try.
+bool SAS::Connection::start_connecting(const char* sas_address, const char* sas_port)
+{
+  SAS_LOG_INFO("Attempting to connect to SAS %s", sas_address);
+
+  _connect_addresses.clear();
+  if (!_resolver->resolve(sas_address, sas_port, _connect_addresses))
+  {
+    return false;
+  }
+  order_addresses(_connect_addresses, _address_family);
+  if (_connect_addresses.empty())
+  {
+    SAS_LOG_ERROR("No addresses of the permitted family for SAS %s", sas_address);
+    return false;
+  }
+
+  uint64_t now = SASThreadStats::now_ns();
+  _connect_deadline_ns = now + _connect_timeout_ns;
+  _connect_next_attempt_ns = now;
+  _connect_next_address = 0;
+  return true;
+}
+
+
+// Handle the epoll events for the connection attempts (ignoring any others),
+// and start attempts to more addresses as they become due.
+//
+// @param wake_ns
+//     Set to when this next needs calling, if the attempts are still in
+//     progress.
+//
+// @returns the connected socket (in non-blocking mode), -1 on failure, or
+// CONNECT_IN_PROGRESS.
+int SAS::Connection::continue_connecting(const struct epoll_event* events,
+                                         int num_events,
+                                         uint64_t& wake_ns)
+{
+  int sock = -1;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    int fd = events[ii].data.fd;
+    std::vector<int>::iterator attempt =
+      std::find(_connect_attempts.begin(), _connect_attempts.end(), fd);
+    if (attempt == _connect_attempts.end())
+    {
+      continue;
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    _connect_attempts.erase(attempt);
+
+    if ((error == 0) && (sock < 0))
+    {
+      sock = fd;
+    }
+    else
+    {
+      if (error != 0)
+      {
+        SAS_LOG_DEBUG("Failed to connect to SAS %s:%s: %d %s",
+                      _sas_address.c_str(), _sas_port.c_str(), error, ::strerror(error));
+
+        // Try the next address straight away.
+        _connect_next_attempt_ns = 0;
+      }
+      ::close(fd);
+    }
+  }
+
+  if (sock >= 0)
+  {
+    return sock;
+  }
+
+  while (true)
+  {
+    uint64_t now = SASThreadStats::now_ns();
+
+    if ((now >= _connect_next_attempt_ns) &&
+        (_connect_next_address < _connect_addresses.size()))
+    {
+      int attempt = start_connect(_connect_addresses[_connect_next_address++]);
+      if (attempt >= 0)
+      {
+        _connect_attempts.push_back(attempt);
+        _connect_next_attempt_ns = now + CONNECTION_ATTEMPT_DELAY_NS;
+      }
+      continue;
+    }
+
+    if ((_connect_attempts.empty()) &&
+        (_connect_next_address >= _connect_addresses.size()))
+    {
+      SAS_LOG_ERROR("Failed to connect to SAS %s:%s", _sas_address.c_str(), _sas_port.c_str());
+      return -1;
+    }
+
+    if (now >= _connect_deadline_ns)
     {
-      SAS_LOG_ERROR("Error connecting to SAS - Resource Identifier is longer than %d characters.",
-                    MAX_RESOURCE_ID_LEN);
-      return SAS_INIT_RC_ERR;
+      SAS_LOG_ERROR("Timed out connecting to SAS %s:%s", _sas_address.c_str(), _sas_port.c_str());
+      return -1;
     }
 
-    _connection = new Connection(system_name,
-                                 system_type,
-                                 resource_identifier,
-                                 sas_address);
+    wake_ns = _connect_deadline_ns;
+    if ((_connect_next_address < _connect_addresses.size()) &&
+        (_connect_next_attempt_ns < wake_ns))
+    {
+      wake_ns = _connect_next_attempt_ns;
+    }
+    return CONNECT_IN_PROGRESS;
   }
-
-  return SAS_INIT_RC_OK;
 }
 
 
-void SAS::term()
+// Abandon any connection attempts still in progress.
+void SAS::Connection::abandon_connecting()
 {
-  delete _connection;
-  _connection = NULL;
+  for (size_t ii = 0; ii < _connect_attempts.size(); ++ii)
+  {
+    ::close(_connect_attempts[ii]);
+  }
+  _connect_attempts.clear();
+  _connect_addresses.clear();
 }
 
 
-SAS::Connection::Connection(const std::string& system_name,
-                            const std::string& system_type,
-                            const std::string& resource_identifier,
-                            const std::string& sas_address) :
-  _system_name(system_name),
-  _system_type(system_type),
-  _resource_identifier(resource_identifier),
-  _sas_address(sas_address),
-  _msg_q(MAX_MSG_QUEUE, false),
-  _writer(0),
-  _sock(-1)
+// Set the socket options that bound how long a dead connection to SAS can go
+// unnoticed (TCP_USER_TIMEOUT limits how long sent data can go
+// unacknowledged, and keepalives probe the connection while it's idle), and
+// the ones that tune it for throughput.  Failures are ignored - the socket
+// may not be TCP if it came from the socket callback.
+void SAS::Connection::configure_socket()
 {
-  // Open the queue for input
-  _msg_q.open();
+  _corked = false;
+  _zerocopy = false;
+  _zerocopy_next_id = 0;
+  _zerocopy_inflight.clear();
 
-  // Spawn a thread to open and write to the SAS connection.
-  int rc = pthread_create(&_writer, NULL, &writer_thread, this);
+  if (_send_buffer_bytes > 0)
+  {
+    setsockopt(_sock, SOL_SOCKET, SO_SNDBUF, &_send_buffer_bytes, sizeof(_send_buffer_bytes));
+  }
 
-  if (rc < 0)
+  int on = 1;
+  if (_tcp_batching == Options::TcpBatching::NoDelay)
   {
-    // LCOV_EXCL_START
-    SAS_LOG_ERROR("Error creating SAS thread");
-    // LCOV_EXCL_STOP
+    setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  else if (_tcp_batching == Options::TcpBatching::Cork)
+  {
+    _corked = (setsockopt(_sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0);
+  }
+
+  if (_notsent_lowat_bytes > 0)
+  {
+    setsockopt(_sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &_notsent_lowat_bytes, sizeof(_notsent_lowat_bytes));
+  }
+
+  if (_zerocopy_min_bytes > 0)
+  {
+    _zerocopy = (setsockopt(_sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+    if (!_zerocopy)
+    {
+      SAS_LOG_WARNING("Zerocopy not supported on SAS connection to %s:%s: %d %s",
+                      _sas_address.c_str(), _sas_port.c_str(), errno, ::strerror(errno));
+    }
+  }
+
+  if (_tcp_user_timeout_ms > 0)
+  {
+    unsigned int timeout = _tcp_user_timeout_ms;
+    setsockopt(_sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+  }
+
+  if (_keepalive_interval_ms > 0)
+  {
+    int interval_s = std::max(_keepalive_interval_ms / 1000, 1);
+    int probes = KEEPALIVE_PROBES;
+    setsockopt(_sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(_sock, IPPROTO_TCP, TCP_KEEPIDLE, &interval_s, sizeof(interval_s));
+    setsockopt(_sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+    setsockopt(_sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
   }
 }
 
 
-SAS::Connection::~Connection()
+// Read (and discard) anything SAS has sent on the socket, and check whether
+// SAS has closed the connection.
+//
+// @returns false if the connection has been closed or has failed.
+bool SAS::Connection::check_socket()
 {
-  // Close off the queue.
-  _msg_q.close();
+  if (!_file_path.empty())
+  {
+    // Failures writing to files and pipes are picked up when writing.
+    return true;
+  }
 
-  if (_writer != 0)
+  if (_zerocopy)
   {
-    // Signal the writer thread to disconnect the socket and end.
-    _msg_q.terminate();
+    reap_zerocopy();
+  }
 
-    // If we haven't yet connected, we can cancel the thread - there's
-    // no risk of truncating data mid-write. This prevents termination
-    // from taking an unnecessarily long time when SAS is unreachable
-    // (which would happen if we didn't cancel the thread and instead
-    // waited for connect() to time out).
-    if (!_connected)
+  char buf[256];
+  while (true)
+  {
+    ssize_t len = ::recv(_sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len > 0)
     {
-      pthread_cancel(_writer);
+      continue;
+    }
+    else if (len == 0)
+    {
+      SAS_LOG_ERROR("SAS %s:%s closed the connection", _sas_address.c_str(), _sas_port.c_str());
+      return false;
+    }
+    else if (errno == EINTR)
+    {
+      continue;
+    }
+    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      return true;
     }
 
-    // Wait for the writer thread to exit.
-    pthread_join(_writer, NULL);
-
-    _writer = 0;
+    SAS_LOG_ERROR("SAS connection to %s:%s failed: %d %s", _sas_address.c_str(), _sas_port.c_str(), errno, ::strerror(errno));
+    return false;
   }
 }
 
 
-void* SAS::Connection::writer_thread(void* p)
+// Send the partial segment held back by TCP_CORK, once everything pending
+// has been written.  Clearing the option pushes it out, and it's then set
+// again for the next batch.
+void SAS::Connection::push_corked()
 {
-  ((SAS::Connection*)p)->writer();
-  return NULL;
+  int off = 0;
+  int on = 1;
+  setsockopt(_sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+  setsockopt(_sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
 }
 
 
-void SAS::Connection::writer()
+// Read the kernel's notifications that it has finished with the messages
+// from zerocopy sends off the socket's error queue.  Each notification
+// covers a range of send IDs.
+void SAS::Connection::reap_zerocopy()
 {
   while (true)
   {
-    int reconnect_timeout = 10000;  // If connect fails, retry every 10 seconds.
-    _connected = false;
-    if (connect_init())
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (::recvmsg(_sock, &msg, MSG_ERRQUEUE) < 0)
     {
-      _connected = true;
-      // Now can start dequeuing and sending data.
-      std::string msg;
-      while ((_sock > 0) && _msg_q.pop(msg, 1000))
+      if (errno == EINTR)
       {
-        if (msg.empty())
-        {
-          // No real messages for a second, so send a heartbeat message
-          msg = SAS::heartbeat_msg();
-        }
-
-        int len = msg.length();
-        char* buf = (char*)msg.data();
-        while (len > 0)
-        {
-          int flags = 0;
-#ifdef MSG_NOSIGNAL
-          flags |= MSG_NOSIGNAL;
-#endif
-          int nsent = ::send(_sock, buf, len, flags);
-          if (nsent > 0)
-          {
-            len -= nsent;
-            buf += nsent;
-          }
-          else if ((nsent < 0) && (errno != EINTR))
-          {
-            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
-            {
-              // The send timeout has expired, so close the socket so we
-              // try to connect again (and avoid buffering data while waiting
-              // for long TCP timeouts).
-              SAS_LOG_ERROR("SAS connection to %s:%s locked up: %d %s", _sas_address.c_str(), SAS_PORT, errno, ::strerror(errno));
-            }
-            else
-            {
-              // The socket has failed.
-              SAS_LOG_ERROR("SAS connection to %s:%s failed: %d %s", _sas_address.c_str(), SAS_PORT, errno, ::strerror(errno));
-            }
-            ::close(_sock);
-            _sock = -1;
-            break;
-          }
-        }
-        msg.clear();
+        continue;
       }
+      return;
+    }
 
-      // Terminate the socket.
-      ::close(_sock);
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+            ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))))
+      {
+        continue;
+      }
 
-      if (_msg_q.is_terminated())
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if ((err.ee_errno != 0) || (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY))
       {
-        // Received a termination signal on the queue, so exit.
-        break;
+        continue;
       }
 
-      // Try reconnecting after 1 second after a failure.
-      reconnect_timeout = 1000;
-    }
+      // The range is inclusive, and the IDs wrap.
+      uint32_t first = err.ee_info;
+      uint32_t count = err.ee_data - first + 1;
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+      {
+        _zerocopy_copied.fetch_add(count, std::memory_order_relaxed);
+      }
 
-    // Wait for the specified timeout before trying to
-    // reconnect.
-    SAS_LOG_DEBUG("Waiting to reconnect to SAS - timeout = %d", reconnect_timeout);
-    while (reconnect_timeout > 0 && !_msg_q.is_terminated())
-    {
-      usleep(1000 * 1000);
-      reconnect_timeout -= 1000;
-    }
-    if (_msg_q.is_terminated())
-    {
-      // Received a termination signal on the queue, so exit.
-      break;
+      std::deque<std::pair<uint32_t, uint64_t> >::iterator it = _zerocopy_inflight.begin();
+      while (it != _zerocopy_inflight.end())
+      {
+        if ((uint32_t)(it->first - first) < count)
+        {
+          it = _zerocopy_inflight.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
     }
   }
 }
 
-bool SAS::Connection::set_send_timeout(int sock, int timeout_secs)
+
+// Open the file (or pipe) for a file:// address.  The file is truncated when
+// first opened, and appended to if it's reopened after a write failure.  A
+// pipe is opened non-blocking, so that this fails (and is retried after the
+// usual reconnection delay) rather than hanging if there's no reader.
+//
+// @returns the file descriptor, or -1 if the file couldn't be opened.
+int SAS::Connection::open_file()
 {
-  // Set a maximum send timeout on the socket so we don't wait forever if the
-  // connection fails.
-  struct timeval timeout;
-  timeout.tv_sec = timeout_secs;
-  timeout.tv_usec = 0;
+  int flags = O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC;
+  if (_connects.load(std::memory_order_relaxed) == 0)
+  {
+    flags |= O_TRUNC;
+  }
 
-  int rc = ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-                    sizeof(timeout));
+  int fd = ::open(_file_path.c_str(), flags, 0644);
+  if (fd < 0)
+  {
+    SAS_LOG_ERROR("Failed to open SAS output file %s: %d %s",
+                  _file_path.c_str(), errno, ::strerror(errno));
+  }
 
-  return (rc == 0);
+  return fd;
 }
 
-int SAS::Connection::get_local_sock(const char* sas_address, const char* sas_port)
-{
-  int rc;
-  struct addrinfo hints, *addrs;
-
-  SAS_LOG_INFO("Attempting to connect to SAS %s", sas_address);
 
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
+// Start a non-blocking connect to an address, adding the socket to the
+// writer's epoll set to wait for it to complete.
+//
+// @returns the socket, or -1 if the connect couldn't be started.
+int SAS::Connection::start_connect(const SASResolvedAddress& address)
+{
+  int sock = ::socket(address.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    SAS_LOG_DEBUG("Failed to open socket: %d %s", errno, ::strerror(errno));
+    return -1;
+  }
 
-  rc = getaddrinfo(sas_address, sas_port, &hints, &addrs);
+  int rc = ::connect(sock, (const struct sockaddr*)&address.addr, address.len);
+  if ((rc < 0) && (errno != EINPROGRESS))
+  {
+    SAS_LOG_DEBUG("Failed to connect to address: %d %s", errno, ::strerror(errno));
+    ::close(sock);
+    return -1;
+  }
 
-  if (rc != 0)
+  // Even if the connect completed immediately, let epoll report it so all
+  // the attempts are handled the same way.
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT;
+  ev.data.fd = sock;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0)
   {
-    SAS_LOG_ERROR("Failed to get addresses for SAS %s:%s : %d %s",
-                  sas_address, sas_port, errno, ::strerror(errno));
+    ::close(sock);
     return -1;
   }
 
-  struct addrinfo *p;
+  return sock;
+}
 
-  int sock;
 
-  // Reset the return code to error
-  rc = 1;
+// Order the addresses to try.  Addresses of a family that isn't allowed are
+// removed, and the rest alternate between families as recommended by RFC
+// 8305, so that a broken family doesn't hold up connecting over the other.
+// The first address is of the preferred family, if there is one, or else is
+// the first address returned by the resolver.
+void SAS::Connection::order_addresses(std::vector<SASResolvedAddress>& addresses,
+                                      Options::AddressFamily preference)
+{
+  int first_family = addresses.empty() ? AF_UNSPEC : addresses[0].family;
+  int preferred_family = AF_UNSPEC;
+  bool only_preferred = false;
+  switch (preference)
+  {
+  case Options::AddressFamily::PreferIPv4:
+    preferred_family = AF_INET;
+    break;
+  case Options::AddressFamily::PreferIPv6:
+    preferred_family = AF_INET6;
+    break;
+  case Options::AddressFamily::IPv4Only:
+    preferred_family = AF_INET;
+    only_preferred = true;
+    break;
+  case Options::AddressFamily::IPv6Only:
+    preferred_family = AF_INET6;
+    only_preferred = true;
+    break;
+  default:
+    break;
+  }
 
-  for (p = addrs; p != NULL; p = p->ai_next)
+  std::vector<SASResolvedAddress> first;
+  std::vector<SASResolvedAddress> other;
+  for (size_t ii = 0; ii < addresses.size(); ++ii)
   {
-    if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+    if (addresses[ii].family == preferred_family)
     {
-      // There was an error opening the socket - try the next address
-      SAS_LOG_DEBUG("Failed to open socket");
-      continue;
+      first_family = preferred_family;
+      break;
+    }
+  }
+  for (size_t ii = 0; ii < addresses.size(); ++ii)
+  {
+    if (addresses[ii].family == first_family)
+    {
+      first.push_back(addresses[ii]);
+    }
+    else
+    {
+      other.push_back(addresses[ii]);
     }
+  }
+  if ((only_preferred) && (first_family != preferred_family))
+  {
+    first.clear();
+  }
+  if (only_preferred)
+  {
+    other.clear();
+  }
 
-    if (!set_send_timeout(sock, SEND_TIMEOUT))
+  addresses.clear();
+  for (size_t ii = 0; ii < std::max(first.size(), other.size()); ++ii)
+  {
+    if (ii < first.size())
     {
-      SAS_LOG_ERROR("Failed to set send timeout on SAS connection : %d %d %s",
-                                                 rc, errno, ::strerror(errno));
-      ::close(sock);
-      sock = -1;
-      continue;
+      addresses.push_back(first[ii]);
+    }
+    if (ii < other.size())
+    {
+      addresses.push_back(other[ii]);
     }
+  }
+}
 
-    rc = ::connect(sock, p->ai_addr, p->ai_addrlen);
 
-    if (rc < 0)
+// Work out the file to write to from the SAS address, if it's a file://
+// address.  Each connection in the pool needs its own file.
+void SAS::Connection::set_file_path()
+{
+  _file_path.clear();
+  if (is_file_address(_sas_address))
+  {
+    _file_path = _sas_address.substr(strlen(FILE_ADDRESS_PREFIX));
+    if (_index > 0)
     {
-      // There was an error connecting - try the next address
-      SAS_LOG_DEBUG("Failed to connect to address: %s", p->ai_addr);
-      ::close(sock);
-      sock = -1;
-      continue;
+      _file_path += "." + std::to_string(_index);
     }
-
-    // Connection successful at this point
-    break;
   }
+}
 
-  if (rc != 0)
+
+// Pick up the address set by set_address, if there is one.  Called on the
+// writer thread while disconnected.
+void SAS::Connection::apply_address()
+{
+  if (!_address_changed.load())
   {
-    SAS_LOG_ERROR("Failed to connect to SAS %s:%s : %d %s", sas_address, sas_port, errno, ::strerror(errno));
-    return -1;
+    return;
   }
 
-  freeaddrinfo(addrs);
+  pthread_mutex_lock(&_address_lock);
+  _sas_address = _next_sas_address;
+  _sas_port = _next_sas_port;
+  _address_changed.store(false);
+  pthread_mutex_unlock(&_address_lock);
 
-  return sock;
+  set_file_path();
+  if ((!_file_path.empty()) && (!_application_driven))
+  {
+    block_sigpipe();
+  }
+
+  SAS_LOG_INFO("Moving SAS connection to %s:%s", _sas_address.c_str(), _sas_port.c_str());
 }
 
 
 bool SAS::Connection::connect_init()
 {
-  if (_socket_callback)
+  apply_address();
+
+  if (!_file_path.empty())
   {
-    _sock = _socket_callback(_sas_address.c_str(), SAS_PORT);
+    _sock = open_file();
+  }
+  else if (_socket_callback)
+  {
+    _sock = _socket_callback(_sas_address.c_str(), _sas_port.c_str());
   }
   else
   {
-    _sock = get_local_sock(_sas_address.c_str(), SAS_PORT);
+    _sock = get_local_sock(_sas_address.c_str(), _sas_port.c_str());
   }
 
+  return finish_connect();
+}
+
+
+// Set up the newly opened socket (or file), and queue the INIT message.
+//
+// @returns false if the socket couldn't be opened or set up.
+bool SAS::Connection::finish_connect()
+{
   if (_sock < 0)
   {
+    _connect_failures.fetch_add(1, std::memory_order_relaxed);
     return false;
   }
 
-  SAS_LOG_DEBUG("Connected SAS socket to %s:%s", _sas_address.c_str(), SAS_PORT);
-  set_send_timeout(_sock, SEND_TIMEOUT);
+  SAS_LOG_DEBUG("Connected SAS socket to %s:%s", _sas_address.c_str(), _sas_port.c_str());
+
+  if (_file_path.empty())
+  {
+    configure_socket();
+  }
+
+  // Switch the socket to non-blocking mode and add it to the writer's epoll
+  // set.  It's edge-triggered - we only wait for it to become writable after
+  // a send has failed with EAGAIN.  It's also watched for readability and
+  // hangup, so that SAS closing the connection is noticed straight away
+  // rather than on a later send.  Regular files can't be polled (epoll_ctl
+  // fails with EPERM) but never return EAGAIN, so don't need to be.
+  int flags = fcntl(_sock, F_GETFL, 0);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = _sock;
+  if ((flags < 0) ||
+      (fcntl(_sock, F_SETFL, flags | O_NONBLOCK) < 0) ||
+      ((epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _sock, &ev) < 0) &&
+       ((errno != EPERM) || (_file_path.empty()))))
+  {
+    SAS_LOG_ERROR("Failed to set up SAS socket for %s:%s: %d %s", _sas_address.c_str(), _sas_port.c_str(), errno, ::strerror(errno));
+    ::close(_sock);
+    _sock = -1;
+    _connect_failures.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
 
   // Send an init message to SAS.
   std::string init;
@@ -451,59 +3715,172 @@ bool SAS::Connection::connect_init()
   write_int8(init, (uint8_t)resource_version.length());
   write_data(init, resource_version.length(), resource_version.data());
 
+  // Send the INIT message ahead of anything left pending from a previous
+  // connection.
   SAS_LOG_DEBUG("Sending SAS INIT message");
+  _pending_bytes += init.length();
+  _pending.push_front(std::move(init));
 
-  int rc = ::send(_sock, init.data(), init.length(), 0);
-  if (rc < 0)
+  SAS_LOG_INFO("Connected to SAS %s:%s", _sas_address.c_str(), _sas_port.c_str());
+  _connects.fetch_add(1, std::memory_order_relaxed);
+
+  return true;
+}
+
+
+void SAS::Connection::send_msg(std::string msg)
+{
+  SASStatsTimer timer(SASThreadStats::ENQUEUE);
+  if (_application_driven)
   {
-    SAS_LOG_ERROR("SAS connection to %s:%s failed: %d %s", _sas_address.c_str(), SAS_PORT, errno, ::strerror(errno));
-    ::close(_sock);
-    _sock = -1;
-    return false;
+    // Add the message straight to the pending list, up to the queue's
+    // capacity.  It's sent by the next flush or poll_once.
+    unsigned int max_queue_depth = _max_queue_depth.load(std::memory_order_relaxed);
+    if (_draining.load())
+    {
+      _dropped_queue_closed.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if ((max_queue_depth != 0) && (_pending.size() >= max_queue_depth))
+    {
+      _dropped_queue_full.fetch_add(1, std::memory_order_relaxed);
+
+      if (!_discarding.exchange(true))
+      {
+        SAS_LOG_WARNING("SAS message queue full - discarding messages");
+      }
+    }
+    else
+    {
+      _pending_bytes += msg.length();
+      _pending.push_back(std::move(msg));
+      _pending_high_water = std::max(_pending_high_water, (unsigned int)_pending.size());
+      _enqueued.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  else if (_msg_q.push_noblock(std::move(msg)))
+  {
+    _enqueued.fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (!_msg_q.is_open())
+  {
+    _dropped_queue_closed.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    _dropped_queue_full.fetch_add(1, std::memory_order_relaxed);
+
+    if (!_discarding.exchange(true))
+    {
+      SAS_LOG_WARNING("SAS message queue full - discarding messages");
+    }
   }
+}
 
-  SAS_LOG_INFO("Connected to SAS %s:%s", _sas_address.c_str(), SAS_PORT);
 
-  return true;
+void SAS::Connection::get_stats(ConnectionStats& stats)
+{
+  stats.enqueued = _enqueued.load(std::memory_order_relaxed);
+  stats.dropped_queue_full = _dropped_queue_full.load(std::memory_order_relaxed);
+  stats.dropped_queue_closed = _dropped_queue_closed.load(std::memory_order_relaxed);
+  stats.dropped_send_failed = _dropped_send_failed.load(std::memory_order_relaxed);
+  stats.messages_sent = _messages_sent.load(std::memory_order_relaxed);
+  stats.bytes_sent = _bytes_sent.load(std::memory_order_relaxed);
+  stats.connects = _connects.load(std::memory_order_relaxed);
+  stats.reconnects = (stats.connects > 0) ? (stats.connects - 1) : 0;
+  stats.connect_failures = _connect_failures.load(std::memory_order_relaxed);
+  stats.send_lockups = _send_lockups.load(std::memory_order_relaxed);
+  stats.spilled = _spilled.load(std::memory_order_relaxed);
+  stats.dropped_spill_full = _dropped_spill_full.load(std::memory_order_relaxed);
+  stats.requeued = _requeued.load(std::memory_order_relaxed);
+  stats.zerocopy_sends = _zerocopy_sends.load(std::memory_order_relaxed);
+  stats.zerocopy_copied = _zerocopy_copied.load(std::memory_order_relaxed);
+
+  unsigned int depth;
+  unsigned int high_water;
+  _msg_q.depth(depth, high_water);
+  if (_application_driven)
+  {
+    // The pending list stands in for the queue.
+    depth = _pending.size();
+    high_water = _pending_high_water;
+  }
+  stats.queue_depth = depth;
+  stats.queue_high_water = high_water;
 }
 
 
-void SAS::Connection::send_msg(std::string msg)
+bool SAS::get_connection_stats(ConnectionStats& stats)
 {
-  _msg_q.push_noblock(msg);
+  if (_connections)
+  {
+    _connections->get_stats(stats);
+    return true;
+  }
+
+  return false;
 }
 
 
 SAS::TrailId SAS::new_trail(uint32_t instance)
 {
-  TrailId trail = _next_trail_id++;
-  return trail;
+  (void)pthread_once(&trail_block_once, init_trail_block_key);
+  TrailBlock* block = (TrailBlock*)pthread_getspecific(trail_block_key);
+  if (block == NULL)
+  {
+    block = new TrailBlock();
+    block->next = 0;
+    block->end = 0;
+    pthread_setspecific(trail_block_key, block);
+  }
+
+  if (block->next == block->end)
+  {
+    block->next = _next_trail_id.fetch_add(TRAIL_BLOCK_SIZE, std::memory_order_relaxed);
+    block->end = block->next + TRAIL_BLOCK_SIZE;
+  }
+
+  return block->next++;
 }
 
 
 void SAS::report_event(const Event& event)
 {
-  if (_connection)
+  if ((_connections) && (_connections->sampled(event._trail)))
   {
-    _connection->send_msg(event.to_string());
+    std::string msg;
+    {
+      SASStatsTimer timer(SASThreadStats::SERIALIZE);
+      msg = event.to_string();
+    }
+    _connections->send_msg(event._trail, std::move(msg));
   }
 }
 
 
 void SAS::report_analytics(const Analytics& analytics, bool sas_store)
 {
-  if (_connection)
+  if ((_connections) && (_connections->sampled(analytics._trail)))
   {
-    _connection->send_msg(analytics.to_string(sas_store));
+    std::string msg;
+    {
+      SASStatsTimer timer(SASThreadStats::SERIALIZE);
+      msg = analytics.to_string(sas_store);
+    }
+    _connections->send_msg(analytics._trail, std::move(msg));
   }
 }
 
 
 void SAS::report_marker(const Marker& marker, Marker::Scope scope, bool reactivate)
 {
-  if (_connection)
+  if ((_connections) && (_connections->sampled(marker._trail)))
   {
-    _connection->send_msg(marker.to_string(scope, reactivate));
+    std::string msg;
+    {
+      SASStatsTimer timer(SASThreadStats::SERIALIZE);
+      msg = marker.to_string(scope, reactivate);
+    }
+    _connections->send_msg(marker._trail, std::move(msg));
   }
 }
 
@@ -516,10 +3893,62 @@ void SAS::associate_trails(TrailId trail_a,
   write_trail(trail_assoc_msg, trail_a);
   write_trail(trail_assoc_msg, trail_b);
   write_int8(trail_assoc_msg, (uint8_t)scope);
-  if (_connection)
+  if (_connections)
+  {
+    _connections->send_assoc(trail_a, trail_b, std::move(trail_assoc_msg));
+  }
+}
+
+bool SAS::report_serialized(std::string msg)
+{
+  // Check the message is complete, and get its type.
+  if ((msg.length() < (size_t)COMMON_HDR_SIZE) ||
+      ((((uint8_t)msg[0] << 8) | (uint8_t)msg[1]) != (int)msg.length()))
+  {
+    return false;
+  }
+  int type = msg[3];
+
+  // Events, markers, analytics and trail associations all start with a trail
+  // ID after the common header, and trail associations have the second
+  // trail straight after the first.
+  TrailId trails[2] = {0, 0};
+  int num_trails = (type == SAS_MSG_TRAIL_ASSOC) ? 2 : 1;
+  if ((type != SAS_MSG_EVENT) &&
+      (type != SAS_MSG_MARKER) &&
+      (type != SAS_MSG_ANALYTICS) &&
+      (type != SAS_MSG_TRAIL_ASSOC))
+  {
+    return false;
+  }
+
+  if (msg.length() < COMMON_HDR_SIZE + num_trails * sizeof(TrailId))
+  {
+    return false;
+  }
+
+  for (int ii = 0; ii < num_trails; ++ii)
+  {
+    for (size_t jj = 0; jj < sizeof(TrailId); ++jj)
+    {
+      trails[ii] = (trails[ii] << 8) |
+                   (uint8_t)msg[COMMON_HDR_SIZE + (ii * sizeof(TrailId)) + jj];
+    }
+  }
+
+  if (_connections)
   {
-    _connection->send_msg(trail_assoc_msg);
+    if (type == SAS_MSG_TRAIL_ASSOC)
+    {
+      _connections->send_assoc(trails[0], trails[1], std::move(msg));
+    }
+    else if (_connections->sampled(trails[0]))
+    {
+      _connections->send_msg(trails[0], std::move(msg));
+    }
   }
+
+  return true;
 }
 
 std::string SAS::heartbeat_msg()
@@ -651,7 +4080,7 @@ std::string SAS::Event::to_string() const
   write_int32(s, _instance);
   write_params(s);
 
-  return std::move(s);
+  return s;
 }
 
 std::string SAS::Analytics::to_string(bool sas_store) const
@@ -677,7 +4106,7 @@ std::string SAS::Analytics::to_string(bool sas_store) const
   write_data(s, _friendly_id.length(), _friendly_id.data());
   write_params(s);
 
-  return std::move(s);
+  return s;
 }
 
 
@@ -745,7 +4174,7 @@ std::string SAS::Marker::to_string(Marker::Scope scope, bool reactivate) const
   write_int8(s, (uint8_t)scope);
   write_params(s);
 
-  return std::move(s);
+  return s;
 }
 
 
@@ -35,6 +35,7 @@
  */
 
 #include <stdio.h>
+#include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include <netdb.h>
@@ -47,25 +48,30 @@
 
 #include "sas.h"
 #include "sas_internal.h"
+#include "sas_stats.h"
 
 class ZlibCompressor : public SAS::Compressor
 {
 public:
-  ZlibCompressor();
+  ZlibCompressor(const SAS::Options& options, uint32_t generation);
   ~ZlibCompressor();
   std::string compress(const std::string& s, const SAS::Profile* profile);
 
-  static SAS::Compressor* get();
+  static SAS::Compressor* get(uint32_t generation);
+  static SAS::Compressor* create(const SAS::Options& options, uint32_t generation);
 
 private:
-  static const int WINDOW_BITS = 15;
-  static const int MEM_LEVEL = 9;
-
   static void init();
+
+  // The generation of the options the compressor was set up with.
+  uint32_t _generation;
   // Variables with which to store a compressor on a per-thread basis.
   static pthread_once_t _once;
   static pthread_key_t _key;
 
+  // Whether deflateInit2 succeeded.  If not, parameters are sent empty, as
+  // SAS would fail to inflate them if they were sent uncompressed.
+  bool _initialized;
   z_stream _stream;
   char _buffer[4096];
 };
@@ -75,19 +81,19 @@ typedef std::pair<LZ4_stream_t*, struct preserved_hash_table_entry_t*> saved_lz4
 class LZ4Compressor : public SAS::Compressor
 {
 public:
-  LZ4Compressor();
+  LZ4Compressor(const SAS::Options& options, uint32_t generation);
   ~LZ4Compressor();
 
   std::string compress(const std::string& s, const SAS::Profile* profile);
 
-  static SAS::Compressor* get();
+  static SAS::Compressor* get(uint32_t generation);
+  static SAS::Compressor* create(const SAS::Options& options, uint32_t generation);
 
 private:
-  // The default acceleration (1) is sufficient for us and gives best
-  // compression.
-  static const int ACCELERATION = 1;
-
   static void init();
+
+  // The generation of the options the compressor was set up with.
+  uint32_t _generation;
   // Variables with which to store a compressor on a per-thread basis.
   static pthread_once_t _once;
   static pthread_key_t _key;
@@ -97,7 +103,9 @@ private:
   int _buffer_len;
   char* _buffer;
 
-  static const int MAX_BUFFER_SIZE = 131072;
+  // From Options::lz4_acceleration and lz4_max_buffer_bytes.
+  int _acceleration;
+  int _max_buffer_len;
 
   std::unordered_map<const SAS::Profile*, saved_lz4_stream> _saved_streams;
 };
@@ -127,42 +135,59 @@ void LZ4Compressor::init()
   }
 }
 
-/// Get a thread-scope Compressor, or create one if it doesn't exist already.
+/// Get a thread-scope Compressor, or create one if it doesn't exist already
+/// (or was set up before the compression options last changed).
 SAS::Compressor* SAS::Compressor::get(SAS::Profile::Algorithm algorithm)
 {
-  if (algorithm == SAS::Profile::Algorithm::LZ4)
-  {
-    return LZ4Compressor::get();
-  }
-  else
+  uint32_t generation = SAS::_compression_generation.load(std::memory_order_acquire);
+  bool lz4 = (algorithm == SAS::Profile::Algorithm::LZ4);
+  Compressor* compressor = lz4 ? LZ4Compressor::get(generation) :
+                                 ZlibCompressor::get(generation);
+  if (compressor == NULL)
   {
-    return ZlibCompressor::get();
+    SAS::Options options;
+    SAS::get_options(options);
+    compressor = lz4 ? LZ4Compressor::create(options, generation) :
+                       ZlibCompressor::create(options, generation);
   }
+  return compressor;
 }
 
-/// Get a thread-scope Compressor, or create one if it doesn't exist already.
-SAS::Compressor* ZlibCompressor::get()
+/// Get the thread-scope Compressor, or NULL if there isn't one for this
+/// generation of the options.
+SAS::Compressor* ZlibCompressor::get(uint32_t generation)
 {
   (void)pthread_once(&_once, init);
-  Compressor* compressor = (Compressor*)pthread_getspecific(_key);
-  if (compressor == NULL)
-  {
-    compressor = new ZlibCompressor();
-    pthread_setspecific(_key, compressor);
-  }
+  ZlibCompressor* compressor = (ZlibCompressor*)pthread_getspecific(_key);
+  return ((compressor != NULL) && (compressor->_generation == generation)) ?
+           compressor : NULL;
+}
+
+/// Create the thread-scope Compressor, replacing any existing one.
+SAS::Compressor* ZlibCompressor::create(const SAS::Options& options, uint32_t generation)
+{
+  delete (ZlibCompressor*)pthread_getspecific(_key);
+  ZlibCompressor* compressor = new ZlibCompressor(options, generation);
+  pthread_setspecific(_key, compressor);
   return compressor;
 }
 
-/// Get a thread-scope Compressor, or create one if it doesn't exist already.
-SAS::Compressor* LZ4Compressor::get()
+/// Get the thread-scope Compressor, or NULL if there isn't one for this
+/// generation of the options.
+SAS::Compressor* LZ4Compressor::get(uint32_t generation)
 {
   (void)pthread_once(&_once, init);
-  Compressor* compressor = (Compressor*)pthread_getspecific(_key);
-  if (compressor == NULL)
-  {
-    compressor = new LZ4Compressor();
-    pthread_setspecific(_key, compressor);
-  }
+  LZ4Compressor* compressor = (LZ4Compressor*)pthread_getspecific(_key);
+  return ((compressor != NULL) && (compressor->_generation == generation)) ?
+           compressor : NULL;
+}
+
+/// Create the thread-scope Compressor, replacing any existing one.
+SAS::Compressor* LZ4Compressor::create(const SAS::Options& options, uint32_t generation)
+{
+  delete (LZ4Compressor*)pthread_getspecific(_key);
+  LZ4Compressor* compressor = new LZ4Compressor(options, generation);
+  pthread_setspecific(_key, compressor);
   return compressor;
 }
 
@@ -174,34 +199,51 @@ void SAS::Compressor::destroy(void* compressor_ptr)
 }
 
 /// Compressor constructor.  Initializes the zlib compressor.
-ZlibCompressor::ZlibCompressor()
+ZlibCompressor::ZlibCompressor(const SAS::Options& options, uint32_t generation) :
+  _generation(generation),
+  _initialized(false)
 {
+  memset(&_stream, 0, sizeof(_stream));
   _stream.next_in = Z_NULL;
   _stream.avail_in = 0;
   _stream.zalloc = Z_NULL;
   _stream.zfree = Z_NULL;
   _stream.opaque = Z_NULL;
   int rc = deflateInit2(&_stream,
-                        Z_DEFAULT_COMPRESSION,
+                        options.zlib_level,
                         Z_DEFLATED,
-                        WINDOW_BITS,
-                        MEM_LEVEL,
+                        options.zlib_window_bits,
+                        options.zlib_mem_level,
                         Z_DEFAULT_STRATEGY);
   if (rc != Z_OK)
   {
-    SAS_LOG_WARNING("Failed to initialize zlib SAS parameter compressor (rc=%d)", rc);
+    SAS_LOG_WARNING("Failed to initialize zlib SAS parameter compressor (rc=%d) - compressed parameters will be sent empty", rc);
+  }
+  else
+  {
+    _initialized = true;
   }
 }
 
 /// Compressor destructor.  Terminates the zlib compressor.
 ZlibCompressor::~ZlibCompressor()
 {
-  deflateEnd(&_stream);
+  if (_initialized)
+  {
+    deflateEnd(&_stream);
+  }
 }
 
 /// Compresses the specified string using the dictionary from the profile (if non-empty).
 std::string ZlibCompressor::compress(const std::string& s, const SAS::Profile* profile)
 {
+  SASStatsTimer timer(SASThreadStats::COMPRESS);
+
+  if (!_initialized)
+  {
+    return std::string();
+  }
+
   if (profile)
   {
     std::string dictionary = profile->get_dictionary();
@@ -239,14 +281,17 @@ std::string ZlibCompressor::compress(const std::string& s, const SAS::Profile* p
 }
 
 /// Compressor constructor.  Initializes the LZ4 compressor.
-LZ4Compressor::LZ4Compressor():
-  _buffer_len(4096)
+LZ4Compressor::LZ4Compressor(const SAS::Options& options, uint32_t generation):
+  _generation(generation),
+  _buffer_len(4096),
+  _acceleration(options.lz4_acceleration),
+  _max_buffer_len(options.lz4_max_buffer_bytes)
 {
   _buffer = (char*)malloc(_buffer_len);
   _stream = LZ4_createStream();
   if (_stream == NULL)
   {
-    SAS_LOG_WARNING("Failed to initialize LZ4 SAS parameter compressor");
+    SAS_LOG_WARNING("Failed to initialize LZ4 SAS parameter compressor - compressed parameters will be sent empty");
   }
 }
 
@@ -272,6 +317,13 @@ LZ4Compressor::~LZ4Compressor()
 /// Compresses the specified string using the dictionary from the profile (if non-empty).
 std::string LZ4Compressor::compress(const std::string& s, const SAS::Profile* profile)
 {
+  SASStatsTimer timer(SASThreadStats::COMPRESS);
+
+  if (_stream == NULL)
+  {
+    return std::string();
+  }
+
   // Get (or create) our saved stream with a pre-loaded dictionary
   std::unordered_map<const SAS::Profile*, saved_lz4_stream>::iterator saved_stream_iterator;
   if (profile)
@@ -312,7 +364,7 @@ std::string LZ4Compressor::compress(const std::string& s, const SAS::Profile* pr
                                                     _buffer,
                                                     s.length(),
                                                     _buffer_len,
-                                                    ACCELERATION);
+                                                    _acceleration);
 
     if (compressed_len <= 0)
     {
@@ -323,13 +375,13 @@ std::string LZ4Compressor::compress(const std::string& s, const SAS::Profile* pr
 
       int new_buffer_length = _buffer_len * 2;
 
-      if (new_buffer_length > MAX_BUFFER_SIZE)
+      if (new_buffer_length > _max_buffer_len)
       {
         SAS_LOG_WARNING("Attempting to compress %lu bytes of data - won't fit "
-                        "into %lu bytes, proposed new buffer of %lu bytes "
-                        "exceeds maximum of %lu bytes",
+                        "into %d bytes, proposed new buffer of %d bytes "
+                        "exceeds maximum of %d bytes",
                         s.length(), _buffer_len, new_buffer_length,
-                        MAX_BUFFER_SIZE);
+                        _max_buffer_len);
         break;
       }
 
@@ -39,9 +39,16 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <deque>
 #include <queue>
 
+#include "sas_internal.h"
+
 template<class T>
 class SASeventq
 {
@@ -55,7 +62,10 @@ public:
     _q(),
     _writers(0),
     _readers(0),
-    _terminated(false)
+    _terminated(false),
+    _high_water(0),
+    _notify_fd(-1),
+    _notify_armed(false)
   {
     pthread_mutex_init(&_m, NULL);
     pthread_condattr_t cond_attr;
@@ -68,18 +78,83 @@ public:
 
   ~SASeventq()
   {
+    if (_notify_fd != -1)
+    {
+      ::close(_notify_fd);
+    }
   };
 
+  /// Create an eventfd that a reader running an event loop (rather than
+  /// blocking in pop) can wait on.  See pop_batch.
+  ///
+  /// @returns the eventfd, or -1 if it could not be created.
+  int enable_notify_fd()
+  {
+    if (_notify_fd == -1)
+    {
+      _notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return _notify_fd;
+  }
+
+  /// Clear the eventfd once the reader has woken up.
+  void clear_notify_fd()
+  {
+    uint64_t value;
+    (void)!::read(_notify_fd, &value, sizeof(value));
+  }
+
   /// Open the queue for new inputs.
   void open()
   {
-    _open = true;
+    _open.store(true, std::memory_order_relaxed);
   }
 
   /// Close the queue to new inputs.
   void close()
   {
-    _open = false;
+    _open.store(false, std::memory_order_relaxed);
+  }
+
+  /// Change the maximum size of the queue (zero is unlimited).  If the
+  /// queue now holds more than the new maximum, nothing is discarded, but
+  /// no more items are accepted until it has drained below it.
+  void set_max_queue(unsigned int max_queue)
+  {
+    pthread_mutex_lock(&_m);
+
+    _max_queue = max_queue;
+    if (_writers > 0)
+    {
+      pthread_cond_broadcast(&_w_cond);
+    }
+
+    pthread_mutex_unlock(&_m);
+  }
+
+  /// Wake a reader so that it notices a change in state (such as the queue
+  /// having been closed) without anything having been pushed.
+  void wake()
+  {
+    pthread_mutex_lock(&_m);
+
+    if (_readers > 0)
+    {
+      pthread_cond_broadcast(&_r_cond);
+    }
+
+    if (_notify_fd != -1)
+    {
+      notify();
+    }
+
+    pthread_mutex_unlock(&_m);
+  }
+
+  /// Indicates whether the queue is open for new inputs.
+  bool is_open() const
+  {
+    return _open.load(std::memory_order_relaxed);
   }
 
   /// Send a termination signal via the queue.
@@ -87,7 +162,6 @@ public:
   {
     pthread_mutex_lock(&_m);
 
-
     _terminated = true;
 
     // Are there any readers waiting?
@@ -99,6 +173,13 @@ public:
       pthread_cond_broadcast(&_r_cond);
     }
 
+    // Always wake a reader using the eventfd, whether or not it is armed, as
+    // it may be waiting for something else (such as its socket).
+    if (_notify_fd != -1)
+    {
+      notify();
+    }
+
     pthread_mutex_unlock(&_m);
   }
 
@@ -131,7 +212,7 @@ public:
 
     pthread_mutex_lock(&_m);
 
-    if (_open)
+    if (_open.load(std::memory_order_relaxed))
     {
       if (_max_queue != 0)
       {
@@ -145,13 +226,18 @@ public:
       }
 
       // Must be space on the queue now.
-      _q.push(item);
+      _q.push(std::move(item));
+      update_high_water();
 
       // Are there any readers waiting?
       if (_readers > 0)
       {
         pthread_cond_signal(&_r_cond);
       }
+      else if (_notify_armed)
+      {
+        notify();
+      }
 
       rc = true;
     }
@@ -170,16 +256,21 @@ public:
 
     pthread_mutex_lock(&_m);
 
-    if ((_open) && ((_max_queue == 0) || (_q.size() < _max_queue)))
+    if ((_open.load(std::memory_order_relaxed)) && ((_max_queue == 0) || (_q.size() < _max_queue)))
     {
       // There is space on the queue.
-      _q.push(item);
+      _q.push(std::move(item));
+      update_high_water();
 
       // Are there any readers waiting?
       if (_readers > 0)
       {
         pthread_cond_signal(&_r_cond);
       }
+      else if (_notify_armed)
+      {
+        notify();
+      }
 
       rc = true;
     }
@@ -287,6 +378,43 @@ public:
     return !_terminated;
   };
 
+  /// Pop a batch of items from the event queue without blocking, appending
+  /// them to the supplied deque.  If the queue is empty, the eventfd (see
+  /// enable_notify_fd) is armed so that it becomes readable when the next
+  /// item is pushed.
+  ///
+  /// @param max_items Maximum number of items to pop.
+  /// @returns false if the queue has been terminated.
+  bool pop_batch(std::deque<T>& items, unsigned int max_items)
+  {
+    pthread_mutex_lock(&_m);
+
+    if (_q.empty())
+    {
+      _notify_armed = true;
+    }
+    else
+    {
+      for (unsigned int ii = 0; (ii < max_items) && (!_q.empty()); ++ii)
+      {
+        items.push_back(std::move(_q.front()));
+        _q.pop();
+      }
+
+      if ((_max_queue != 0) &&
+          (_q.size() < _max_queue) &&
+          (_writers > 0))
+      {
+        pthread_cond_broadcast(&_w_cond);
+      }
+    }
+
+    bool terminated = _terminated;
+    pthread_mutex_unlock(&_m);
+
+    return !terminated;
+  };
+
   /// Peek at the item at the front of the event queue.
   T peek() const
   {
@@ -298,19 +426,73 @@ public:
     return _q.size();
   };
 
+  /// Get the current depth of the queue and the highest it has been.  Unlike
+  /// size(), this is safe to call while other threads are using the queue.
+  void depth(unsigned int& current, unsigned int& high_water)
+  {
+    pthread_mutex_lock(&_m);
+    current = _q.size();
+    high_water = _high_water;
+    pthread_mutex_unlock(&_m);
+  }
+
 private:
 
-  bool _open;
+  // Wake a reader waiting on the eventfd.  Must be called with the mutex
+  // held.
+  void notify()
+  {
+    uint64_t one = 1;
+    (void)!::write(_notify_fd, &one, sizeof(one));
+    _notify_armed = false;
+  }
+
+  // Must be called with the mutex held.
+  void update_high_water()
+  {
+    if (_q.size() > _high_water)
+    {
+      _high_water = _q.size();
+    }
+  }
+
+  // The members are laid out so that state written by different threads
+  // doesn't share cache lines.  The padding at each end also keeps the queue
+  // clear of whatever it is embedded in.
+  char _pad0[SAS_CACHE_LINE_SIZE];
+
+  // Read-mostly configuration.  _open is read by producers on every push,
+  // but only written when the queue is opened or closed.  It's atomic as
+  // is_open reads it without the lock.
+  std::atomic<bool> _open;
   unsigned int _max_queue;
+
+  char _pad1[SAS_CACHE_LINE_SIZE];
+
+  // The mutex and the state it protects, which is only accessed with the
+  // mutex held, so shares its cache lines with it.
+  pthread_mutex_t _m;
   std::queue<T> _q;
   int _writers;
   int _readers;
   bool _terminated;
+  unsigned int _high_water;
 
-  pthread_mutex_t _m;
+  // Eventfd used to wake a reader running an event loop, and whether that
+  // reader is waiting for it (that is, found the queue empty).
+  int _notify_fd;
+  bool _notify_armed;
+
+  char _pad2[SAS_CACHE_LINE_SIZE];
+
+  // Condition variables waited on by blocked producers and consumers
+  // respectively.  Waiting writes to the condition variable, so keep them
+  // apart.
   pthread_cond_t _w_cond;
+  char _pad3[SAS_CACHE_LINE_SIZE];
   pthread_cond_t _r_cond;
 
+  char _pad4[SAS_CACHE_LINE_SIZE];
 };
 
 #endif
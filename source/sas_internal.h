@@ -44,15 +44,21 @@
 #define SAS_LOG_WARNING(...) SAS_LOG(SAS::SASCLIENT_LOG_WARNING, __FILE__, __LINE__, __VA_ARGS__)
 #define SAS_LOG_INFO(...) SAS_LOG(SAS::SASCLIENT_LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
 #define SAS_LOG_DEBUG(...) SAS_LOG(SAS::SASCLIENT_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define SAS_LOG_TRACE(...) SAS_LOG(SAS::SASCLIENT_LOG_STATS, __FILE__, __LINE__, __VA_ARGS__)
+#define SAS_LOG_TRACE(...) SAS_LOG(SAS::SASCLIENT_LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+#define SAS_LOG_STATS(...) SAS_LOG(SAS::SASCLIENT_LOG_STATS, __FILE__, __LINE__, __VA_ARGS__)
 
 #define SAS_LOG(...) SAS::sasclient_log_callback(__VA_ARGS__)
 
+// Size of a cache line.  Data written by different threads is kept at least
+// this far apart to avoid false sharing.
+const int SAS_CACHE_LINE_SIZE = 64;
+
 // SAS message types.
 const int SAS_MSG_INIT   = 1;
 const int SAS_MSG_TRAIL_ASSOC   = 2;
 const int SAS_MSG_EVENT  = 3;
 const int SAS_MSG_MARKER = 4;
+const int SAS_MSG_HEARTBEAT = 5;
 const int SAS_MSG_ANALYTICS = 7;
 
 // SAS message header sizes
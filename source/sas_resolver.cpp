@@ -0,0 +1,234 @@
+/**
+ * @file sas_resolver.cpp Cached, background DNS resolution of SAS addresses.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <time.h>
+
+#include "sas.h"
+#include "sas_internal.h"
+#include "sas_resolver.h"
+#include "sas_stats.h"
+
+SASResolver::State::State(uint64_t refresh_interval_ns) :
+  stopping(false),
+  refresh_interval_ns(refresh_interval_ns)
+{
+  pthread_mutex_init(&lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+
+SASResolver::State::~State()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+
+SASResolver::SASResolver(int refresh_interval_ms) :
+  _state(new State(refresh_interval_ms * 1000000ull)),
+  _thread(0)
+{
+  // The thread holds its own reference to the shared state.
+  std::shared_ptr<State>* thread_state = new std::shared_ptr<State>(_state);
+  if (pthread_create(&_thread, NULL, &resolver_thread, thread_state) != 0)
+  {
+    // LCOV_EXCL_START
+    SAS_LOG_ERROR("Error creating SAS resolver thread");
+    delete thread_state;
+    _thread = 0;
+    // LCOV_EXCL_STOP
+  }
+}
+
+
+SASResolver::~SASResolver()
+{
+  stop();
+
+  if (_thread != 0)
+  {
+    // Don't wait for the thread, which may be in the middle of a slow DNS
+    // lookup.  It will exit when the lookup completes.
+    pthread_detach(_thread);
+    _thread = 0;
+  }
+}
+
+
+void SASResolver::stop()
+{
+  pthread_mutex_lock(&_state->lock);
+  _state->stopping = true;
+  pthread_cond_broadcast(&_state->cond);
+  pthread_mutex_unlock(&_state->lock);
+}
+
+
+bool SASResolver::resolve(const std::string& host,
+                          const std::string& port,
+                          std::vector<SASResolvedAddress>& addresses)
+{
+  State& state = *_state;
+  pthread_mutex_lock(&state.lock);
+
+  Entry& entry = state.entries[Key(host, port)];
+  if (entry.addresses.empty())
+  {
+    // We don't have any addresses for this host (either because this is the
+    // first time it's been asked for, or because the last lookup failed), so
+    // ask the thread to look it up now and wait for the result.
+    uint64_t lookups = entry.lookups;
+    entry.refresh_ns = 0;
+    pthread_cond_broadcast(&state.cond);
+
+    while ((!state.stopping) && (entry.lookups == lookups))
+    {
+      pthread_cond_wait(&state.cond, &state.lock);
+    }
+  }
+
+  addresses = entry.addresses;
+  bool ok = (!state.stopping) && (!addresses.empty());
+  pthread_mutex_unlock(&state.lock);
+
+  return ok;
+}
+
+
+void* SASResolver::resolver_thread(void* p)
+{
+  std::shared_ptr<State>* state = (std::shared_ptr<State>*)p;
+  run(*state);
+  delete state;
+  return NULL;
+}
+
+
+// The resolver thread.  Looks up each entry when it is due to be refreshed.
+void SASResolver::run(const std::shared_ptr<State>& state)
+{
+  pthread_mutex_lock(&state->lock);
+
+  while (!state->stopping)
+  {
+    // Find the entry that is next due to be refreshed.
+    std::map<Key, Entry>::iterator next = state->entries.end();
+    for (std::map<Key, Entry>::iterator it = state->entries.begin();
+         it != state->entries.end();
+         ++it)
+    {
+      if ((next == state->entries.end()) ||
+          (it->second.refresh_ns < next->second.refresh_ns))
+      {
+        next = it;
+      }
+    }
+
+    if (next == state->entries.end())
+    {
+      pthread_cond_wait(&state->cond, &state->lock);
+      continue;
+    }
+
+    uint64_t now = SASThreadStats::now_ns();
+    if (next->second.refresh_ns > now)
+    {
+      struct timespec attime;
+      attime.tv_sec = next->second.refresh_ns / 1000000000ull;
+      attime.tv_nsec = next->second.refresh_ns % 1000000000ull;
+      pthread_cond_timedwait(&state->cond, &state->lock, &attime);
+      continue;
+    }
+
+    // Do the lookup without holding the lock.  Entries are never removed, so
+    // the iterator remains valid.
+    Key key = next->first;
+    next->second.refresh_ns = now + state->refresh_interval_ns;
+    pthread_mutex_unlock(&state->lock);
+
+    std::vector<SASResolvedAddress> addresses;
+    bool ok = lookup(key, addresses);
+
+    pthread_mutex_lock(&state->lock);
+    if (ok)
+    {
+      next->second.addresses.swap(addresses);
+    }
+    ++next->second.lookups;
+    pthread_cond_broadcast(&state->cond);
+  }
+
+  pthread_mutex_unlock(&state->lock);
+}
+
+
+bool SASResolver::lookup(const Key& key, std::vector<SASResolvedAddress>& addresses)
+{
+  struct addrinfo hints, *addrs;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int rc = getaddrinfo(key.first.c_str(), key.second.c_str(), &hints, &addrs);
+  if (rc != 0)
+  {
+    SAS_LOG_ERROR("Failed to get addresses for SAS %s:%s : %d %s",
+                  key.first.c_str(), key.second.c_str(), rc, gai_strerror(rc));
+    return false;
+  }
+
+  for (struct addrinfo* p = addrs; p != NULL; p = p->ai_next)
+  {
+    SASResolvedAddress address;
+    memset(&address, 0, sizeof(address));
+    address.family = p->ai_family;
+    address.len = p->ai_addrlen;
+    memcpy(&address.addr, p->ai_addr, p->ai_addrlen);
+    addresses.push_back(address);
+  }
+
+  freeaddrinfo(addrs);
+
+  return !addresses.empty();
+}
@@ -0,0 +1,124 @@
+/**
+ * @file sas_resolver.h Cached, background DNS resolution of SAS addresses.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_RESOLVER__
+#define SAS_RESOLVER__
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A resolved address to connect to.
+struct SASResolvedAddress
+{
+  int family;
+  socklen_t len;
+  struct sockaddr_storage addr;
+};
+
+// Caches the results of resolving SAS addresses, and refreshes them on a
+// background thread, so that the writer threads don't have to wait for DNS
+// each time they reconnect.
+//
+// getaddrinfo doesn't report the TTLs of the records it returns, so each
+// cached result is refreshed at a fixed interval.  If a refresh fails, the
+// previous result is kept.
+//
+// The background thread shares the cache with the SASResolver (rather than
+// the SASResolver owning it), so that the SASResolver can be destroyed
+// straight away even if the thread is stuck waiting for DNS.  The thread is
+// detached, and exits once its current lookup completes.
+class SASResolver
+{
+public:
+  SASResolver(int refresh_interval_ms);
+  ~SASResolver();
+
+  /// Get the addresses for a host and port.  If the host has already been
+  /// resolved this returns the cached addresses immediately.  Otherwise it
+  /// waits for the background thread to resolve it.
+  ///
+  /// @returns false if the host can't be resolved or the resolver has been
+  ///          stopped.
+  bool resolve(const std::string& host,
+               const std::string& port,
+               std::vector<SASResolvedAddress>& addresses);
+
+  /// Stop the resolver, waking any threads waiting in resolve.
+  void stop();
+
+private:
+  struct Entry
+  {
+    Entry() : refresh_ns(0), lookups(0) {}
+
+    std::vector<SASResolvedAddress> addresses;
+
+    // When the entry should next be refreshed.
+    uint64_t refresh_ns;
+
+    // Number of lookups completed for the entry.
+    uint64_t lookups;
+  };
+
+  typedef std::pair<std::string, std::string> Key;
+
+  struct State
+  {
+    State(uint64_t refresh_interval_ns);
+    ~State();
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    uint64_t refresh_interval_ns;
+    std::map<Key, Entry> entries;
+  };
+
+  static void* resolver_thread(void* p);
+  static void run(const std::shared_ptr<State>& state);
+  static bool lookup(const Key& key, std::vector<SASResolvedAddress>& addresses);
+
+  std::shared_ptr<State> _state;
+  pthread_t _thread;
+};
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * @file sas_ring.cpp Memory-mapped ring file capturing recent SAS messages.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "sas.h"
+#include "sas_internal.h"
+#include "sas_ring.h"
+
+static const char RING_MAGIC[8] = {'S', 'A', 'S', 'R', 'I', 'N', 'G', '1'};
+
+SASCaptureRing::SASCaptureRing() :
+  _fd(-1),
+  _map(NULL),
+  _map_bytes(0),
+  _header(NULL),
+  _data(NULL),
+  _ring_bytes(0)
+{
+}
+
+
+SASCaptureRing::~SASCaptureRing()
+{
+  close();
+}
+
+
+bool SASCaptureRing::open(const std::string& path,
+                          size_t ring_bytes,
+                          const std::string& system_name,
+                          const std::string& system_type,
+                          const std::string& resource_identifier)
+{
+  close();
+
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (_fd < 0)
+  {
+    SAS_LOG_ERROR("Failed to open SAS capture file %s: %d %s",
+                  path.c_str(), errno, ::strerror(errno));
+    return false;
+  }
+
+  // Allocate the whole file up front, so that writes into the mapping can't
+  // fail (with SIGBUS) because the disk is full.
+  size_t map_bytes = HEADER_BYTES + ring_bytes;
+  int rc = posix_fallocate(_fd, 0, map_bytes);
+  if (rc != 0)
+  {
+    SAS_LOG_ERROR("Failed to allocate %lu bytes for SAS capture file %s: %d %s",
+                  map_bytes, path.c_str(), rc, ::strerror(rc));
+    close();
+    return false;
+  }
+
+  void* map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED)
+  {
+    SAS_LOG_ERROR("Failed to map SAS capture file %s: %d %s",
+                  path.c_str(), errno, ::strerror(errno));
+    close();
+    return false;
+  }
+
+  _map = (char*)map;
+  _map_bytes = map_bytes;
+  _header = (Header*)_map;
+  _data = _map + HEADER_BYTES;
+  _ring_bytes = ring_bytes;
+
+  _header->header_bytes = HEADER_BYTES;
+  _header->ring_bytes = ring_bytes;
+  _header->write_offset.store(0);
+  char* system = _header->system;
+  const std::string* strings[] = {&system_name, &system_type, &resource_identifier};
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    size_t len = std::min(strings[ii]->length(), (size_t)255);
+    *system++ = (char)len;
+    memcpy(system, strings[ii]->data(), len);
+    system += len;
+  }
+
+  // Write the magic last, so a file is only recognized once it's set up.
+  memcpy(_header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+
+  return true;
+}
+
+
+void SASCaptureRing::close()
+{
+  if (_map != NULL)
+  {
+    munmap(_map, _map_bytes);
+    _map = NULL;
+    _header = NULL;
+    _data = NULL;
+  }
+
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+
+void SASCaptureRing::append(const std::string& msg)
+{
+  size_t len = msg.length();
+  if (len > _ring_bytes)
+  {
+    return;
+  }
+
+  uint64_t offset = _header->write_offset.fetch_add(len, std::memory_order_relaxed);
+  size_t start = offset % _ring_bytes;
+  size_t first = std::min(len, _ring_bytes - start);
+  memcpy(_data + start, msg.data(), first);
+  if (first < len)
+  {
+    // Wrap round to the start of the ring.
+    memcpy(_data, msg.data() + first, len - first);
+  }
+}
+
+
+// Get the length of the message at an offset in the ring, from the first two
+// bytes of its header.
+size_t SASCaptureRing::msg_len(const char* data, uint64_t ring_bytes, uint64_t offset)
+{
+  unsigned char hi = data[offset % ring_bytes];
+  unsigned char lo = data[(offset + 1) % ring_bytes];
+  return (hi << 8) | lo;
+}
+
+
+// Check whether there looks to be a valid message at an offset - that is, its
+// length fits before the end of the data, and it has the right version and a
+// known message type.
+bool SASCaptureRing::valid_msg(const char* data, uint64_t ring_bytes, uint64_t offset, uint64_t end)
+{
+  if (end - offset < COMMON_HDR_SIZE)
+  {
+    return false;
+  }
+
+  size_t len = msg_len(data, ring_bytes, offset);
+  unsigned char version = data[(offset + 2) % ring_bytes];
+  unsigned char type = data[(offset + 3) % ring_bytes];
+  return ((len >= COMMON_HDR_SIZE) &&
+          (len <= end - offset) &&
+          (version == 3) &&
+          ((type == SAS_MSG_TRAIL_ASSOC) ||
+           (type == SAS_MSG_EVENT) ||
+           (type == SAS_MSG_MARKER) ||
+           (type == SAS_MSG_ANALYTICS)));
+}
+
+
+// Check whether a run of valid messages starts at the offset.  Used to find
+// the first message boundary when the start of the ring has been partly
+// overwritten.  A run of a few messages (or reaching the end) is good enough
+// to rule out a coincidental match.
+bool SASCaptureRing::chain_ok(const char* data, uint64_t ring_bytes, uint64_t offset, uint64_t end)
+{
+  for (int ii = 0; (ii < 4) && (offset < end); ++ii)
+  {
+    if (!valid_msg(data, ring_bytes, offset, end))
+    {
+      return false;
+    }
+    offset += msg_len(data, ring_bytes, offset);
+  }
+  return true;
+}
+
+
+bool SASCaptureRing::load(const std::string& path, Contents& contents, std::string& error)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    error = std::string("can't open file: ") + ::strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < HEADER_BYTES))
+  {
+    ::close(fd);
+    error = "file too short";
+    return false;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+  {
+    error = std::string("can't map file: ") + ::strerror(errno);
+    return false;
+  }
+
+  const Header* header = (const Header*)map;
+  if ((memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0) ||
+      (header->header_bytes != HEADER_BYTES) ||
+      (header->ring_bytes == 0) ||
+      (HEADER_BYTES + header->ring_bytes > (uint64_t)st.st_size))
+  {
+    munmap(map, st.st_size);
+    error = "not a SAS capture ring file";
+    return false;
+  }
+
+  const char* system = header->system;
+  std::string* strings[] = {&contents.system_name,
+                            &contents.system_type,
+                            &contents.resource_identifier};
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    size_t len = (unsigned char)*system++;
+    strings[ii]->assign(system, len);
+    system += len;
+  }
+
+  // The ring holds the last ring_bytes bytes written (or everything, if it
+  // hasn't filled yet).
+  const char* data = (const char*)map + HEADER_BYTES;
+  uint64_t ring_bytes = header->ring_bytes;
+  uint64_t end = header->write_offset.load();
+  uint64_t offset = (end > ring_bytes) ? end - ring_bytes : 0;
+
+  contents.msgs.clear();
+  contents.skipped_bytes = 0;
+  while (offset < end)
+  {
+    if (!valid_msg(data, ring_bytes, offset, end))
+    {
+      // Either the oldest message has been partly overwritten, or this
+      // message was never completely written.  Skip forward to the next
+      // message boundary.
+      uint64_t skip_start = offset;
+      while ((offset < end) && (!chain_ok(data, ring_bytes, offset, end)))
+      {
+        ++offset;
+      }
+      contents.skipped_bytes += offset - skip_start;
+      continue;
+    }
+
+    size_t len = msg_len(data, ring_bytes, offset);
+    std::string msg;
+    msg.reserve(len);
+    for (size_t start = offset % ring_bytes; msg.length() < len; start = 0)
+    {
+      size_t chunk = std::min(len - msg.length(), (size_t)(ring_bytes - start));
+      msg.append(data + start, chunk);
+    }
+    contents.msgs.push_back(msg);
+    offset += len;
+  }
+
+  munmap(map, st.st_size);
+  return true;
+}
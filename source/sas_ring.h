@@ -0,0 +1,131 @@
+/**
+ * @file sas_ring.h Memory-mapped ring file capturing recent SAS messages.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_RING__
+#define SAS_RING__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// A fixed-size, memory-mapped ring file holding the most recently reported
+// SAS messages, so that they can be recovered (and replayed to SAS, with
+// sas_replay) after the process dies.
+//
+// The file starts with a header page holding the system details that the
+// process connected to SAS with, and the total number of bytes ever written
+// to the ring.  The rest of the file is the ring, holding messages exactly as
+// they would be sent on the wire, each starting with its 2 byte length.
+//
+// Appending a message is lock-free and makes no system calls: the writer
+// reserves space by atomically advancing the write offset, and copies the
+// message into the mapping.  Data written to a shared mapping survives the
+// process crashing (though not the machine).
+class SASCaptureRing
+{
+public:
+  SASCaptureRing();
+  ~SASCaptureRing();
+
+  /// Create (or truncate) and map the file.
+  ///
+  /// @returns false (having logged why) if the file can't be set up.
+  bool open(const std::string& path,
+            size_t ring_bytes,
+            const std::string& system_name,
+            const std::string& system_type,
+            const std::string& resource_identifier);
+  void close();
+
+  /// Copy a message into the ring.  May be called from any thread.
+  void append(const std::string& msg);
+
+  /// The contents of a ring file, as read back by load.
+  struct Contents
+  {
+    std::string system_name;
+    std::string system_type;
+    std::string resource_identifier;
+
+    /// The messages, oldest first.
+    std::vector<std::string> msgs;
+
+    /// Bytes of the ring that couldn't be parsed as messages (because they
+    /// were partly overwritten, or were being written when the process
+    /// died), and so were skipped.
+    uint64_t skipped_bytes;
+  };
+
+  /// Read the messages from a ring file.
+  ///
+  /// @returns false (setting error) if the file isn't a valid ring file.
+  static bool load(const std::string& path, Contents& contents, std::string& error);
+
+private:
+  // The header at the start of the file.  The write offset is on its own
+  // cache line as every producer updates it.
+  struct Header
+  {
+    char magic[8];
+    uint64_t header_bytes;
+    uint64_t ring_bytes;
+    char _pad0[64 - 24];
+    std::atomic<uint64_t> write_offset;
+    char _pad1[64 - sizeof(std::atomic<uint64_t>)];
+
+    // System name, type and resource identifier, each preceded by a length
+    // byte.
+    char system[3 * 256];
+  };
+
+  static const size_t HEADER_BYTES = 4096;
+
+  static bool valid_msg(const char* data, uint64_t ring_bytes, uint64_t offset, uint64_t end);
+  static size_t msg_len(const char* data, uint64_t ring_bytes, uint64_t offset);
+  static bool chain_ok(const char* data, uint64_t ring_bytes, uint64_t offset, uint64_t end);
+
+  int _fd;
+  char* _map;
+  size_t _map_bytes;
+  Header* _header;
+  char* _data;
+  uint64_t _ring_bytes;
+};
+
+#endif
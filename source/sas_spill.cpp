@@ -0,0 +1,169 @@
+/**
+ * @file sas_spill.cpp Memory-mapped overflow file for the SAS message queue.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sas.h"
+#include "sas_internal.h"
+#include "sas_spill.h"
+
+SASSpillFile::SASSpillFile() :
+  _fd(-1),
+  _data(NULL),
+  _size(0),
+  _read_offset(0),
+  _write_offset(0)
+{
+}
+
+
+SASSpillFile::~SASSpillFile()
+{
+  close();
+}
+
+
+bool SASSpillFile::open(const std::string& path, size_t max_bytes)
+{
+  close();
+
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (_fd < 0)
+  {
+    SAS_LOG_ERROR("Failed to open SAS spill file %s: %d %s",
+                  path.c_str(), errno, ::strerror(errno));
+    return false;
+  }
+
+  // Allocate the whole file up front, so that writes into the mapping can't
+  // fail (with SIGBUS) because the disk is full.
+  int rc = posix_fallocate(_fd, 0, max_bytes);
+  if (rc != 0)
+  {
+    SAS_LOG_ERROR("Failed to allocate %lu bytes for SAS spill file %s: %d %s",
+                  max_bytes, path.c_str(), rc, ::strerror(rc));
+    close();
+    return false;
+  }
+
+  void* data = mmap(NULL, max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (data == MAP_FAILED)
+  {
+    SAS_LOG_ERROR("Failed to map SAS spill file %s: %d %s",
+                  path.c_str(), errno, ::strerror(errno));
+    close();
+    return false;
+  }
+
+  _data = (char*)data;
+  _size = max_bytes;
+  _read_offset = 0;
+  _write_offset = 0;
+
+  return true;
+}
+
+
+void SASSpillFile::close()
+{
+  if (_data != NULL)
+  {
+    munmap(_data, _size);
+    _data = NULL;
+  }
+
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  _size = 0;
+  _read_offset = 0;
+  _write_offset = 0;
+}
+
+
+bool SASSpillFile::append(const std::string& msg)
+{
+  if (msg.length() > _size - _write_offset)
+  {
+    return false;
+  }
+
+  memcpy(_data + _write_offset, msg.data(), msg.length());
+  _write_offset += msg.length();
+  return true;
+}
+
+
+size_t SASSpillFile::read(std::deque<std::string>& msgs, size_t max_bytes)
+{
+  size_t bytes = 0;
+
+  while ((bytes < max_bytes) && (_write_offset - _read_offset >= 2))
+  {
+    const unsigned char* hdr = (const unsigned char*)_data + _read_offset;
+    size_t msg_len = (hdr[0] << 8) | hdr[1];
+    if ((msg_len < 2) || (msg_len > _write_offset - _read_offset))
+    {
+      // LCOV_EXCL_START - only messages written by the library are appended
+      SAS_LOG_ERROR("Corrupt message in SAS spill file - discarding %lu bytes",
+                    _write_offset - _read_offset);
+      _read_offset = _write_offset;
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    msgs.push_back(std::string(_data + _read_offset, msg_len));
+    _read_offset += msg_len;
+    bytes += msg_len;
+  }
+
+  if (_read_offset == _write_offset)
+  {
+    // Everything has been read, so start again from the beginning of the
+    // file.
+    _read_offset = 0;
+    _write_offset = 0;
+  }
+
+  return bytes;
+}
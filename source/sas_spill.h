@@ -0,0 +1,96 @@
+/**
+ * @file sas_spill.h Memory-mapped overflow file for the SAS message queue.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_SPILL__
+#define SAS_SPILL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+// An append-only file that a connection's writer thread moves queued
+// messages into when SAS is unreachable (or too slow) and the in-memory
+// queue is filling up, and reads them back from once SAS is accepting data
+// again.
+//
+// The file holds the messages exactly as they would be sent on the wire.
+// Each SAS message starts with its 2 byte length, so no other framing is
+// needed.  The file is mapped into memory, so appending and reading are
+// plain memory copies.  Its full size is allocated on disk when it is
+// opened, which bounds the disk space used and means that writing into the
+// mapping can't fail because the disk has filled up.  Once every message
+// has been read back, the file is reused from the start.
+//
+// Only used by the writer thread, so not thread-safe.
+class SASSpillFile
+{
+public:
+  SASSpillFile();
+  ~SASSpillFile();
+
+  /// Create (or truncate) and map the file.
+  ///
+  /// @returns false (having logged why) if the file can't be set up.
+  bool open(const std::string& path, size_t max_bytes);
+  void close();
+
+  bool is_open() const { return _data != NULL; }
+  bool empty() const { return _read_offset == _write_offset; }
+  size_t used() const { return _write_offset - _read_offset; }
+
+  /// Append a message.
+  ///
+  /// @returns false if there isn't room for it.
+  bool append(const std::string& msg);
+
+  /// Read messages back in the order they were appended, adding them to the
+  /// end of the list, until either the file is empty or the messages read
+  /// total at least max_bytes.
+  ///
+  /// @returns the number of bytes read.
+  size_t read(std::deque<std::string>& msgs, size_t max_bytes);
+
+private:
+  int _fd;
+  char* _data;
+  size_t _size;
+  size_t _read_offset;
+  size_t _write_offset;
+};
+
+#endif
@@ -0,0 +1,312 @@
+/**
+ * @file sas_stats.cpp Implementation of latency statistics for the SAS client
+ * library.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sas.h"
+#include "sas_internal.h"
+#include "sas_stats.h"
+
+bool SASThreadStats::_enabled = false;
+pthread_once_t SASThreadStats::_once = PTHREAD_ONCE_INIT;
+pthread_key_t SASThreadStats::_key = {0};
+pthread_mutex_t SASThreadStats::_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+std::set<SASThreadStats*> SASThreadStats::_registry;
+SAS::Stats SASThreadStats::_retired;
+
+SAS::Histogram::Histogram() :
+  _count(0),
+  _sum(0),
+  _min(UINT64_MAX),
+  _max(0)
+{
+  memset(_counts, 0, sizeof(_counts));
+}
+
+/// Get the bucket a value falls into.  Values smaller than SUB_BUCKETS have a
+/// bucket each; above that there are SUB_BUCKETS buckets per power of two.
+int SAS::Histogram::bucket(uint64_t value)
+{
+  if (value < (uint64_t)SUB_BUCKETS)
+  {
+    return (int)value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  return ((shift + 1) * SUB_BUCKETS) + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t SAS::Histogram::bucket_lowest(int bucket)
+{
+  if (bucket < SUB_BUCKETS)
+  {
+    return bucket;
+  }
+
+  int shift = (bucket / SUB_BUCKETS) - 1;
+  return (uint64_t)(SUB_BUCKETS + (bucket % SUB_BUCKETS)) << shift;
+}
+
+uint64_t SAS::Histogram::bucket_highest(int bucket)
+{
+  if (bucket < SUB_BUCKETS)
+  {
+    return bucket;
+  }
+
+  int shift = (bucket / SUB_BUCKETS) - 1;
+  return bucket_lowest(bucket) + ((1ull << shift) - 1);
+}
+
+void SAS::Histogram::record(uint64_t value, uint64_t count)
+{
+  _counts[bucket(value)] += count;
+  _count += count;
+  _sum += value * count;
+  _min = std::min(_min, value);
+  _max = std::max(_max, value);
+}
+
+void SAS::Histogram::merge(const Histogram& other)
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _counts[ii] += other._counts[ii];
+  }
+  _count += other._count;
+  _sum += other._sum;
+  _min = std::min(_min, other._min);
+  _max = std::max(_max, other._max);
+}
+
+SAS::Histogram SAS::Histogram::delta(const Histogram& earlier) const
+{
+  Histogram result;
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    uint64_t count = _counts[ii] - earlier._counts[ii];
+    if (count > 0)
+    {
+      result._counts[ii] = count;
+      result._count += count;
+      result._min = std::min(result._min, std::max(bucket_lowest(ii), _min));
+      result._max = std::max(result._max, std::min(bucket_highest(ii), _max));
+    }
+  }
+  result._sum = _sum - earlier._sum;
+  return result;
+}
+
+uint64_t SAS::Histogram::percentile(double pct) const
+{
+  if (_count == 0)
+  {
+    return 0;
+  }
+
+  // Find the bucket containing the value at this rank.
+  uint64_t rank = (uint64_t)((pct / 100.0) * _count + 0.5);
+  rank = std::max(rank, (uint64_t)1);
+  uint64_t seen = 0;
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    seen += _counts[ii];
+    if (seen >= rank)
+    {
+      return std::min(bucket_highest(ii), _max);
+    }
+  }
+
+  return _max;
+}
+
+/// Statically initialize the statistics by creating the thread-local key.
+void SASThreadStats::init()
+{
+  int rc = pthread_key_create(&_key, destroy);
+  if (rc != 0)
+  {
+    SAS_LOG_WARNING("Failed to create key for SAS statistics");
+  }
+}
+
+/// Get the thread-scope statistics, or create them if they don't exist
+/// already.
+SASThreadStats* SASThreadStats::get()
+{
+  (void)pthread_once(&_once, init);
+  SASThreadStats* stats = (SASThreadStats*)pthread_getspecific(_key);
+  if (stats == NULL)
+  {
+    stats = new SASThreadStats();
+    pthread_setspecific(_key, stats);
+
+    pthread_mutex_lock(&_registry_lock);
+    _registry.insert(stats);
+    pthread_mutex_unlock(&_registry_lock);
+  }
+  return stats;
+}
+
+/// Destroy a thread's statistics, folding them into the retired totals.
+/// (Called by pthread when a thread terminates.)
+void SASThreadStats::destroy(void* stats_ptr)
+{
+  SASThreadStats* stats = (SASThreadStats*)stats_ptr;
+
+  pthread_mutex_lock(&_registry_lock);
+  _registry.erase(stats);
+  stats->add_to(SERIALIZE, _retired.serialize);
+  stats->add_to(COMPRESS, _retired.compress);
+  stats->add_to(ENQUEUE, _retired.enqueue);
+  pthread_mutex_unlock(&_registry_lock);
+
+  delete stats;
+}
+
+SASThreadStats::SASThreadStats()
+{
+  for (int ii = 0; ii < NUM_CATEGORIES; ++ii)
+  {
+    for (int jj = 0; jj < SAS::Histogram::NUM_BUCKETS; ++jj)
+    {
+      _counts[ii].buckets[jj] = 0;
+    }
+    _counts[ii].count = 0;
+    _counts[ii].sum = 0;
+    _counts[ii].min = UINT64_MAX;
+    _counts[ii].max = 0;
+  }
+}
+
+SASThreadStats::~SASThreadStats()
+{
+}
+
+void SASThreadStats::record(Category category, uint64_t ns)
+{
+  Counts& counts = get()->_counts[category];
+
+  // This thread is the only writer, so there's no need for an atomic
+  // increment - a relaxed load and store is enough for readers on other
+  // threads to see a consistent (if slightly stale) value.
+  std::atomic<uint64_t>& bucket = counts.buckets[SAS::Histogram::bucket(ns)];
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  counts.count.store(counts.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  counts.sum.store(counts.sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+  if (ns < counts.min.load(std::memory_order_relaxed))
+  {
+    counts.min.store(ns, std::memory_order_relaxed);
+  }
+  if (ns > counts.max.load(std::memory_order_relaxed))
+  {
+    counts.max.store(ns, std::memory_order_relaxed);
+  }
+}
+
+void SASThreadStats::add_to(Category category, SAS::Histogram& histogram) const
+{
+  const Counts& counts = _counts[category];
+  SAS::Histogram thread_histogram;
+  for (int ii = 0; ii < SAS::Histogram::NUM_BUCKETS; ++ii)
+  {
+    thread_histogram._counts[ii] = counts.buckets[ii].load(std::memory_order_relaxed);
+  }
+  thread_histogram._count = counts.count.load(std::memory_order_relaxed);
+  thread_histogram._sum = counts.sum.load(std::memory_order_relaxed);
+  thread_histogram._min = counts.min.load(std::memory_order_relaxed);
+  thread_histogram._max = counts.max.load(std::memory_order_relaxed);
+  histogram.merge(thread_histogram);
+}
+
+void SASThreadStats::snapshot(SAS::Stats& stats)
+{
+  stats = SAS::Stats();
+
+  pthread_mutex_lock(&_registry_lock);
+  stats.serialize.merge(_retired.serialize);
+  stats.compress.merge(_retired.compress);
+  stats.enqueue.merge(_retired.enqueue);
+  for (std::set<SASThreadStats*>::const_iterator it = _registry.begin();
+       it != _registry.end();
+       ++it)
+  {
+    (*it)->add_to(SERIALIZE, stats.serialize);
+    (*it)->add_to(COMPRESS, stats.compress);
+    (*it)->add_to(ENQUEUE, stats.enqueue);
+  }
+  pthread_mutex_unlock(&_registry_lock);
+}
+
+void SASThreadStats::log(SAS::Stats& last)
+{
+  SAS::Stats now;
+  snapshot(now);
+
+  const char* names[] = {"serialize", "compress", "enqueue"};
+  SAS::Histogram deltas[] = {now.serialize.delta(last.serialize),
+                             now.compress.delta(last.compress),
+                             now.enqueue.delta(last.enqueue)};
+
+  char line[1024];
+  int written = 0;
+  for (int ii = 0; ii < NUM_CATEGORIES; ++ii)
+  {
+    const SAS::Histogram& h = deltas[ii];
+    written += snprintf(line + written,
+                        sizeof(line) - written,
+                        "%s%s: count=%lu mean=%luns p50=%luns p99=%luns p99.9=%luns max=%luns",
+                        (ii > 0) ? ", " : "",
+                        names[ii],
+                        h.count(),
+                        h.mean(),
+                        h.percentile(50),
+                        h.percentile(99),
+                        h.percentile(99.9),
+                        h.max());
+  }
+
+  SAS_LOG_STATS("SAS client latency: %s", line);
+  last = now;
+}
+
+void SAS::get_stats(Stats& stats)
+{
+  SASThreadStats::snapshot(stats);
+}
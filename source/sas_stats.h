@@ -0,0 +1,149 @@
+/**
+ * @file sas_stats.h Collection of latency statistics for the report_* calls.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_STATS__
+#define SAS_STATS__
+
+#include <pthread.h>
+#include <time.h>
+
+#include <set>
+
+#include "sas.h"
+
+// Per-thread latency statistics.
+//
+// Each thread that calls into the library records into its own set of
+// histograms, so recording never takes a lock or writes to a cache line
+// shared with another thread.  Each counter is only ever written by its
+// owning thread; SAS::get_stats reads them all (with relaxed atomic loads)
+// and sums them.  When a thread exits its counts are folded into a set of
+// retired totals so they aren't lost.
+class SASThreadStats
+{
+public:
+  enum Category
+  {
+    SERIALIZE = 0,
+    COMPRESS,
+    ENQUEUE,
+    NUM_CATEGORIES
+  };
+
+  /// Enable or disable statistics collection.
+  static void set_enabled(bool enabled) { _enabled = enabled; }
+  static inline bool enabled() { return _enabled; }
+
+  /// Record a latency for the calling thread.
+  static void record(Category category, uint64_t ns);
+
+  /// Sum the statistics across all threads.
+  static void snapshot(SAS::Stats& stats);
+
+  /// Log the statistics recorded since the last snapshot (and update the
+  /// snapshot).
+  static void log(SAS::Stats& last);
+
+  static inline uint64_t now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+  }
+
+private:
+  SASThreadStats();
+  ~SASThreadStats();
+
+  static SASThreadStats* get();
+  static void init();
+  static void destroy(void* stats_ptr);
+
+  // Add this thread's counts to the specified histogram.
+  void add_to(Category category, SAS::Histogram& histogram) const;
+
+  // Counts for one category.  Only the owning thread writes these, so they
+  // are updated with relaxed loads and stores rather than locked
+  // read-modify-write instructions.
+  struct Counts
+  {
+    std::atomic<uint64_t> buckets[SAS::Histogram::NUM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+  };
+  Counts _counts[NUM_CATEGORIES];
+
+  static bool _enabled;
+
+  // Variables with which to store the statistics on a per-thread basis.
+  static pthread_once_t _once;
+  static pthread_key_t _key;
+
+  // All live threads' statistics, plus the totals from threads that have
+  // exited, protected by a mutex.  The mutex is only taken when a thread
+  // first records statistics, when it exits and when taking a snapshot.
+  static pthread_mutex_t _registry_lock;
+  static std::set<SASThreadStats*> _registry;
+  static SAS::Stats _retired;
+};
+
+// Times the lifetime of the object and records it against the specified
+// category, if statistics are enabled.
+class SASStatsTimer
+{
+public:
+  inline SASStatsTimer(SASThreadStats::Category category) :
+    _category(category),
+    _start(SASThreadStats::enabled() ? SASThreadStats::now_ns() : 0)
+  {
+  }
+
+  inline ~SASStatsTimer()
+  {
+    if (_start != 0)
+    {
+      SASThreadStats::record(_category, SASThreadStats::now_ns() - _start);
+    }
+  }
+
+private:
+  SASThreadStats::Category _category;
+  uint64_t _start;
+};
+
+#endif
@@ -0,0 +1,291 @@
+/**
+ * @file sas_uring.cpp Minimal io_uring wrapper for the SAS writer threads.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "sas_uring.h"
+
+SASUring::SASUring() :
+  _fd(-1),
+  _sq_ring(MAP_FAILED),
+  _sq_ring_size(0),
+  _cq_ring(MAP_FAILED),
+  _cq_ring_size(0),
+  _sqes((struct io_uring_sqe*)MAP_FAILED),
+  _sqes_size(0),
+  _sq_head(NULL),
+  _sq_tail(NULL),
+  _sq_mask(0),
+  _sq_entries(0),
+  _cq_head(NULL),
+  _cq_tail(NULL),
+  _cq_mask(0),
+  _cqes(NULL),
+  _sqe_tail(0),
+  _to_submit(0)
+{
+}
+
+
+SASUring::~SASUring()
+{
+  close();
+}
+
+
+bool SASUring::init(unsigned int entries)
+{
+  close();
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  _fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (_fd < 0)
+  {
+    return false;
+  }
+
+  // The writer waits with a timeout (which needs IORING_FEAT_EXT_ARG, from
+  // Linux 5.11), and relies on completions never being dropped.
+  if ((!(params.features & IORING_FEAT_EXT_ARG)) ||
+      (!(params.features & IORING_FEAT_NODROP)))
+  {
+    close();
+    errno = ENOTSUP;
+    return false;
+  }
+
+  // Check the operations the writer uses are supported.
+  std::vector<char> probe_buf(sizeof(struct io_uring_probe) +
+                              256 * sizeof(struct io_uring_probe_op), 0);
+  struct io_uring_probe* probe = (struct io_uring_probe*)&probe_buf[0];
+  if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+  {
+    int saved_errno = errno;
+    close();
+    errno = saved_errno;
+    return false;
+  }
+
+  const int needed_ops[] = {IORING_OP_SENDMSG,
+                            IORING_OP_READ,
+                            IORING_OP_POLL_ADD,
+                            IORING_OP_ASYNC_CANCEL};
+  for (size_t ii = 0; ii < sizeof(needed_ops) / sizeof(needed_ops[0]); ++ii)
+  {
+    if ((needed_ops[ii] > probe->last_op) ||
+        (!(probe->ops[needed_ops[ii]].flags & IO_URING_OP_SUPPORTED)))
+    {
+      close();
+      errno = ENOTSUP;
+      return false;
+    }
+  }
+
+  // Map the rings.  Since Linux 5.4 the submission and completion queue
+  // rings share a mapping.
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if ((single_mmap) && (_cq_ring_size > _sq_ring_size))
+  {
+    _sq_ring_size = _cq_ring_size;
+  }
+
+  _sq_ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+  if (_sq_ring == MAP_FAILED)
+  {
+    int saved_errno = errno;
+    close();
+    errno = saved_errno;
+    return false;
+  }
+
+  if (single_mmap)
+  {
+    _cq_ring = _sq_ring;
+    _cq_ring_size = _sq_ring_size;
+  }
+  else
+  {
+    _cq_ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+    if (_cq_ring == MAP_FAILED)
+    {
+      int saved_errno = errno;
+      close();
+      errno = saved_errno;
+      return false;
+    }
+  }
+
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = (struct io_uring_sqe*)mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+  if (_sqes == MAP_FAILED)
+  {
+    int saved_errno = errno;
+    close();
+    errno = saved_errno;
+    return false;
+  }
+
+  char* sq = (char*)_sq_ring;
+  _sq_head = (unsigned int*)(sq + params.sq_off.head);
+  _sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+  _sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  _sqe_tail = *_sq_tail;
+
+  // Entries are always submitted in order, so the indirection array maps
+  // each slot to the entry of the same index.
+  unsigned int* array = (unsigned int*)(sq + params.sq_off.array);
+  for (unsigned int ii = 0; ii < params.sq_entries; ++ii)
+  {
+    array[ii] = ii;
+  }
+
+  char* cq = (char*)_cq_ring;
+  _cq_head = (unsigned int*)(cq + params.cq_off.head);
+  _cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+  _cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return true;
+}
+
+
+void SASUring::close()
+{
+  if (_sqes != MAP_FAILED)
+  {
+    munmap(_sqes, _sqes_size);
+    _sqes = (struct io_uring_sqe*)MAP_FAILED;
+  }
+
+  if ((_cq_ring != MAP_FAILED) && (_cq_ring != _sq_ring))
+  {
+    munmap(_cq_ring, _cq_ring_size);
+  }
+  _cq_ring = MAP_FAILED;
+
+  if (_sq_ring != MAP_FAILED)
+  {
+    munmap(_sq_ring, _sq_ring_size);
+    _sq_ring = MAP_FAILED;
+  }
+
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  _to_submit = 0;
+}
+
+
+struct io_uring_sqe* SASUring::get_sqe(uint64_t user_data)
+{
+  unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  if (_sqe_tail - head >= _sq_entries)
+  {
+    return NULL;
+  }
+
+  struct io_uring_sqe* sqe = &_sqes[_sqe_tail & _sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = user_data;
+  ++_sqe_tail;
+  ++_to_submit;
+  return sqe;
+}
+
+
+int SASUring::submit_and_wait(int64_t timeout_ns)
+{
+  // Publish the new entries to the kernel.
+  __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned int flags = IORING_ENTER_GETEVENTS;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void* argp = NULL;
+  size_t argsz = 0;
+  if (timeout_ns >= 0)
+  {
+    ts.tv_sec = timeout_ns / 1000000000ll;
+    ts.tv_nsec = timeout_ns % 1000000000ll;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+
+  int rc = syscall(__NR_io_uring_enter, _fd, _to_submit, 1, flags, argp, argsz);
+  int saved_errno = errno;
+
+  // Any entries the kernel didn't consume are submitted next time.
+  _to_submit = _sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+  return (rc < 0) ? -saved_errno : 0;
+}
+
+
+bool SASUring::next_cqe(uint64_t& user_data, int& res)
+{
+  unsigned int head = *_cq_head;
+  if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+  {
+    return false;
+  }
+
+  struct io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+  user_data = cqe->user_data;
+  res = cqe->res;
+  __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
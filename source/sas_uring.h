@@ -0,0 +1,109 @@
+/**
+ * @file sas_uring.h Minimal io_uring wrapper for the SAS writer threads.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_URING__
+#define SAS_URING__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// An io_uring, set up and driven with the raw system calls (so there's no
+// dependency on liburing).  A connection's writer thread uses it to submit
+// sends, and the reads and polls that wake it, and to wait for their
+// completions, in a single system call.
+//
+// Only used by one thread at a time, so not thread-safe.
+class SASUring
+{
+public:
+  SASUring();
+  ~SASUring();
+
+  /// Create the ring, with room for the given number of submissions.
+  ///
+  /// @returns false (leaving errno set) if io_uring isn't available, or
+  ///          lacks an operation or feature the writer needs.
+  bool init(unsigned int entries);
+
+  /// Get the next free submission queue entry, cleared, and with the given
+  /// user data.  It's submitted on the next call to submit_and_wait.
+  ///
+  /// @returns NULL if the submission queue is full.
+  struct io_uring_sqe* get_sqe(uint64_t user_data);
+
+  /// Submit the entries got since the last call, and wait until at least
+  /// one completion is available or the timeout (if not negative) expires.
+  ///
+  /// @returns 0, or a negative errno (-ETIME if the timeout expired).
+  int submit_and_wait(int64_t timeout_ns);
+
+  /// Take the next completion off the completion queue.
+  ///
+  /// @returns false if there are none.
+  bool next_cqe(uint64_t& user_data, int& res);
+
+private:
+  void close();
+
+  int _fd;
+
+  // The mappings of the submission and completion queue rings (which may be
+  // a single mapping) and of the submission queue entries.
+  void* _sq_ring;
+  size_t _sq_ring_size;
+  void* _cq_ring;
+  size_t _cq_ring_size;
+  struct io_uring_sqe* _sqes;
+  size_t _sqes_size;
+
+  // Pointers into the rings.
+  unsigned int* _sq_head;
+  unsigned int* _sq_tail;
+  unsigned int _sq_mask;
+  unsigned int _sq_entries;
+  unsigned int* _cq_head;
+  unsigned int* _cq_tail;
+  unsigned int _cq_mask;
+  struct io_uring_cqe* _cqes;
+
+  // The submission queue tail as written by get_sqe, and how many entries
+  // have been got since the last submission.
+  unsigned int _sqe_tail;
+  unsigned int _to_submit;
+};
+
+#endif
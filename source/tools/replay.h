@@ -0,0 +1,340 @@
+/**
+ * @file replay.h Reading and rewriting captured SAS messages for replay.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REPLAY_H__
+#define REPLAY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "sas.h"
+
+namespace SasReplay
+{
+  // Wire format offsets.  Every message starts with a 2 byte length (which
+  // includes the header), a version byte, a type byte and an 8 byte
+  // timestamp.  Events, markers, analytics and trail associations have a
+  // trail ID straight after the header, and trail associations the second
+  // trail after that.
+  const size_t LENGTH_SIZE = 2;
+  const size_t TYPE_OFFSET = 3;
+  const size_t TIMESTAMP_OFFSET = 4;
+  const size_t COMMON_HDR_SIZE = 12;
+  const size_t TRAIL_OFFSET = COMMON_HDR_SIZE;
+  const size_t TRAIL_B_OFFSET = TRAIL_OFFSET + 8;
+
+  const int MSG_TYPE_INIT = 1;
+  const int MSG_TYPE_TRAIL_ASSOC = 2;
+  const int MSG_TYPE_HEARTBEAT = 5;
+
+  inline uint64_t read_int64(const std::string& s, size_t offset)
+  {
+    uint64_t v = 0;
+    for (size_t ii = 0; ii < 8; ++ii)
+    {
+      v = (v << 8) | (uint8_t)s[offset + ii];
+    }
+    return v;
+  }
+
+  inline void write_int64(std::string& s, size_t offset, uint64_t v)
+  {
+    for (size_t ii = 0; ii < 8; ++ii)
+    {
+      s[offset + ii] = (char)(v >> (56 - (8 * ii)));
+    }
+  }
+
+  // Reads messages from a captured SAS byte stream, as written by the
+  // library to a file:// address - a sequence of messages, each starting
+  // with its 2 byte length.  The file is read in large chunks, so streams
+  // bigger than memory can be replayed.
+  class StreamReader
+  {
+  public:
+    StreamReader() : _file(NULL), _offset(0), _truncated_bytes(0) {}
+    ~StreamReader() { close(); }
+
+    // Open a stream file.  If it starts with an INIT message, the system
+    // details are read from it.
+    //
+    // @returns false if the file can't be opened.
+    bool open(const std::string& path)
+    {
+      _file = fopen(path.c_str(), "r");
+      if (_file == NULL)
+      {
+        return false;
+      }
+
+      // Look at the first message without consuming it.
+      std::string msg;
+      if ((peek(msg)) && ((uint8_t)msg[TYPE_OFFSET] == MSG_TYPE_INIT))
+      {
+        parse_init(msg);
+      }
+
+      return true;
+    }
+
+    void close()
+    {
+      if (_file != NULL)
+      {
+        fclose(_file);
+        _file = NULL;
+      }
+    }
+
+    // Get the next data message, skipping INIT and heartbeat messages (the
+    // library sends its own).
+    //
+    // @returns false at the end of the stream.
+    bool next(std::string& msg)
+    {
+      while (peek(msg))
+      {
+        _offset += msg.length();
+        int type = (uint8_t)msg[TYPE_OFFSET];
+        if ((type != MSG_TYPE_INIT) && (type != MSG_TYPE_HEARTBEAT))
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::string system_name;
+    std::string system_type;
+    std::string resource_identifier;
+
+    // Bytes at the end of the stream that don't form a complete message
+    // (for example, because the capture was cut short).
+    uint64_t truncated_bytes() const { return _truncated_bytes; }
+
+  private:
+    static const size_t READ_BYTES = 1024 * 1024;
+
+    // Get the message at the current offset, reading more of the file if
+    // necessary.
+    bool peek(std::string& msg)
+    {
+      while (true)
+      {
+        size_t available = _buf.length() - _offset;
+        if (available >= LENGTH_SIZE)
+        {
+          size_t len = ((uint8_t)_buf[_offset] << 8) | (uint8_t)_buf[_offset + 1];
+          if (len < COMMON_HDR_SIZE)
+          {
+            // Corrupt - there's no way to find the next message.
+            _truncated_bytes += available;
+            _offset = _buf.length();
+            return false;
+          }
+
+          if (available >= len)
+          {
+            msg.assign(_buf, _offset, len);
+            return true;
+          }
+        }
+
+        // Discard what's been consumed and read some more.
+        _buf.erase(0, _offset);
+        _offset = 0;
+        size_t old_len = _buf.length();
+        _buf.resize(old_len + READ_BYTES);
+        size_t nread = (_file != NULL) ? fread(&_buf[old_len], 1, READ_BYTES, _file) : 0;
+        _buf.resize(old_len + nread);
+        if (nread == 0)
+        {
+          _truncated_bytes += _buf.length();
+          _buf.clear();
+          return false;
+        }
+      }
+    }
+
+    // Read the system details from an INIT message - the system name, the
+    // endianness, the protocol version, the system type and the resource
+    // identifier, each string preceded by a length byte.
+    void parse_init(const std::string& msg)
+    {
+      size_t offset = COMMON_HDR_SIZE;
+      read_string(msg, offset, system_name);
+      offset += sizeof(int);
+      std::string version;
+      read_string(msg, offset, version);
+      read_string(msg, offset, system_type);
+      read_string(msg, offset, resource_identifier);
+    }
+
+    static void read_string(const std::string& msg, size_t& offset, std::string& s)
+    {
+      if (offset < msg.length())
+      {
+        size_t len = (uint8_t)msg[offset];
+        s.assign(msg, offset + 1, std::min(len, msg.length() - offset - 1));
+        offset += 1 + len;
+      }
+    }
+
+    FILE* _file;
+    std::string _buf;
+    size_t _offset;
+    uint64_t _truncated_bytes;
+  };
+
+  // Rewrites captured messages so that a replay looks like new traffic:
+  // optionally moving the timestamps so that the first message is stamped
+  // with the time it is replayed (keeping the gaps between messages), and
+  // giving each captured trail a new trail ID (consistently, so messages
+  // that shared a trail still do).
+  class Rewriter
+  {
+  public:
+    Rewriter(bool timestamps, bool trails) :
+      _timestamps(timestamps),
+      _trails(trails),
+      _timestamp_shift(0),
+      _shift_set(false)
+    {
+    }
+
+    void rewrite(std::string& msg)
+    {
+      if (msg.length() < COMMON_HDR_SIZE)
+      {
+        return;
+      }
+
+      if (_timestamps)
+      {
+        uint64_t timestamp = read_int64(msg, TIMESTAMP_OFFSET);
+        if (!_shift_set)
+        {
+          _timestamp_shift = SAS::get_current_timestamp() - timestamp;
+          _shift_set = true;
+        }
+        write_int64(msg, TIMESTAMP_OFFSET, timestamp + _timestamp_shift);
+      }
+
+      if ((_trails) && (msg.length() >= TRAIL_OFFSET + 8))
+      {
+        rewrite_trail(msg, TRAIL_OFFSET);
+        if (((uint8_t)msg[TYPE_OFFSET] == MSG_TYPE_TRAIL_ASSOC) &&
+            (msg.length() >= TRAIL_B_OFFSET + 8))
+        {
+          rewrite_trail(msg, TRAIL_B_OFFSET);
+        }
+      }
+    }
+
+  private:
+    void rewrite_trail(std::string& msg, size_t offset)
+    {
+      SAS::TrailId old_trail = read_int64(msg, offset);
+      std::map<SAS::TrailId, SAS::TrailId>::const_iterator it = _trail_map.find(old_trail);
+      SAS::TrailId new_trail;
+      if (it != _trail_map.end())
+      {
+        new_trail = it->second;
+      }
+      else
+      {
+        new_trail = SAS::new_trail();
+        _trail_map[old_trail] = new_trail;
+      }
+      write_int64(msg, offset, new_trail);
+    }
+
+    bool _timestamps;
+    bool _trails;
+    uint64_t _timestamp_shift;
+    bool _shift_set;
+    std::map<SAS::TrailId, SAS::TrailId> _trail_map;
+  };
+
+  // Paces a replay to a target rate in messages per second (0 meaning as
+  // fast as possible), by sleeping until each message is due.
+  class Pacer
+  {
+  public:
+    Pacer(uint64_t rate) : _rate(rate), _start_ns(now_ns()), _count(0) {}
+
+    void wait()
+    {
+      if (_rate == 0)
+      {
+        return;
+      }
+
+      uint64_t due_ns = _start_ns + (_count++ * 1000000000ull / _rate);
+      uint64_t now = now_ns();
+      if (due_ns > now + MIN_SLEEP_NS)
+      {
+        struct timespec ts;
+        ts.tv_sec = (due_ns - now) / 1000000000ull;
+        ts.tv_nsec = (due_ns - now) % 1000000000ull;
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    static uint64_t now_ns()
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+    }
+
+  private:
+    // Don't sleep for less than this - instead let the replay fall slightly
+    // behind and catch up with a burst.
+    static const uint64_t MIN_SLEEP_NS = 100000;
+
+    uint64_t _rate;
+    uint64_t _start_ns;
+    uint64_t _count;
+  };
+}
+
+#endif
@@ -0,0 +1,319 @@
+/**
+ * @file sas_replay.cpp Tool to replay captured SAS messages to a SAS server.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+// Usage: sas_replay (--ring=FILE | --stream=FILE) --sas=ADDRESS [--rate=N]
+//                   [--rewrite-timestamps] [--new-trails]
+//                   [--system-name=NAME] [--system-type=TYPE]
+//                   [--resource-id=ID]
+//
+// Sends captured SAS messages to SAS at ADDRESS (which may include a port,
+// as for SAS::init), using the library's own connection and batching code.
+// The messages are read from either:
+//
+// --ring     a capture ring file (see SAS::Options::capture_file), or
+// --stream   a SAS byte stream, as written by the library to a file:// SAS
+//            address.
+//
+// The connection identifies itself with the system details recorded in the
+// file, unless overridden.
+//
+// --rate limits the replay to that many messages per second (0, the
+// default, means as fast as SAS will take them).
+//
+// --rewrite-timestamps shifts the messages' timestamps so that the first is
+// stamped with the current time, keeping the intervals between them.
+//
+// --new-trails gives each captured trail a new trail ID, so the replayed
+// messages don't merge with the originals in SAS.
+//
+// Reports the number of messages replayed, and the rate they were sent at.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "sas.h"
+#include "sas_ring.h"
+#include "replay.h"
+
+namespace
+{
+
+// Get the value of a "--name=value" argument.
+std::string get_arg(int argc, char* argv[], const char* name, const std::string& dflt)
+{
+  std::string prefix = std::string("--") + name + "=";
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    if (strncmp(argv[ii], prefix.c_str(), prefix.length()) == 0)
+    {
+      return argv[ii] + prefix.length();
+    }
+  }
+  return dflt;
+}
+
+// Check whether a "--name" flag is present.
+bool get_flag(int argc, char* argv[], const char* name)
+{
+  std::string flag = std::string("--") + name;
+  for (int ii = 1; ii < argc; ++ii)
+  {
+    if (flag == argv[ii])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void log_callback(SAS::sas_log_level_t level,
+                  int32_t log_id_len,
+                  unsigned char* log_id,
+                  int32_t sas_ip_len,
+                  unsigned char* sas_ip,
+                  int32_t msg_len,
+                  unsigned char* msg)
+{
+  if (level <= SAS::SASCLIENT_LOG_WARNING)
+  {
+    fprintf(stderr, "%.*s\n", msg_len, msg);
+  }
+}
+
+// Source of the messages to replay - either a ring file (loaded whole, as
+// it's of bounded size) or a stream file (read as it goes).
+class Source
+{
+public:
+  Source() : _ring_index(0) {}
+
+  bool open(const std::string& ring_file, const std::string& stream_file)
+  {
+    if (!ring_file.empty())
+    {
+      std::string error;
+      if (!SASCaptureRing::load(ring_file, _ring, error))
+      {
+        fprintf(stderr, "Failed to read %s: %s\n", ring_file.c_str(), error.c_str());
+        return false;
+      }
+      system_name = _ring.system_name;
+      system_type = _ring.system_type;
+      resource_identifier = _ring.resource_identifier;
+      return true;
+    }
+
+    if (!_stream.open(stream_file))
+    {
+      fprintf(stderr, "Failed to open %s\n", stream_file.c_str());
+      return false;
+    }
+    system_name = _stream.system_name;
+    system_type = _stream.system_type;
+    resource_identifier = _stream.resource_identifier;
+    return true;
+  }
+
+  bool next(std::string& msg)
+  {
+    if (_ring_index < _ring.msgs.size())
+    {
+      msg.swap(_ring.msgs[_ring_index++]);
+      return true;
+    }
+    return _stream.next(msg);
+  }
+
+  uint64_t skipped_bytes() const
+  {
+    return _ring.skipped_bytes + _stream.truncated_bytes();
+  }
+
+  std::string system_name;
+  std::string system_type;
+  std::string resource_identifier;
+
+private:
+  SASCaptureRing::Contents _ring;
+  size_t _ring_index;
+  SasReplay::StreamReader _stream;
+};
+
+// Wait until everything queued has been sent (or dropped), or nothing has
+// been sent for the timeout.
+void wait_for_send(int timeout_ms)
+{
+  SAS::ConnectionStats stats;
+  uint64_t last_sent = 0;
+  int idle_ms = 0;
+  while (idle_ms < timeout_ms)
+  {
+    SAS::get_connection_stats(stats);
+    if (stats.messages_sent + stats.dropped_send_failed >= stats.enqueued)
+    {
+      break;
+    }
+
+    if (stats.messages_sent != last_sent)
+    {
+      last_sent = stats.messages_sent;
+      idle_ms = 0;
+    }
+    usleep(10000);
+    idle_ms += 10;
+  }
+}
+
+// Wait for the library to connect, so the replay rate doesn't include the
+// connection setup.
+bool wait_for_connection(int timeout_ms)
+{
+  SAS::ConnectionStats stats;
+  for (int waited_ms = 0; waited_ms < timeout_ms; waited_ms += 10)
+  {
+    SAS::get_connection_stats(stats);
+    if (stats.connects > 0)
+    {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+// How often (in messages) to check whether the queue is backing up, and the
+// depth above which to wait for it to drain rather than overflow it.
+const uint64_t QUEUE_CHECK_INTERVAL = 1024;
+const uint64_t MAX_QUEUE_DEPTH = 50000;
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+  std::string ring_file = get_arg(argc, argv, "ring", "");
+  std::string stream_file = get_arg(argc, argv, "stream", "");
+  std::string sas_address = get_arg(argc, argv, "sas", "");
+  if ((ring_file.empty() == stream_file.empty()) || (sas_address.empty()))
+  {
+    fprintf(stderr, "Usage: %s (--ring=FILE | --stream=FILE) --sas=ADDRESS [--rate=N] "
+                    "[--rewrite-timestamps] [--new-trails] [--system-name=NAME] "
+                    "[--system-type=TYPE] [--resource-id=ID]\n", argv[0]);
+    return 2;
+  }
+
+  Source source;
+  if (!source.open(ring_file, stream_file))
+  {
+    return 1;
+  }
+
+  if (SAS::init(get_arg(argc, argv, "system-name", source.system_name),
+                get_arg(argc, argv, "system-type", source.system_type),
+                get_arg(argc, argv, "resource-id", source.resource_identifier),
+                sas_address,
+                &log_callback) != SAS_INIT_RC_OK)
+  {
+    fprintf(stderr, "Failed to initialize SAS client\n");
+    return 1;
+  }
+
+  if (!wait_for_connection(10000))
+  {
+    fprintf(stderr, "Failed to connect to SAS at %s\n", sas_address.c_str());
+    SAS::term();
+    return 1;
+  }
+
+  SasReplay::Rewriter rewriter(get_flag(argc, argv, "rewrite-timestamps"),
+                               get_flag(argc, argv, "new-trails"));
+  SasReplay::Pacer pacer(strtoull(get_arg(argc, argv, "rate", "0").c_str(), NULL, 0));
+
+  uint64_t start_ns = SasReplay::Pacer::now_ns();
+  uint64_t replayed = 0;
+  uint64_t rejected = 0;
+  std::string msg;
+  while (source.next(msg))
+  {
+    pacer.wait();
+    rewriter.rewrite(msg);
+    if (SAS::report_serialized(msg))
+    {
+      ++replayed;
+    }
+    else
+    {
+      ++rejected;
+    }
+
+    if ((replayed % QUEUE_CHECK_INTERVAL) == 0)
+    {
+      // Don't let the queue overflow when replaying as fast as possible.
+      SAS::ConnectionStats stats;
+      SAS::get_connection_stats(stats);
+      while (stats.queue_depth > MAX_QUEUE_DEPTH)
+      {
+        usleep(1000);
+        SAS::get_connection_stats(stats);
+      }
+    }
+  }
+
+  wait_for_send(10000);
+  uint64_t elapsed_ns = SasReplay::Pacer::now_ns() - start_ns;
+
+  SAS::ConnectionStats stats;
+  SAS::get_connection_stats(stats);
+  SAS::term();
+
+  double elapsed_s = (elapsed_ns > 0) ? (elapsed_ns / 1e9) : 1e-9;
+  printf("replayed:      %lu messages\n", replayed);
+  printf("rejected:      %lu messages\n", rejected);
+  printf("skipped:       %lu bytes\n", source.skipped_bytes());
+  printf("sent:          %lu messages, %lu bytes\n", stats.messages_sent, stats.bytes_sent);
+  printf("dropped:       %lu messages\n",
+         stats.dropped_queue_full + stats.dropped_send_failed);
+  printf("elapsed:       %.3f s\n", elapsed_s);
+  printf("rate:          %.0f msgs/s, %.2f MB/s\n",
+         stats.messages_sent / elapsed_s,
+         stats.bytes_sent / elapsed_s / (1024 * 1024));
+
+  return (stats.messages_sent == replayed) ? 0 : 1;
+}
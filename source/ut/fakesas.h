@@ -0,0 +1,416 @@
+/**
+ * @file fakesas.h A minimal in-process SAS server for tests and benchmarks.
+ *
+ * Service Assurance Server client library
+ * Copyright (C) 2013  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef FAKESAS_H__
+#define FAKESAS_H__
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace SasTest
+{
+  // A fake SAS server.  It listens on an ephemeral port on the loopback
+  // interface, accepts any number of client connections and parses the
+  // stream of SAS messages on each, counting them by type.  It can
+  // optionally keep a copy of every message received so tests can check
+  // exactly what was sent.
+  class FakeSas
+  {
+  public:
+    static const int MSG_TYPE_INIT = 1;
+    static const int MSG_TYPE_TRAIL_ASSOC = 2;
+    static const int MSG_TYPE_EVENT = 3;
+    static const int MSG_TYPE_HEARTBEAT = 5;
+    static const int MAX_MSG_TYPE = 16;
+
+    FakeSas(const std::string& address = "127.0.0.1", bool store = false) :
+      _address(address),
+      _store(store),
+      _listen_sock(-1),
+      _epoll_fd(-1),
+      _stop_fd(-1),
+      _port(0),
+      _thread(0),
+      _messages(0),
+      _bytes(0),
+      _connections(0),
+      _cpu_ns(0),
+      _paused(false),
+      _close_requested(CLOSE_NONE)
+    {
+      for (int ii = 0; ii < MAX_MSG_TYPE; ++ii)
+      {
+        _messages_by_type[ii] = 0;
+      }
+      pthread_mutex_init(&_m, NULL);
+    }
+
+    ~FakeSas()
+    {
+      stop();
+      pthread_mutex_destroy(&_m);
+    }
+
+    // Start listening.  Returns false if the listening socket can't be set
+    // up.
+    bool start()
+    {
+      struct addrinfo hints, *addrs;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+      if (getaddrinfo(_address.c_str(), "0", &hints, &addrs) != 0)
+      {
+        return false;
+      }
+
+      _listen_sock = ::socket(addrs->ai_family, SOCK_STREAM, 0);
+      int reuse = 1;
+      setsockopt(_listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      bool ok = ((_listen_sock >= 0) &&
+                 (::bind(_listen_sock, addrs->ai_addr, addrs->ai_addrlen) == 0) &&
+                 (::listen(_listen_sock, 16) == 0));
+      freeaddrinfo(addrs);
+      if (!ok)
+      {
+        return false;
+      }
+
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      getsockname(_listen_sock, (struct sockaddr*)&addr, &addr_len);
+      _port = (addr.ss_family == AF_INET6) ?
+                ntohs(((struct sockaddr_in6*)&addr)->sin6_port) :
+                ntohs(((struct sockaddr_in*)&addr)->sin_port);
+
+      _epoll_fd = epoll_create1(0);
+      _stop_fd = eventfd(0, 0);
+      add_fd(_listen_sock);
+      add_fd(_stop_fd);
+
+      return (pthread_create(&_thread, NULL, &server_thread, this) == 0);
+    }
+
+    // Stop the server, closing all the connections.
+    void stop()
+    {
+      if (_thread != 0)
+      {
+        uint64_t one = 1;
+        (void)!::write(_stop_fd, &one, sizeof(one));
+        pthread_join(_thread, NULL);
+        _thread = 0;
+      }
+
+      for (std::map<int, std::string>::iterator it = _buffers.begin();
+           it != _buffers.end();
+           ++it)
+      {
+        ::close(it->first);
+      }
+      _buffers.clear();
+
+      if (_listen_sock >= 0)
+      {
+        ::close(_listen_sock);
+        ::close(_epoll_fd);
+        ::close(_stop_fd);
+        _listen_sock = -1;
+      }
+    }
+
+    int port() const { return _port; }
+    std::string port_str() const { return std::to_string(_port); }
+
+    // Total number of messages received (of all types).
+    uint64_t messages() const { return _messages; }
+
+    // Number of messages received of a particular type.
+    uint64_t messages(int type) const
+    {
+      return ((type >= 0) && (type < MAX_MSG_TYPE)) ? _messages_by_type[type].load() : 0;
+    }
+
+    // Number of messages that carry data - that is, excluding INIT and
+    // heartbeat messages.
+    uint64_t data_messages() const
+    {
+      return messages() - messages(MSG_TYPE_INIT) - messages(MSG_TYPE_HEARTBEAT);
+    }
+
+    uint64_t bytes() const { return _bytes; }
+
+    // Stop (or restart) reading from the connections, so that the client's
+    // socket fills up as if SAS had locked up.
+    void set_paused(bool paused) { _paused = paused; }
+
+    uint64_t connections() const { return _connections; }
+
+    // Close all the connections from the server end, either gracefully (with
+    // a FIN) or by resetting them, and wait for that to be done.
+    void close_connections(bool reset)
+    {
+      _close_requested = reset ? CLOSE_RESET : CLOSE_GRACEFUL;
+      uint64_t one = 1;
+      (void)!::write(_stop_fd, &one, sizeof(one));
+      while (_close_requested != CLOSE_NONE)
+      {
+        usleep(1000);
+      }
+    }
+
+    // CPU time consumed by the server thread, so that benchmarks can subtract
+    // it from the process CPU time.
+    uint64_t cpu_ns() const { return _cpu_ns; }
+
+    // Copy of the messages received so far (only if storing is enabled).
+    std::vector<std::string> received()
+    {
+      pthread_mutex_lock(&_m);
+      std::vector<std::string> msgs = _received;
+      pthread_mutex_unlock(&_m);
+      return msgs;
+    }
+
+    // Wait until at least the specified number of data messages have been
+    // received, or the timeout expires.
+    bool wait_for_data_messages(uint64_t count, int timeout_ms)
+    {
+      for (int waited = 0; waited < timeout_ms; ++waited)
+      {
+        if (data_messages() >= count)
+        {
+          return true;
+        }
+        usleep(1000);
+      }
+      return (data_messages() >= count);
+    }
+
+    // Wait until at least the specified number of INIT messages have been
+    // received (that is, the client has connected that many times), or the
+    // timeout expires.
+    bool wait_for_inits(uint64_t count, int timeout_ms)
+    {
+      for (int waited = 0; waited < timeout_ms; ++waited)
+      {
+        if (messages(MSG_TYPE_INIT) >= count)
+        {
+          return true;
+        }
+        usleep(1000);
+      }
+      return (messages(MSG_TYPE_INIT) >= count);
+    }
+
+  private:
+    void add_fd(int fd)
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    static void* server_thread(void* p)
+    {
+      ((FakeSas*)p)->run();
+      return NULL;
+    }
+
+    void run()
+    {
+      char buf[65536];
+      struct epoll_event events[16];
+      bool stopping = false;
+
+      while (!stopping)
+      {
+        int n = epoll_wait(_epoll_fd, events, 16, -1);
+        for (int ii = 0; ii < n; ++ii)
+        {
+          int fd = events[ii].data.fd;
+          if (fd == _stop_fd)
+          {
+            uint64_t value;
+            (void)!::read(_stop_fd, &value, sizeof(value));
+            int close_requested = _close_requested;
+            if (close_requested != CLOSE_NONE)
+            {
+              close_all(close_requested == CLOSE_RESET);
+              _close_requested = CLOSE_NONE;
+            }
+            else
+            {
+              stopping = true;
+            }
+          }
+          else if (fd == _listen_sock)
+          {
+            int sock = ::accept(_listen_sock, NULL, NULL);
+            if (sock >= 0)
+            {
+              add_fd(sock);
+              _buffers[sock] = std::string();
+              ++_connections;
+            }
+          }
+          else if (!_paused)
+          {
+            ssize_t len = ::recv(fd, buf, sizeof(buf), 0);
+            if (len <= 0)
+            {
+              epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+              ::close(fd);
+              _buffers.erase(fd);
+            }
+            else
+            {
+              _bytes += len;
+              std::string& buffer = _buffers[fd];
+              buffer.append(buf, len);
+              parse(buffer);
+            }
+          }
+        }
+
+        if (_paused)
+        {
+          // The connections are still readable, so avoid spinning.
+          usleep(1000);
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        _cpu_ns = ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+      }
+    }
+
+    void close_all(bool reset)
+    {
+      for (std::map<int, std::string>::iterator it = _buffers.begin();
+           it != _buffers.end();
+           ++it)
+      {
+        if (reset)
+        {
+          // Closing with a zero linger time sends a reset.
+          struct linger linger = {1, 0};
+          setsockopt(it->first, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, it->first, NULL);
+        ::close(it->first);
+      }
+      _buffers.clear();
+    }
+
+    // Consume all the complete messages at the start of the buffer.  Each
+    // message starts with its 2 byte length (which includes the length field
+    // itself), followed by the version and message type.
+    void parse(std::string& buffer)
+    {
+      size_t offset = 0;
+      while (buffer.length() - offset >= 4)
+      {
+        const unsigned char* hdr = (const unsigned char*)buffer.data() + offset;
+        size_t msg_len = (hdr[0] << 8) | hdr[1];
+        if (buffer.length() - offset < msg_len)
+        {
+          break;
+        }
+
+        int type = hdr[3];
+        if (type < MAX_MSG_TYPE)
+        {
+          ++_messages_by_type[type];
+        }
+        if (_store)
+        {
+          pthread_mutex_lock(&_m);
+          _received.push_back(buffer.substr(offset, msg_len));
+          pthread_mutex_unlock(&_m);
+        }
+        ++_messages;
+        offset += (msg_len >= 4) ? msg_len : buffer.length();
+      }
+      buffer.erase(0, offset);
+    }
+
+    std::string _address;
+    bool _store;
+    int _listen_sock;
+    int _epoll_fd;
+    int _stop_fd;
+    int _port;
+    pthread_t _thread;
+
+    // Partially received data on each connection, keyed by socket.
+    std::map<int, std::string> _buffers;
+
+    std::atomic<uint64_t> _messages;
+    std::atomic<uint64_t> _messages_by_type[MAX_MSG_TYPE];
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _connections;
+    std::atomic<uint64_t> _cpu_ns;
+    std::atomic<bool> _paused;
+
+    // Request from the test thread to close the connections.
+    static const int CLOSE_NONE = 0;
+    static const int CLOSE_GRACEFUL = 1;
+    static const int CLOSE_RESET = 2;
+    std::atomic<int> _close_requested;
+
+    pthread_mutex_t _m;
+    std::vector<std::string> _received;
+  };
+} // namespace SasTest
+
+#endif
@@ -36,6 +36,21 @@
 
 #include "sas.h"
 #include "sastestutil.h"
+#include "fakesas.h"
+#include "sas_ring.h"
+#include "replay.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 //
 // Event tests.
@@ -425,6 +440,1337 @@ void test_xml_with_store()
 }
 } // namespace AnalyticsTest
 
+// Latency histogram tests
+namespace HistogramTest
+{
+
+void test_small_values_exact()
+{
+  SAS::Histogram histogram;
+  for (uint64_t ii = 0; ii < 8; ++ii)
+  {
+    histogram.record(ii);
+  }
+
+  ASSERT(histogram.count() == 8);
+  ASSERT(histogram.min() == 0);
+  ASSERT(histogram.max() == 7);
+  ASSERT(histogram.percentile(50) == 3);
+  ASSERT(histogram.percentile(100) == 7);
+}
+
+void test_percentile_accuracy()
+{
+  SAS::Histogram histogram;
+  for (uint64_t ii = 1; ii <= 100000; ++ii)
+  {
+    histogram.record(ii * 1000);
+  }
+
+  ASSERT(histogram.count() == 100000);
+  ASSERT(histogram.mean() == 50000500);
+
+  // Each percentile should be within the 12.5% bucket resolution of the
+  // exact value (and never below it).
+  uint64_t p50 = histogram.percentile(50);
+  uint64_t p99 = histogram.percentile(99);
+  ASSERT((p50 >= 50000000) && (p50 <= 56250000));
+  ASSERT((p99 >= 99000000) && (p99 <= 111375000));
+  ASSERT(histogram.percentile(100) == 100000000);
+}
+
+void test_bucket_bounds()
+{
+  for (int ii = 0; ii < SAS::Histogram::NUM_BUCKETS; ++ii)
+  {
+    ASSERT(SAS::Histogram::bucket(SAS::Histogram::bucket_lowest(ii)) == ii);
+    ASSERT(SAS::Histogram::bucket(SAS::Histogram::bucket_highest(ii)) == ii);
+  }
+}
+
+void test_delta()
+{
+  SAS::Histogram histogram;
+  histogram.record(100);
+  histogram.record(200);
+  SAS::Histogram earlier = histogram;
+  histogram.record(5000);
+
+  SAS::Histogram delta = histogram.delta(earlier);
+  ASSERT(delta.count() == 1);
+  ASSERT(delta.sum() == 5000);
+  ASSERT(delta.percentile(50) == 5000);
+}
+} // namespace HistogramTest
+
+// Trail ID allocation tests
+namespace TrailTest
+{
+
+void* new_trails(void* p)
+{
+  std::vector<SAS::TrailId>* trails = (std::vector<SAS::TrailId>*)p;
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    trails->push_back(SAS::new_trail());
+  }
+  return NULL;
+}
+
+void test_unique_across_threads()
+{
+  // Each thread allocates from its own blocks of IDs, and runs through
+  // more than one block.
+  const int num_threads = 8;
+  std::vector<SAS::TrailId> trails[num_threads];
+  pthread_t threads[num_threads];
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    ASSERT(pthread_create(&threads[ii], NULL, new_trails, &trails[ii]) == 0);
+  }
+
+  std::set<SAS::TrailId> all;
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    for (size_t jj = 1; jj < trails[ii].size(); ++jj)
+    {
+      ASSERT(trails[ii][jj] > trails[ii][jj - 1]);
+    }
+    all.insert(trails[ii].begin(), trails[ii].end());
+  }
+
+  ASSERT(all.size() == num_threads * 10000u);
+  ASSERT(all.count(0) == 0);
+}
+} // namespace TrailTest
+
+// Tests of the connection to SAS, using a fake SAS server.
+namespace ConnectionTest
+{
+
+SasTest::FakeSas* fake_sas = NULL;
+SasTest::FakeSas* fake_sas_2 = NULL;
+
+// Set to make create_socket fail, as if SAS were unreachable.
+std::atomic<bool> refuse_connections(false);
+
+void log_callback(SAS::sas_log_level_t level,
+                  int32_t log_id_len,
+                  unsigned char* log_id,
+                  int32_t sas_ip_len,
+                  unsigned char* sas_ip,
+                  int32_t msg_len,
+                  unsigned char* msg)
+{
+}
+
+// Connect to the fake SAS server rather than the real SAS port.  The address
+// "sas2" is mapped to the second fake server, and all others to the first.
+int create_socket(const char* hostname, const char* port)
+{
+  if (refuse_connections)
+  {
+    return -1;
+  }
+
+  SasTest::FakeSas* server = (strcmp(hostname, "sas2") == 0) ? fake_sas_2 : fake_sas;
+  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server->port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    ::close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Looking up this host takes several seconds, as if DNS weren't responding.
+const char* SLOW_DNS_HOST = "slow-dns.sas.test";
+
+} // namespace ConnectionTest
+
+// Stands in for the C library's getaddrinfo (which the library picks up,
+// since it's linked statically into this program), to simulate a slow DNS
+// server.
+extern "C" int getaddrinfo(const char* node,
+                           const char* service,
+                           const struct addrinfo* hints,
+                           struct addrinfo** res)
+{
+  if ((node != NULL) && (strcmp(node, ConnectionTest::SLOW_DNS_HOST) == 0))
+  {
+    sleep(5);
+    return EAI_AGAIN;
+  }
+
+  typedef int (*getaddrinfo_fn)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+  static getaddrinfo_fn real_getaddrinfo = (getaddrinfo_fn)dlsym(RTLD_NEXT, "getaddrinfo");
+  return real_getaddrinfo(node, service, hints, res);
+}
+
+namespace ConnectionTest
+{
+
+void test_connection_stats()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  SAS::ConnectionStats stats;
+  ASSERT(!SAS::get_connection_stats(stats));
+
+  SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    SAS::Event event(111, 222, 333);
+    event.add_var_param("hello");
+    SAS::report_event(event);
+  }
+  ASSERT(fake_sas->wait_for_data_messages(10, 5000));
+
+  ASSERT(SAS::get_connection_stats(stats));
+  SAS::term();
+  fake_sas->stop();
+
+  ASSERT(stats.enqueued == 10);
+  ASSERT(stats.messages_sent == 10);
+  ASSERT(stats.dropped_queue_full == 0);
+  ASSERT(stats.dropped_send_failed == 0);
+  ASSERT(stats.connects == 1);
+  ASSERT(stats.reconnects == 0);
+  ASSERT(stats.queue_high_water >= 1);
+  ASSERT(stats.bytes_sent > 0);
+
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_send_lockup()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  SAS::Options options;
+  options.send_timeout_ms = 200;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  // Stop SAS reading, then send enough data to fill the socket buffers and
+  // the writer's pending list.
+  fake_sas->set_paused(true);
+  std::string data(4096, 'x');
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    SAS::Event event(111, 222, 333);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+
+  SAS::ConnectionStats stats;
+  for (int waited = 0; waited < 5000; waited += 10)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    if (stats.send_lockups > 0)
+    {
+      break;
+    }
+    usleep(10000);
+  }
+  ASSERT(stats.send_lockups == 1);
+
+  // Once SAS recovers the client reconnects.
+  fake_sas->set_paused(false);
+  ASSERT(fake_sas->wait_for_inits(2, 5000));
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+// Get the trail IDs of the events received by a fake SAS server.  The trail
+// ID follows the common header.
+std::set<SAS::TrailId> received_trails(SasTest::FakeSas* server)
+{
+  std::set<SAS::TrailId> trails;
+  std::vector<std::string> msgs = server->received();
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if ((msgs[ii].length() >= 20) && (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT))
+    {
+      SAS::TrailId trail = 0;
+      for (int jj = 12; jj < 20; ++jj)
+      {
+        trail = (trail << 8) | (uint8_t)msgs[ii][jj];
+      }
+      trails.insert(trail);
+    }
+  }
+  return trails;
+}
+
+// Start two fake servers and initialise SAS to connect to both.
+void init_two_servers(SAS::Options::Distribution distribution)
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  fake_sas_2 = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+  ASSERT(fake_sas_2->start());
+
+  SAS::Options options;
+  options.distribution = distribution;
+  SAS::init("system", "type", "resource", "sas1, sas2", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+  ASSERT(fake_sas_2->wait_for_inits(1, 5000));
+}
+
+void term_two_servers()
+{
+  SAS::term();
+  fake_sas->stop();
+  fake_sas_2->stop();
+  delete fake_sas; fake_sas = NULL;
+  delete fake_sas_2; fake_sas_2 = NULL;
+}
+
+void report_events(int num_trails, int events_per_trail)
+{
+  for (int ii = 1; ii <= num_trails; ++ii)
+  {
+    for (int jj = 0; jj < events_per_trail; ++jj)
+    {
+      SAS::Event event(ii, 222, jj);
+      SAS::report_event(event);
+    }
+  }
+}
+
+void test_sharded_destinations()
+{
+  init_two_servers(SAS::Options::Distribution::ShardByTrail);
+
+  report_events(100, 3);
+  for (int waited = 0;
+       (waited < 5000) &&
+       (fake_sas->data_messages() + fake_sas_2->data_messages() < 300);
+       ++waited)
+  {
+    usleep(1000);
+  }
+  ASSERT(fake_sas->data_messages() + fake_sas_2->data_messages() == 300);
+
+  // Every trail went to exactly one of the servers.
+  std::set<SAS::TrailId> trails_1 = received_trails(fake_sas);
+  std::set<SAS::TrailId> trails_2 = received_trails(fake_sas_2);
+  ASSERT(!trails_1.empty());
+  ASSERT(!trails_2.empty());
+  ASSERT(trails_1.size() + trails_2.size() == 100);
+  ASSERT(fake_sas->data_messages() == trails_1.size() * 3);
+
+  // Associations between trails on different servers go to both.
+  for (int ii = 1; ii <= 20; ++ii)
+  {
+    SAS::associate_trails(ii, 100 + ii);
+  }
+  uint64_t assocs = 0;
+  for (int waited = 0; (waited < 5000) && (assocs <= 20); ++waited)
+  {
+    usleep(1000);
+    assocs = fake_sas->messages(SasTest::FakeSas::MSG_TYPE_TRAIL_ASSOC) +
+             fake_sas_2->messages(SasTest::FakeSas::MSG_TYPE_TRAIL_ASSOC);
+  }
+  ASSERT(assocs > 20);
+  ASSERT(assocs <= 40);
+
+  SAS::ConnectionStats stats;
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.connects == 2);
+
+  term_two_servers();
+}
+
+void test_replicated_destinations()
+{
+  init_two_servers(SAS::Options::Distribution::Replicate);
+
+  report_events(100, 3);
+  ASSERT(fake_sas->wait_for_data_messages(300, 5000));
+  ASSERT(fake_sas_2->wait_for_data_messages(300, 5000));
+  ASSERT(received_trails(fake_sas).size() == 100);
+  ASSERT(received_trails(fake_sas_2).size() == 100);
+
+  term_two_servers();
+}
+
+void test_multiple_connections_per_address()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  SAS::Options options;
+  options.connections_per_address = 4;
+  options.trail_assoc_connection = 0;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(4, 5000));
+  ASSERT(fake_sas->connections() == 4);
+
+  report_events(100, 3);
+  ASSERT(fake_sas->wait_for_data_messages(300, 5000));
+
+  // The connections deliver independently, but each trail's events are on
+  // one connection so arrive in the order they were reported.  The event
+  // instance ID follows the trail ID and event ID.
+  std::map<SAS::TrailId, uint32_t> next_instance;
+  std::vector<std::string> msgs = fake_sas->received();
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      SAS::TrailId trail = 0;
+      uint32_t instance = 0;
+      for (int jj = 12; jj < 20; ++jj)
+      {
+        trail = (trail << 8) | (uint8_t)msgs[ii][jj];
+      }
+      for (int jj = 24; jj < 28; ++jj)
+      {
+        instance = (instance << 8) | (uint8_t)msgs[ii][jj];
+      }
+      ASSERT(instance == next_instance[trail]);
+      next_instance[trail] = instance + 1;
+    }
+  }
+  ASSERT(next_instance.size() == 100);
+
+  // All associations go to the designated connection, so each is sent once.
+  for (int ii = 1; ii <= 20; ++ii)
+  {
+    SAS::associate_trails(ii, 100 + ii);
+  }
+  for (int waited = 0;
+       (waited < 5000) &&
+       (fake_sas->messages(SasTest::FakeSas::MSG_TYPE_TRAIL_ASSOC) < 20);
+       ++waited)
+  {
+    usleep(1000);
+  }
+  usleep(10000);
+  ASSERT(fake_sas->messages(SasTest::FakeSas::MSG_TYPE_TRAIL_ASSOC) == 20);
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+void test_reconnect_backoff()
+{
+  // Start and stop the fake server, so that connections to its port are
+  // refused.
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+  fake_sas->stop();
+
+  SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+
+  // The first retries are within milliseconds.
+  usleep(200000);
+  SAS::ConnectionStats stats;
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.connect_failures >= 3);
+  ASSERT(stats.connects == 0);
+
+  // Terminating doesn't wait for the backoff to expire.
+  uint64_t start = now_ms();
+  SAS::term();
+  ASSERT(now_ms() - start < 100);
+
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_term_while_connecting()
+{
+  // Connect to an address that (almost certainly) doesn't respond, using the
+  // library's own connection code.
+  SAS::init("system", "type", "resource", "10.255.255.1", &log_callback);
+  usleep(50000);
+
+  // Terminating doesn't wait for the connection attempt to time out.
+  uint64_t start = now_ms();
+  SAS::term();
+  ASSERT(now_ms() - start < 100);
+
+  // Nor for a name that can't be resolved.
+  SAS::init("system", "type", "resource", "sas.invalid", &log_callback);
+  usleep(50000);
+  start = now_ms();
+  SAS::term();
+  ASSERT(now_ms() - start < 100);
+}
+
+void test_ipv6()
+{
+  fake_sas = new SasTest::FakeSas("::1");
+  ASSERT(fake_sas->start());
+
+  // A bracketed IPv6 literal with a port, using the library's own connection
+  // code.
+  ASSERT(SAS::init("system", "type", "resource", "[::1]:" + fake_sas->port_str(), &log_callback) == SAS_INIT_RC_OK);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+  SAS::Event event(1, 222, 333);
+  SAS::report_event(event);
+  ASSERT(fake_sas->wait_for_data_messages(1, 5000));
+  SAS::term();
+
+  // A bare IPv6 literal, with the port set in the options.
+  SAS::Options options;
+  options.sas_port = fake_sas->port_str();
+  options.address_family = SAS::Options::AddressFamily::IPv6Only;
+  ASSERT(SAS::init("system", "type", "resource", "::1", options, &log_callback) == SAS_INIT_RC_OK);
+  ASSERT(fake_sas->wait_for_inits(2, 5000));
+  SAS::term();
+
+  // Malformed addresses are rejected.
+  ASSERT(SAS::init("system", "type", "resource", "[::1", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "[::1]6761", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "127.0.0.1:sas", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "127.0.0.1:99999", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "[::1]:0", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "[::1]:00000000000000000000", &log_callback) == SAS_INIT_RC_ERR);
+  ASSERT(SAS::init("system", "type", "resource", "[::1]:99999999999999999999999", &log_callback) == SAS_INIT_RC_ERR);
+
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_spill_to_disk()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  std::string spill_file = "/tmp/sas_test_spill." + std::to_string(getpid());
+  SAS::Options options;
+  options.spill_file = spill_file;
+  options.spill_file_max_bytes = 16 * 1024 * 1024;
+  options.spill_watermark = 100;
+
+  // Report while SAS is unreachable.  The messages are spilled to disk.
+  refuse_connections = true;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  for (int ii = 0; ii < 5000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param("spilled");
+    SAS::report_event(event);
+  }
+
+  SAS::ConnectionStats stats;
+  for (int waited = 0; waited < 5000; ++waited)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    if (stats.queue_depth < 100)
+    {
+      break;
+    }
+    usleep(1000);
+  }
+  ASSERT(stats.spilled >= 4900);
+  ASSERT(stats.dropped_queue_full == 0);
+
+  // Once SAS is reachable, everything is sent in order.
+  refuse_connections = false;
+  ASSERT(fake_sas->wait_for_data_messages(5000, 5000));
+
+  std::vector<std::string> msgs = fake_sas->received();
+  uint32_t next_instance = 0;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      uint32_t instance = 0;
+      for (int jj = 24; jj < 28; ++jj)
+      {
+        instance = (instance << 8) | (uint8_t)msgs[ii][jj];
+      }
+      ASSERT(instance == next_instance);
+      ++next_instance;
+    }
+  }
+  ASSERT(next_instance == 5000);
+
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.dropped_spill_full == 0);
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+  unlink(spill_file.c_str());
+}
+
+// Get the instance ID of an event.
+uint32_t event_instance(const std::string& msg)
+{
+  uint32_t instance = 0;
+  for (int jj = 24; jj < 28; ++jj)
+  {
+    instance = (instance << 8) | (uint8_t)msg[jj];
+  }
+  return instance;
+}
+
+void test_capture_ring()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  // Use a ring small enough that it wraps several times.
+  std::string capture_file = "/tmp/sas_test_capture." + std::to_string(getpid());
+  SAS::Options options;
+  options.capture_file = capture_file;
+  options.capture_file_bytes = 16 * 1024;
+  SAS::init("capture", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param("captured");
+    SAS::report_event(event);
+  }
+  ASSERT(fake_sas->wait_for_data_messages(2000, 5000));
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+
+  // The ring holds the newest messages, in order, and the system details.
+  SASCaptureRing::Contents contents;
+  std::string error;
+  ASSERT(SASCaptureRing::load(capture_file, contents, error));
+  unlink(capture_file.c_str());
+  ASSERT(contents.system_name == "capture");
+  ASSERT(contents.resource_identifier == "resource");
+  ASSERT(contents.msgs.size() > 100);
+  ASSERT(contents.msgs.size() < 2000);
+  for (size_t ii = 0; ii < contents.msgs.size(); ++ii)
+  {
+    ASSERT(contents.msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT);
+    ASSERT(event_instance(contents.msgs[ii]) == 2000 - contents.msgs.size() + ii);
+  }
+
+  // The captured messages can be replayed.
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+  SAS::init("capture", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+  ASSERT(!SAS::report_serialized("garbage"));
+  for (size_t ii = 0; ii < contents.msgs.size(); ++ii)
+  {
+    ASSERT(SAS::report_serialized(contents.msgs[ii]));
+  }
+  ASSERT(fake_sas->wait_for_data_messages(contents.msgs.size(), 5000));
+  std::vector<std::string> msgs = fake_sas->received();
+  ASSERT(std::find(msgs.begin(), msgs.end(), contents.msgs.back()) != msgs.end());
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_file_output()
+{
+  std::string output_file = "/tmp/sas_test_output." + std::to_string(getpid());
+  ASSERT(SAS::init("system", "type", "resource", "file://" + output_file, &log_callback) == SAS_INIT_RC_OK);
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param("written to file");
+    SAS::report_event(event);
+  }
+
+  SAS::ConnectionStats stats;
+  for (int waited = 0; waited < 5000; ++waited)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    if (stats.messages_sent == 1000)
+    {
+      break;
+    }
+    usleep(1000);
+  }
+  ASSERT(stats.messages_sent == 1000);
+  SAS::term();
+
+  // The file holds the INIT message followed by the events, in order.
+  FILE* file = fopen(output_file.c_str(), "r");
+  ASSERT(file != NULL);
+  std::string data;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+  {
+    data.append(buf, len);
+  }
+  fclose(file);
+  unlink(output_file.c_str());
+
+  std::vector<std::string> msgs;
+  size_t offset = 0;
+  while (offset + 2 <= data.length())
+  {
+    size_t msg_len = ((uint8_t)data[offset] << 8) | (uint8_t)data[offset + 1];
+    ASSERT(msg_len >= 4);
+    ASSERT(offset + msg_len <= data.length());
+    msgs.push_back(data.substr(offset, msg_len));
+    offset += msg_len;
+  }
+  ASSERT(offset == data.length());
+  ASSERT(msgs.size() >= 1001);
+  ASSERT(msgs[0][3] == SasTest::FakeSas::MSG_TYPE_INIT);
+
+  uint32_t next_instance = 0;
+  for (size_t ii = 1; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      ASSERT(event_instance(msgs[ii]) == next_instance);
+      ++next_instance;
+    }
+  }
+  ASSERT(next_instance == 1000);
+
+  ASSERT(SAS::init("system", "type", "resource", "file://", &log_callback) == SAS_INIT_RC_ERR);
+}
+
+void test_replay_stream()
+{
+  // Capture a stream to a file.
+  std::string stream_file = "/tmp/sas_test_stream." + std::to_string(getpid());
+  SAS::init("replay", "type", "resource", "file://" + stream_file, &log_callback);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    SAS::Event event(1000 + (ii % 5), 222, ii);
+    SAS::report_event(event);
+  }
+  SAS::ConnectionStats stats;
+  for (int waited = 0; (waited < 5000) && (stats.messages_sent < 100); ++waited)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    usleep(1000);
+  }
+  SAS::term();
+
+  // Replay it to a fake SAS server, with new trail IDs and timestamps.
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+  SAS::init("other", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+
+  SasReplay::StreamReader reader;
+  ASSERT(reader.open(stream_file));
+  ASSERT(reader.system_name == "replay");
+  ASSERT(reader.system_type == "type");
+  ASSERT(reader.resource_identifier == "resource");
+
+  SasReplay::Rewriter rewriter(true, true);
+  SAS::Timestamp start = SAS::get_current_timestamp();
+  std::string msg;
+  int replayed = 0;
+  while (reader.next(msg))
+  {
+    rewriter.rewrite(msg);
+    ASSERT(SAS::report_serialized(msg));
+    ++replayed;
+  }
+  ASSERT(replayed == 100);
+  ASSERT(reader.truncated_bytes() == 0);
+  ASSERT(fake_sas->wait_for_data_messages(100, 5000));
+  unlink(stream_file.c_str());
+
+  // The events arrive in order.  Events that shared a trail still do, but
+  // on a new trail.
+  std::vector<std::string> msgs = fake_sas->received();
+  std::map<uint32_t, SAS::TrailId> trail_by_instance;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      uint32_t instance = event_instance(msgs[ii]);
+      ASSERT(instance == trail_by_instance.size());
+      trail_by_instance[instance] = SasReplay::read_int64(msgs[ii], SasReplay::TRAIL_OFFSET);
+      ASSERT(SasReplay::read_int64(msgs[ii], SasReplay::TIMESTAMP_OFFSET) >= start);
+    }
+  }
+  ASSERT(trail_by_instance.size() == 100);
+  for (uint32_t ii = 0; ii < 100; ++ii)
+  {
+    ASSERT(trail_by_instance[ii] == trail_by_instance[ii % 5]);
+    ASSERT((trail_by_instance[ii] < 1000) || (trail_by_instance[ii] > 1004));
+  }
+  ASSERT(trail_by_instance[0] != trail_by_instance[1]);
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_term_flushes_queue()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+  for (int ii = 0; ii < 20000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param("flushed");
+    SAS::report_event(event);
+  }
+
+  // Everything reported before term is sent.
+  SAS::term(5000);
+  ASSERT(fake_sas->wait_for_data_messages(20000, 5000));
+  ASSERT(fake_sas->data_messages() == 20000);
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+
+  // If SAS can't be reached, term gives up at the deadline.
+  refuse_connections = true;
+  SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    SAS::report_event(event);
+  }
+  uint64_t start_ms = now_ms();
+  SAS::term(200);
+  uint64_t term_ms = now_ms() - start_ms;
+  ASSERT(term_ms >= 190);
+  ASSERT(term_ms < 2000);
+  refuse_connections = false;
+
+  // Nor does it wait for a DNS lookup that's taking a long time.
+  SAS::init("system", "type", "resource", SLOW_DNS_HOST, &log_callback);
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    SAS::report_event(event);
+  }
+  start_ms = now_ms();
+  SAS::term(200);
+  term_ms = now_ms() - start_ms;
+  ASSERT(term_ms >= 190);
+  ASSERT(term_ms < 2000);
+}
+
+void test_heartbeats()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  SAS::Options options;
+  options.heartbeat_interval_ms = 100;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  // An idle connection sends a heartbeat every interval.
+  usleep(550000);
+  uint64_t idle_heartbeats = fake_sas->messages(SasTest::FakeSas::MSG_TYPE_HEARTBEAT);
+  ASSERT(idle_heartbeats >= 3);
+  ASSERT(idle_heartbeats <= 6);
+
+  // A busy one doesn't send any.
+  for (int ii = 0; ii < 25; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    SAS::report_event(event);
+    usleep(20000);
+  }
+  ASSERT(fake_sas->messages(SasTest::FakeSas::MSG_TYPE_HEARTBEAT) <= idle_heartbeats + 1);
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_server_close_detected()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  // With heartbeats off, nothing is sent while idle, so the close can only
+  // be noticed by watching the socket.
+  SAS::Options options;
+  options.heartbeat_interval_ms = 0;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  fake_sas->close_connections(false);
+  ASSERT(fake_sas->wait_for_inits(2, 1000));
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_requeue_unacked()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  // Stop SAS reading so that data builds up unacknowledged in the client's
+  // socket, then reset the connection.
+  fake_sas->set_paused(true);
+  std::string data(4096, 'x');
+  const int num_events = 2000;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+  usleep(200000);
+  fake_sas->close_connections(true);
+  fake_sas->set_paused(false);
+
+  // The unacknowledged messages are sent again on the new connection, so
+  // everything from the first of them on arrives.
+  ASSERT(fake_sas->wait_for_inits(2, 5000));
+  SAS::ConnectionStats stats;
+  for (int waited = 0; waited < 5000; ++waited)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    if (stats.messages_sent == (uint64_t)num_events)
+    {
+      break;
+    }
+    usleep(1000);
+  }
+  ASSERT(stats.requeued > 0);
+  ASSERT(stats.dropped_send_failed == 0);
+  ASSERT(stats.messages_sent == (uint64_t)num_events);
+
+  usleep(100000);
+  std::vector<std::string> msgs = fake_sas->received();
+  std::set<uint32_t> instances;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      instances.insert(event_instance(msgs[ii]));
+    }
+  }
+  ASSERT(instances.count(num_events - 1) == 1);
+  for (uint32_t ii = num_events - stats.requeued; ii < (uint32_t)num_events; ++ii)
+  {
+    ASSERT(instances.count(ii) == 1);
+  }
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_socket_tuning()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  // Cork the socket and send every batch with zerocopy.  Everything must
+  // still arrive intact and in order, and the last partial segment must be
+  // pushed out rather than held back by the cork.
+  SAS::Options options;
+  options.send_buffer_bytes = 256 * 1024;
+  options.tcp_batching = SAS::Options::TcpBatching::Cork;
+  options.notsent_lowat_bytes = 64 * 1024;
+  options.zerocopy_min_bytes = 1;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  std::string data(1000, 'x');
+  const int num_events = 2000;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+  ASSERT(fake_sas->wait_for_data_messages(num_events, 5000));
+
+  SAS::ConnectionStats stats;
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.zerocopy_sends > 0);
+
+  std::vector<std::string> msgs = fake_sas->received();
+  uint32_t next_instance = 0;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      ASSERT(event_instance(msgs[ii]) == next_instance);
+      ASSERT(msgs[ii].find(data) != std::string::npos);
+      ++next_instance;
+    }
+  }
+  ASSERT(next_instance == (uint32_t)num_events);
+
+  SAS::term(1000);
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_io_uring_backend()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  // Where io_uring isn't available this falls back to epoll, which must
+  // behave the same.
+  SAS::Options options;
+  options.send_backend = SAS::Options::SendBackend::IoUring;
+  options.heartbeat_interval_ms = 100;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  std::string data(1000, 'x');
+  const int num_events = 2000;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+  ASSERT(fake_sas->wait_for_data_messages(num_events, 5000));
+
+  std::vector<std::string> msgs = fake_sas->received();
+  uint32_t next_instance = 0;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      ASSERT(event_instance(msgs[ii]) == next_instance);
+      ++next_instance;
+    }
+  }
+  ASSERT(next_instance == (uint32_t)num_events);
+
+  // Heartbeats are sent while idle, and SAS closing the connection is
+  // noticed, after which everything carries on over a new connection.
+  usleep(350000);
+  ASSERT(fake_sas->messages(SasTest::FakeSas::MSG_TYPE_HEARTBEAT) >= 2);
+  fake_sas->close_connections(false);
+  ASSERT(fake_sas->wait_for_inits(2, 1000));
+
+  SAS::Event event(1, 222, num_events);
+  SAS::report_event(event);
+  ASSERT(fake_sas->wait_for_data_messages(num_events + 1, 1000));
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_queue_options()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  // With SAS not reading, a small queue (and a writer that only takes one
+  // message off it at a time) fills up and discards messages.
+  SAS::Options options;
+  options.max_queue_depth = 100;
+  options.max_pending_bytes = 1;
+  options.max_batch_msgs = 1;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+  fake_sas->set_paused(true);
+
+  std::string data(4096, 'x');
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+
+  SAS::ConnectionStats stats;
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.dropped_queue_full > 0);
+  ASSERT(stats.queue_high_water <= 100);
+
+  fake_sas->set_paused(false);
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_invalid_compression_options()
+{
+  // Out-of-range compression options are rejected by init...
+  SAS::Options options;
+  options.zlib_window_bits = 20;
+  ASSERT(SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket) == SAS_INIT_RC_ERR);
+  options = SAS::Options();
+  options.lz4_acceleration = 0;
+  ASSERT(SAS::init("system", "type", "resource", "0.0.0.0", options, &log_callback) == SAS_INIT_RC_ERR);
+
+  // ...and by reconfigure, which leaves the library running.
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+  ASSERT(SAS::init("system", "type", "resource", "127.0.0.1", &log_callback, &create_socket) == SAS_INIT_RC_OK);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+  options = SAS::Options();
+  options.zlib_mem_level = 0;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_ERR);
+  options = SAS::Options();
+  options.zlib_level = 10;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_ERR);
+
+  SAS::Event event(1, 222, 1);
+  SAS::report_event(event);
+  ASSERT(fake_sas->wait_for_data_messages(1, 5000));
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+void test_reconfigure()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  fake_sas_2 = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+  ASSERT(fake_sas_2->start());
+
+  SAS::Options options;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_ERR);
+  SAS::init("system", "type", "resource", "sas1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+  ASSERT(SAS::reconfigure(options, "sas1, sas2") == SAS_INIT_RC_ERR);
+  ASSERT(SAS::reconfigure(options, " , ") == SAS_INIT_RC_ERR);
+
+  // Move to the second server while the first isn't reading.  What the
+  // first hadn't acknowledged is sent to the second, along with the rest of
+  // the queue.
+  fake_sas->set_paused(true);
+  std::string data(4096, 'x');
+  const int num_events = 2000;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+  usleep(200000);
+  ASSERT(SAS::reconfigure(options, "sas2") == SAS_INIT_RC_OK);
+  ASSERT(fake_sas_2->wait_for_inits(1, 5000));
+  ASSERT(fake_sas_2->wait_for_data_messages(1, 5000));
+
+  SAS::ConnectionStats stats;
+  for (int waited = 0; waited < 5000; ++waited)
+  {
+    ASSERT(SAS::get_connection_stats(stats));
+    if (stats.messages_sent == (uint64_t)num_events)
+    {
+      break;
+    }
+    usleep(1000);
+  }
+  ASSERT(stats.requeued > 0);
+  ASSERT(stats.messages_sent == (uint64_t)num_events);
+  ASSERT(fake_sas->messages(SasTest::FakeSas::MSG_TYPE_INIT) == 1);
+
+  usleep(100000);
+  std::vector<std::string> msgs = fake_sas_2->received();
+  std::set<uint32_t> instances;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      instances.insert(event_instance(msgs[ii]));
+    }
+  }
+  for (uint32_t ii = num_events - stats.requeued; ii < (uint32_t)num_events; ++ii)
+  {
+    ASSERT(instances.count(ii) == 1);
+  }
+
+  // With a sample rate of zero, events are discarded but associations are
+  // still sent.
+  uint64_t received = fake_sas_2->data_messages();
+  options.trail_sample_rate = 0.0;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_OK);
+  report_events(100, 1);
+  SAS::associate_trails(1, 2);
+  options.trail_sample_rate = 1.0;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_OK);
+  SAS::Event event(1, 222, num_events);
+  SAS::report_event(event);
+  ASSERT(fake_sas_2->wait_for_data_messages(received + 2, 5000));
+  usleep(100000);
+  ASSERT(fake_sas_2->data_messages() == received + 2);
+
+  // Shrinking the queue makes it discard messages while SAS isn't reading.
+  options.max_queue_depth = 100;
+  ASSERT(SAS::reconfigure(options) == SAS_INIT_RC_OK);
+  fake_sas_2->set_paused(true);
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(data);
+    SAS::report_event(event);
+  }
+  ASSERT(SAS::get_connection_stats(stats));
+  ASSERT(stats.dropped_queue_full > 0);
+
+  fake_sas->set_paused(false);
+  fake_sas_2->set_paused(false);
+  term_two_servers();
+}
+
+// Find the ID of this process's thread with the given name, or 0 if there
+// isn't one.
+pid_t find_thread(const std::string& name)
+{
+  pid_t tid = 0;
+  DIR* dir = opendir("/proc/self/task");
+  struct dirent* entry;
+  while ((dir != NULL) && (tid == 0) && ((entry = readdir(dir)) != NULL))
+  {
+    std::string comm;
+    std::ifstream file(std::string("/proc/self/task/") + entry->d_name + "/comm");
+    if ((std::getline(file, comm)) && (comm == name))
+    {
+      tid = atoi(entry->d_name);
+    }
+  }
+  if (dir != NULL)
+  {
+    closedir(dir);
+  }
+  return tid;
+}
+
+void test_writer_thread_options()
+{
+  fake_sas = new SasTest::FakeSas();
+  ASSERT(fake_sas->start());
+
+  SAS::Options options;
+  options.writer_cpus.push_back(0);
+  options.writer_thread_name = "sas-test";
+  options.writer_sched_policy = SAS::Options::SchedPolicy::Batch;
+  options.writer_nice = 5;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(fake_sas->wait_for_inits(1, 5000));
+
+  pid_t tid = find_thread("sas-test-0");
+  ASSERT(tid != 0);
+  if (tid != 0)
+  {
+    cpu_set_t cpus;
+    ASSERT(sched_getaffinity(tid, sizeof(cpus), &cpus) == 0);
+    ASSERT(CPU_COUNT(&cpus) == 1);
+    ASSERT(CPU_ISSET(0, &cpus));
+    ASSERT(sched_getscheduler(tid) == SCHED_BATCH);
+    ASSERT(getpriority(PRIO_PROCESS, tid) >= 5);
+  }
+
+  SAS::term();
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+
+// Run an application's event loop for the library for up to the timeout,
+// until the condition holds.
+bool poll_until(std::function<bool()> condition, int timeout_ms)
+{
+  int epoll_fd = epoll_create1(0);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, SAS::get_poll_fd(), &ev);
+
+  bool done = condition();
+  for (int waited = 0; (!done) && (waited < timeout_ms); waited += 10)
+  {
+    struct epoll_event event;
+    if (epoll_wait(epoll_fd, &event, 1, 10) > 0)
+    {
+      SAS::poll_once();
+    }
+    done = condition();
+  }
+
+  ::close(epoll_fd);
+  return done;
+}
+
+void test_application_driven()
+{
+  fake_sas = new SasTest::FakeSas("127.0.0.1", true);
+  ASSERT(fake_sas->start());
+
+  SAS::Options options;
+  options.application_driven = true;
+  options.heartbeat_interval_ms = 100;
+  SAS::init("system", "type", "resource", "127.0.0.1", options, &log_callback, &create_socket);
+  ASSERT(SAS::get_poll_fd() >= 0);
+  ASSERT(find_thread("sas-writer-0") == 0);
+
+  // Nothing happens until the application polls.
+  usleep(100000);
+  ASSERT(fake_sas->messages(SasTest::FakeSas::MSG_TYPE_INIT) == 0);
+  ASSERT(poll_until([]{ return fake_sas->messages(SasTest::FakeSas::MSG_TYPE_INIT) == 1; }, 5000));
+
+  const int num_events = 1000;
+  for (int ii = 0; ii < num_events; ++ii)
+  {
+    SAS::Event event(1, 222, ii);
+    event.add_var_param(std::string(1000, 'x'));
+    SAS::report_event(event);
+  }
+  SAS::flush();
+  ASSERT(poll_until([]{ return SAS::flush() && (fake_sas->data_messages() == num_events); }, 5000));
+
+  std::vector<std::string> msgs = fake_sas->received();
+  uint32_t next_instance = 0;
+  for (size_t ii = 0; ii < msgs.size(); ++ii)
+  {
+    if (msgs[ii][3] == SasTest::FakeSas::MSG_TYPE_EVENT)
+    {
+      ASSERT(event_instance(msgs[ii]) == next_instance);
+      ++next_instance;
+    }
+  }
+  ASSERT(next_instance == (uint32_t)num_events);
+
+  // The poll fd wakes the application for heartbeats, and for SAS closing
+  // the connection, after which it reconnects.
+  ASSERT(poll_until([]{ return fake_sas->messages(SasTest::FakeSas::MSG_TYPE_HEARTBEAT) >= 2; }, 1000));
+  fake_sas->close_connections(false);
+  ASSERT(poll_until([]{ return fake_sas->messages(SasTest::FakeSas::MSG_TYPE_INIT) == 2; }, 1000));
+
+  // Terminating sends what's still pending.
+  SAS::Event event(1, 222, num_events);
+  SAS::report_event(event);
+  SAS::term(1000);
+  ASSERT(fake_sas->wait_for_data_messages(num_events + 1, 1000));
+
+  fake_sas->stop();
+  delete fake_sas; fake_sas = NULL;
+}
+} // namespace ConnectionTest
+
 int main(int argc, char *argv[])
 {
   RUN_TEST(EventTest::test_empty);
@@ -453,6 +1799,37 @@ int main(int argc, char *argv[])
   RUN_TEST(AnalyticsTest::test_json_no_store);
   RUN_TEST(AnalyticsTest::test_xml_with_store);
 
+  RUN_TEST(HistogramTest::test_small_values_exact);
+  RUN_TEST(HistogramTest::test_percentile_accuracy);
+  RUN_TEST(HistogramTest::test_bucket_bounds);
+  RUN_TEST(HistogramTest::test_delta);
+
+  RUN_TEST(TrailTest::test_unique_across_threads);
+
+  RUN_TEST(ConnectionTest::test_connection_stats);
+  RUN_TEST(ConnectionTest::test_send_lockup);
+  RUN_TEST(ConnectionTest::test_sharded_destinations);
+  RUN_TEST(ConnectionTest::test_replicated_destinations);
+  RUN_TEST(ConnectionTest::test_multiple_connections_per_address);
+  RUN_TEST(ConnectionTest::test_reconnect_backoff);
+  RUN_TEST(ConnectionTest::test_term_while_connecting);
+  RUN_TEST(ConnectionTest::test_ipv6);
+  RUN_TEST(ConnectionTest::test_spill_to_disk);
+  RUN_TEST(ConnectionTest::test_capture_ring);
+  RUN_TEST(ConnectionTest::test_file_output);
+  RUN_TEST(ConnectionTest::test_replay_stream);
+  RUN_TEST(ConnectionTest::test_term_flushes_queue);
+  RUN_TEST(ConnectionTest::test_heartbeats);
+  RUN_TEST(ConnectionTest::test_server_close_detected);
+  RUN_TEST(ConnectionTest::test_requeue_unacked);
+  RUN_TEST(ConnectionTest::test_socket_tuning);
+  RUN_TEST(ConnectionTest::test_io_uring_backend);
+  RUN_TEST(ConnectionTest::test_queue_options);
+  RUN_TEST(ConnectionTest::test_invalid_compression_options);
+  RUN_TEST(ConnectionTest::test_reconfigure);
+  RUN_TEST(ConnectionTest::test_writer_thread_options);
+  RUN_TEST(ConnectionTest::test_application_driven);
+
   if (failures == 0)
   {
     std::cout << std::endl << "All tests passed" << std::endl;
@@ -38,6 +38,33 @@
 #include "sastestutil.h"
 #include "lz4.h"
 
+#include <dlfcn.h>
+#include <zlib.h>
+
+// Set to make setting up zlib compressors fail.
+bool fail_deflate_init = false;
+
+// Stands in for zlib's deflateInit2_ (which deflateInit2 expands to), so that
+// tests can make it fail.
+extern "C" int deflateInit2_(z_streamp strm,
+                             int level,
+                             int method,
+                             int window_bits,
+                             int mem_level,
+                             int strategy,
+                             const char* version,
+                             int stream_size)
+{
+  if (fail_deflate_init)
+  {
+    return Z_MEM_ERROR;
+  }
+
+  typedef int (*deflate_init_fn)(z_streamp, int, int, int, int, int, const char*, int);
+  static deflate_init_fn real_deflate_init = (deflate_init_fn)dlsym(RTLD_NEXT, "deflateInit2_");
+  return real_deflate_init(strm, level, method, window_bits, mem_level, strategy, version, stream_size);
+}
+
 //
 // Compression tests.
 //
@@ -186,6 +213,103 @@ void test_large_data()
 }
 
 
+// Test that compression time is recorded when statistics are enabled.
+void test_compression_stats()
+{
+  SAS::Options options;
+  options.stats_enabled = true;
+  SAS::init("system", "type", "resource", "0.0.0.0", options, NULL);
+
+  SAS::Stats before;
+  SAS::get_stats(before);
+
+  SAS::Event event(1, 2, 3);
+  event.add_compressed_param("hello world\n");
+  event.add_compressed_param("hello world\n", &lz4_profile);
+
+  SAS::Stats after;
+  SAS::get_stats(after);
+  SAS::term();
+
+  ASSERT(after.compress.count() == before.compress.count() + 2);
+  ASSERT(after.compress.max() > 0);
+}
+
+// Compress on a new thread, as each thread's compressors are set up with the
+// options in force when it first compresses.
+void* compress_with_options(void* p)
+{
+  std::vector<std::string>* params = (std::vector<std::string>*)p;
+
+  // Incompressible data, which LZ4 needs more than 4096 bytes of buffer for.
+  std::string random_data;
+  uint64_t x = 88172645463325252ull;
+  for (int ii = 0; ii < 8192; ++ii)
+  {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    random_data += (char)x;
+  }
+
+  SAS::Event event(1, 2, 3);
+  event.add_compressed_param(std::string(1000, 'a'));
+  event.add_compressed_param(random_data, &lz4_profile);
+  SasTest::Event parsed;
+  parsed.parse(event.to_string());
+  *params = parsed.var_params;
+  return NULL;
+}
+
+void log_callback(SAS::sas_log_level_t level,
+                  int32_t log_id_len,
+                  unsigned char* log_id,
+                  int32_t sas_ip_len,
+                  unsigned char* sas_ip,
+                  int32_t msg_len,
+                  unsigned char* msg)
+{
+}
+
+// Test that the compression options are applied.
+void test_compression_options()
+{
+  SAS::Options options;
+  options.zlib_level = 0;
+  options.lz4_max_buffer_bytes = 4096;
+  SAS::init("system", "type", "resource", "0.0.0.0", options, &log_callback);
+
+  std::vector<std::string> params;
+  pthread_t thread;
+  ASSERT(pthread_create(&thread, NULL, compress_with_options, &params) == 0);
+  pthread_join(thread, NULL);
+  SAS::term();
+
+  // Level 0 stores the data uncompressed, and the LZ4 output doesn't fit in
+  // the buffer so is dropped.
+  ASSERT(params.size() == 2);
+  ASSERT(params[0].length() > 1000);
+  ASSERT(params[1].empty());
+}
+
+// Test that if a compressor can't be set up, parameters are sent empty
+// rather than uncompressed (which SAS would fail to decompress).
+void test_compressor_setup_failure()
+{
+  // Initializing the library makes each thread set up new compressors.
+  fail_deflate_init = true;
+  SAS::init("system", "type", "resource", "0.0.0.0", &log_callback);
+
+  SAS::Event event(1, 2, 3);
+  event.add_compressed_param("hello world\n");
+  SasTest::Event parsed;
+  parsed.parse(event.to_string());
+
+  fail_deflate_init = false;
+  SAS::term();
+
+  ASSERT(parsed.var_params.size() == 1);
+  ASSERT(parsed.var_params[0].empty());
+}
+
 } // namespace CompressionTest
 
 int main(int argc, char *argv[])
@@ -196,6 +320,9 @@ int main(int argc, char *argv[])
   RUN_TEST(CompressionTest::test_dictionary_lz4);
   RUN_TEST(CompressionTest::test_empty);
   RUN_TEST(CompressionTest::test_large_data);
+  RUN_TEST(CompressionTest::test_compression_stats);
+  RUN_TEST(CompressionTest::test_compression_options);
+  RUN_TEST(CompressionTest::test_compressor_setup_failure);
 
   if (failures == 0)
   {